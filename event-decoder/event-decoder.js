@@ -32,176 +32,20 @@ particle.listDevices({ auth:config.get('AUTH_TOKEN') }).then(
 					
 					var deviceName = deviceIdToName[event.coreid] || event.coreid;
 
-					var events = event.data.split(';');
-					
-					for(var ii = 0; ii < events.length; ii++) {
-						
-						var fields = events[ii].split(',');
-						
-						if (fields.length == 4) {
-							var dateMillis = parseInt(fields[0], 10) * 1000;							
-							var dateStr = ((dateMillis != 0) ? new Date(dateMillis).toISOString() : "no date"); 
-							var millisStr = fields[1];
-							var eventCode = parseInt(fields[2], 10);
-
-							var data = parseInt(fields[3], 10);
-														
-							switch(eventCode) {
-							case 0:
-								msg = 'SETUP_STARTED';
-								break;
-								
-							case 1:
-								msg = 'CELLULAR_READY ' + (data ? 'connected' : 'disconnected');
-								break;
-								
-							case 2:
-								msg = 'CLOUD_CONNECTED ' + (data ? 'connected' : 'disconnected');
-								break;
-								
-							case 3:
-								msg = 'LISTENING_ENTERED';
-								break;
-								
-							case 4:
-								msg = 'MODEM_RESET';
-								break;
-							
-							case 5:
-								msg = 'REBOOT_LISTENING';
-								break;
-								
-							case 6:
-								msg = 'REBOOT_NO_CLOUD';
-								break;
-
-							case 7:
-								msg = 'PING_DNS ' + (data ? 'success' : 'failed');
-								break;
-
-							case 8:
-								msg = 'PING_API ' + (data ? 'success' : 'failed');
-								break;
-
-							case 9:
-								msg = 'APP_WATCHDOG';
-								break;
-
-							case 10:
-								msg = 'TESTER_RESET';
-								break;
-
-							case 11:
-								msg = 'TESTER_APP_WATCHDOG';
-								break;
-
-							case 12:
-								msg = 'TESTER_SLEEP';
-								break;
-
-							case 13:
-								msg = 'LOW_BATTERY_SLEEP';
-								break;
-
-							case 14:
-								msg = 'SESSION_EVENT_LOST';
-								break;
-
-							case 15:
-								msg = 'SESSION_RESET';
-								break;
-
-							case 16:
-								msg = 'TESTER_RESET_SESSION';
-								break;
-
-							case 17:
-								msg = 'TESTER_RESET_MODEM';
-								break;
-
-							case 18:
-								msg = 'RESET_REASON ';
-								switch(data) {
-								case 0:
-									msg += 'RESET_REASON_NONE';
-									break;
-
-								case 10:
-									msg += 'RESET_REASON_UNKNOWN';
-									break;
-
-								case 20:
-									msg += 'RESET_REASON_PIN_RESET';
-									break;
-
-								case 30:
-									msg += 'RESET_REASON_POWER_MANAGEMENT';
-									break;
-
-								case 40:
-									msg += 'RESET_REASON_POWER_DOWN';
-									break;
-
-								case 50:
-									msg += 'RESET_REASON_POWER_BROWNOUT';
-									break;
-
-								case 60:
-									msg += 'RESET_REASON_WATCHDOG';
-									break;
-
-								case 70:
-									msg += 'RESET_REASON_UPDATE';
-									break;
-
-								case 80:
-									msg += 'RESET_REASON_UPDATE_ERROR';
-									break;
-
-								case 90:
-									msg += 'RESET_REASON_UPDATE_TIMEOUT';
-									break;
-
-								case 100:
-									msg += 'RESET_REASON_FACTORY_RESET';
-									break;
-
-								case 110:
-									msg += 'RESET_REASON_SAFE_MODE';
-									break;
-
-								case 120:
-									msg += 'RESET_REASON_DFU_MODE';
-									break;
-
-								case 130:
-									msg += 'RESET_REASON_PANIC';
-									break;
-
-								case 140:
-									msg += 'RESET_REASON_USER';
-									break;
-								}
-								break;
-								
-							case 19:
-								msg = 'TESTER_SAFE_MODE';
-								break;
-
-							case 20:
-								msg = 'TESTER_PING ' + data;
-								break;
-								
-							case 21:
-								msg = 'STOP_SLEEP_WAKE';
-								break;
-								
-							case 22:
-								msg = 'FAILURE_SLEEP';
-								break;
-							}
-							console.log(deviceName + ',' + dateStr + ',' + millisStr + ',' + msg);
-						}
+					var records;
+					if (event.data.charAt(0) == '~') {
+						records = decodeCompact(event.data.substr(1));
+					}
+					else {
+						records = decodeText(event.data);
+					}
+
+					for(var ii = 0; ii < records.length; ii++) {
+						var rec = records[ii];
+						var dateMillis = rec.tsDate * 1000;
+						var dateStr = ((dateMillis != 0) ? new Date(dateMillis).toISOString() : "no date"); 
+
+						console.log(deviceName + ',' + dateStr + ',' + rec.tsMillis + ',' + eventToString(rec.eventCode, rec.data));
 					}
 				});
 			},
@@ -215,5 +59,359 @@ particle.listDevices({ auth:config.get('AUTH_TOKEN') }).then(
 	}
 );
 
+// Text encoding: tsDate,tsMillis,eventCode,data; repeated
+function decodeText(str) {
+	var records = [];
+	var events = str.split(';');
+
+	for(var ii = 0; ii < events.length; ii++) {
+		var fields = events[ii].split(',');
+
+		if (fields.length == 4) {
+			records.push({
+				tsDate: parseInt(fields[0], 10),
+				tsMillis: parseInt(fields[1], 10),
+				eventCode: parseInt(fields[2], 10),
+				data: parseInt(fields[3], 10)
+			});
+		}
+	}
+	return records;
+}
+
+// Compact encoding (ConnectionEvents::ENCODING_COMPACT), after removing the leading ~
+// Z85 (base85) encoded binary data containing 4 varints per record:
+// zigzag(delta tsDate), zigzag(delta tsMillis), eventCode, zigzag(data)
+function decodeCompact(str) {
+	var bytes = z85Decode(str);
+	var records = [];
+	var offset = 0;
+	var prevDate = 0, prevMillis = 0;
+
+	function readVarint() {
+		var value = 0, mult = 1, b;
+		do {
+			if (offset >= bytes.length) {
+				throw new Error('truncated varint');
+			}
+			b = bytes[offset++];
+			value += (b & 0x7f) * mult;
+			mult *= 128;
+		} while(b & 0x80);
+		return value >>> 0;
+	}
+
+	function unzigzag(value) {
+		return (value >>> 1) ^ -(value & 1);
+	}
+
+	try {
+		while(offset < bytes.length) {
+			var tsDate = (prevDate + unzigzag(readVarint())) >>> 0;
+			var tsMillis = (prevMillis + unzigzag(readVarint())) >>> 0;
+			var eventCode = readVarint();
+			var data = unzigzag(readVarint());
+
+			records.push({ tsDate:tsDate, tsMillis:tsMillis, eventCode:eventCode, data:data });
+			prevDate = tsDate;
+			prevMillis = tsMillis;
+		}
+	}
+	catch(e) {
+		console.log('malformed compact event data', e.message);
+	}
+	return records;
+}
+
+function z85Decode(str) {
+	var alphabet = '0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#';
+	var bytes = [];
+
+	for(var ii = 0; ii < str.length; ii += 5) {
+		var group = str.substr(ii, 5);
+		var numBytes = group.length - 1;
+
+		// A partial group of n bytes was sent as n + 1 characters; pad with the highest digit
+		var value = 0;
+		for(var jj = 0; jj < 5; jj++) {
+			var digit = (jj < group.length) ? alphabet.indexOf(group.charAt(jj)) : 84;
+			value = value * 85 + digit;
+		}
+		for(var jj = 0; jj < numBytes; jj++) {
+			bytes.push(Math.floor(value / Math.pow(256, 3 - jj)) % 256);
+		}
+	}
+	return bytes;
+}
+
+function eventToString(eventCode, data) {
+	var msg = '';
 
+	switch(eventCode) {
+	case 0:
+		msg = 'SETUP_STARTED';
+		break;
+		
+	case 1:
+		msg = 'CELLULAR_READY ' + (data ? 'connected' : 'disconnected');
+		break;
+		
+	case 2:
+		msg = 'CLOUD_CONNECTED ' + (data ? 'connected' : 'disconnected');
+		break;
+		
+	case 3:
+		msg = 'LISTENING_ENTERED';
+		break;
+		
+	case 4:
+		msg = 'MODEM_RESET';
+		break;
+	
+	case 5:
+		msg = 'REBOOT_LISTENING';
+		break;
+		
+	case 6:
+		msg = 'REBOOT_NO_CLOUD';
+		break;
+
+	case 7:
+		// data is the number of replies received
+		msg = 'PING_DNS ' + ((data > 0) ? 'success' : 'failed');
+		break;
+
+	case 8:
+		msg = 'PING_API ' + ((data > 0) ? 'success' : 'failed');
+		break;
+
+	case 9:
+		msg = 'APP_WATCHDOG';
+		break;
+
+	case 10:
+		msg = 'TESTER_RESET';
+		break;
+
+	case 11:
+		msg = 'TESTER_APP_WATCHDOG';
+		break;
+
+	case 12:
+		msg = 'TESTER_SLEEP';
+		break;
+
+	case 13:
+		msg = 'LOW_BATTERY_SLEEP';
+		break;
+
+	case 14:
+		msg = 'SESSION_EVENT_LOST';
+		break;
+
+	case 15:
+		msg = 'SESSION_RESET';
+		break;
+
+	case 16:
+		msg = 'TESTER_RESET_SESSION';
+		break;
+
+	case 17:
+		msg = 'TESTER_RESET_MODEM';
+		break;
+
+	case 18:
+		msg = 'RESET_REASON ';
+		switch(data) {
+		case 0:
+			msg += 'RESET_REASON_NONE';
+			break;
+
+		case 10:
+			msg += 'RESET_REASON_UNKNOWN';
+			break;
+
+		case 20:
+			msg += 'RESET_REASON_PIN_RESET';
+			break;
+
+		case 30:
+			msg += 'RESET_REASON_POWER_MANAGEMENT';
+			break;
+
+		case 40:
+			msg += 'RESET_REASON_POWER_DOWN';
+			break;
+
+		case 50:
+			msg += 'RESET_REASON_POWER_BROWNOUT';
+			break;
+
+		case 60:
+			msg += 'RESET_REASON_WATCHDOG';
+			break;
+
+		case 70:
+			msg += 'RESET_REASON_UPDATE';
+			break;
+
+		case 80:
+			msg += 'RESET_REASON_UPDATE_ERROR';
+			break;
+
+		case 90:
+			msg += 'RESET_REASON_UPDATE_TIMEOUT';
+			break;
+
+		case 100:
+			msg += 'RESET_REASON_FACTORY_RESET';
+			break;
+
+		case 110:
+			msg += 'RESET_REASON_SAFE_MODE';
+			break;
+
+		case 120:
+			msg += 'RESET_REASON_DFU_MODE';
+			break;
+
+		case 130:
+			msg += 'RESET_REASON_PANIC';
+			break;
+
+		case 140:
+			msg += 'RESET_REASON_USER';
+			break;
+		}
+		break;
+		
+	case 19:
+		msg = 'TESTER_SAFE_MODE';
+		break;
 
+	case 20:
+		msg = 'TESTER_PING ' + data;
+		break;
+		
+	case 21:
+		msg = 'STOP_SLEEP_WAKE';
+		break;
+		
+	case 22:
+		msg = 'FAILURE_SLEEP';
+		break;
+
+	case 23:
+		msg = 'PING_DNS_RTT ' + pingResultToString(data);
+		break;
+
+	case 24:
+		msg = 'PING_API_RTT ' + pingResultToString(data);
+		break;
+
+	case 25:
+		// ConnectionCheck::RecoveryAction in the low 8 bits, step number above that
+		var actions = ['SESSION_RESTART', 'CELLULAR_CYCLE', 'MODEM_RESET', 'SLEEP'];
+		msg = 'RECOVERY_STEP ' + (data >>> 8) + ' ' + (actions[data & 0xff] || (data & 0xff));
+		break;
+
+	case 26:
+		msg = 'SESSION_DEGRADED ' + sessionResultToString(data);
+		break;
+
+	case 27:
+		// ConnectionEvents::packRepeat(). The timestamp is the last repeat; the first is the
+		// original record before this one.
+		msg = 'REPEAT x' + (data & 0xffff) + ' ' + eventToString((data >>> 24) & 0xff, (data >>> 16) & 0xff);
+		break;
+
+	case 28:
+		msg = 'TESTER_LOAD ' + data;
+		break;
+
+	case 29:
+		msg = 'TESTER_LOAD_ENQUEUED ' + data;
+		break;
+
+	case 30:
+		msg = 'TESTER_LOAD_DROPPED ' + data;
+		break;
+
+	case 31:
+		msg = 'TESTER_LOAD_PUBLISHED ' + data;
+		break;
+
+	case 32:
+		msg = 'TESTER_LOAD_BYTES ' + data;
+		break;
+
+	case 33:
+		// Tester::reportCommandQueue()
+		msg = 'TESTER_QUEUE maxDepth=' + (data & 0xff) + ' dropped=' + (data >>> 8);
+		break;
+
+	case 34:
+		msg = 'BATTERY_SLEEP ' + batterySleepToString(data);
+		break;
+
+	case 35:
+		msg = 'POWER_TIER ' + powerTierToString(data);
+		break;
+
+	case 36:
+		// LoopProfiler::packSlowLoop()
+		msg = 'SLOW_LOOP module=' + ((data >>> 24) & 0xff) + ' ' + (data & 0xffffff) + 'ms';
+		break;
+
+	case 37:
+		msg = 'HEARTBEAT_STALL ' + heartbeatStallToString(data);
+		break;
+	}
+	return msg;
+}
+
+// BatteryCheck::packSleepPlan()
+function batterySleepToString(data) {
+	var rate = data >> 16;
+
+	return (data & 0x7fff) + 'min rate=' + ((rate == -32768) ? 'unknown' : ((rate / 100).toFixed(2) + '%/h')) +
+		((data & 0x8000) ? ' predicted' : '');
+}
+
+// PowerState::update()
+function powerTierToString(data) {
+	var tiers = ['NORMAL', 'CONSERVE', 'LOW', 'CRITICAL'];
+	var tierName = function(tier) {
+		return (tier < tiers.length) ? tiers[tier] : tier.toString();
+	};
+
+	return tierName(data & 0xff) + ' from ' + tierName((data >>> 8) & 0xff) + ' soc=' + ((data >>> 16) & 0xff) + '%';
+}
+
+// HeartbeatWatchdog::packStall()
+function heartbeatStallToString(data) {
+	var channel = (data >>> 24) & 0xff;
+	var stage = (data >>> 16) & 0xff;
+
+	return 'channel=' + ((channel >= 32) ? ('user' + (channel - 32)) : channel) +
+		' stage=' + ((stage == 0xff) ? 'none' : stage) + ' ' + ((data & 0xffff) / 10).toFixed(1) + 's';
+}
+
+// SessionCheck::packProbeResult()
+function sessionResultToString(data) {
+	var value = data >>> 0;
+
+	return 'rtt=' + (value & 0xffff) + 'ms received=' + ((value >>> 24) & 0xf) + '/' + ((value >>> 28) & 0xf) +
+		' lossAverage=' + ((value >>> 16) & 0xff) + '%';
+}
+
+// ConnectionCheck::packPingResult()
+function pingResultToString(data) {
+	var value = data >>> 0;
+	var sent = (value >>> 28) & 0xf;
+	var received = (value >>> 24) & 0xf;
+
+	return 'rtt=' + (value & 0xffff) + 'ms ttl=' + ((value >>> 16) & 0xff) +
+		' received=' + received + '/' + sent + ' loss=' + (sent ? Math.round(100 * (sent - received) / sent) : 0) + '%';
+}
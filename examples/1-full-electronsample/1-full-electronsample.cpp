@@ -8,8 +8,15 @@
 
 #include "AppWatchdogWrapper.h"
 #include "BatteryCheck.h"
+#include "Breadcrumbs.h"
 #include "ConnectionCheck.h"
 #include "ConnectionEvents.h"
+#include "ConnectionEventSpool.h"
+#include "HeartbeatWatchdog.h"
+#include "LoopProfiler.h"
+#include "ModuleScheduler.h"
+#include "PowerState.h"
+#include "PublishScheduler.h"
 #include "SessionCheck.h"
 #include "Tester.h"
 
@@ -37,10 +44,29 @@ SYSTEM_THREAD(ENABLED);
 SYSTEM_MODE(SEMI_AUTOMATIC);
 
 
+// Runs each of the modules below only when it has something to do, instead of on every loop.
+ModuleScheduler moduleScheduler;
+
+// Keeps a trail of what the modules were doing in retained memory, and publishes it after a panic
+// or a watchdog reset.
+Breadcrumbs breadcrumbs;
+
+// Measures how long each module's loop() takes and publishes a summary every 6 hours, so you can
+// see if one is holding up your own code in loop().
+LoopProfiler loopProfiler;
+
+// Shares the Particle.publish rate limit (1 per second, bursts of up to 4) between all of the
+// modules so together they don't exceed it and have events dropped.
+PublishScheduler publishScheduler;
+
 // Manage connection-related events with this object. Publish with the event name "connEventStats" and store up to 32 events
 // in retained memory. This provides better visibility into what your Electron is using but doesn't use too much data.
 ConnectionEvents connectionEvents("connEventStats");
 
+// When the retained event log fills up while offline, the oldest events are moved to EEPROM instead
+// of being discarded. Uses the whole EEPROM; pass an offset and length if your app uses EEPROM too.
+ConnectionEventSpool connectionEventSpool;
+
 // Check session by sending and receiving an event every hour. This can help troubleshoot problems where
 // your Electron is online but not communicating
 SessionCheck sessionCheck(3600);
@@ -53,15 +79,27 @@ ConnectionCheck connectionCheck;
 // testerFn is the function and and the second parameter that's a pin to test pin sleep modes.
 Tester tester("testerFn", D2);
 
-// BatteryCheck is used to put the device to sleep immediately when the battery is low.
-// 15.0 is the minimum SoC, if it's lower than that and not externally powered, it will
-// sleep for the number of seconds in the second parameter, in this case, 3600 seconds = 1 hour.
+// BatteryCheck is used to put the device to sleep when the battery is low. 15.0 is the minimum
+// SoC; below that, or if it's draining fast enough to get there before the next check, the device
+// sleeps. How long is based on the trend of the SoC: while charging, until it's projected to be
+// back above the minimum plus the hysteresis, while still draining, half of the projected time
+// until it's empty, and otherwise for the longest time allowed by withSleepRange() (6 hours by
+// default). The second parameter, 3600 seconds = 1 hour, is only used until there are enough
+// samples for a trend.
 BatteryCheck batteryCheck(15.0, 3600);
 
+// The other modules save power gradually as the battery runs down: session checks are further
+// apart, connection events are batched, and so on. BatteryCheck sets the tier.
+PowerState powerState;
+
 // This is a wrapper around the ApplicationWatchdog. It just makes using it easier. It writes
 // a ConnectionEvents event to retained memory then does System.reset().
 AppWatchdogWrapper watchdog(60000);
 
+// Resets if a module's loop() doesn't return within 20 seconds, before the application watchdog
+// would, and logs which module it was.
+HeartbeatWatchdog heartbeatWatchdog;
+
 //
 //
 //
@@ -76,16 +114,42 @@ void setup() {
 	// Electron won't continuously try and fail to connect, depleting the battery.
 	// connectionCheck.withFailureSleepSec(15 * 60);
 
+	// First, so the trail from before a crash is saved before anything adds to it
+	breadcrumbs.setup();
+
+	publishScheduler.setup();
+
 	// We store connection events in retained memory. Do this early because things like batteryCheck will generate events.
+	connectionEventSpool.setup();
+	connectionEvents.withSpool(connectionEventSpool);
 	connectionEvents.setup();
 
 	// Check if there's sufficient battery power. If not, go to sleep immediately, before powering up the modem.
+	powerState.setup();
 	batteryCheck.setup();
 
 	// Set up the other modules
+	// Check every 2 hours while checks succeed, down to every 15 minutes after failures. Send 3
+	// probes per check so lost events and round trip times show up.
+	sessionCheck.withCheckPeriodRange(15 * 60, 2 * 3600).withProbeCount(3);
 	sessionCheck.setup();
 	connectionCheck.setup();
 	tester.setup();
+	loopProfiler.setup();
+	heartbeatWatchdog.setup();
+
+	// Modules are run in this order when more than one is due at the same time
+	moduleScheduler
+		.withModule(batteryCheck)
+		.withModule(sessionCheck)
+		.withModule(connectionCheck)
+		.withModule(connectionEvents)
+		.withModule(tester)
+		.withModule(publishScheduler)
+		.withModule(breadcrumbs)
+		.withModule(loopProfiler)
+		.withProfiler(loopProfiler)
+		.withWatchdog(heartbeatWatchdog);
 
 	// We use semi-automatic mode so we can disconnect if we want to, but basically we
 	// use it like automatic, as we always connect initially.
@@ -93,11 +157,17 @@ void setup() {
 }
 
 void loop() {
-	batteryCheck.loop();
-	sessionCheck.loop();
-	connectionCheck.loop();
-	connectionEvents.loop();
-	tester.loop();
+	moduleScheduler.loop();
+
+	// Nothing else needs to happen until the next module is due. With the system thread enabled,
+	// delay() lets the system thread run, and function calls and subscription events that arrive
+	// wake the module that handles them. This is capped so your own code in loop() still runs
+	// regularly; remove the delay if you do other work here.
+	unsigned long idleMs = moduleScheduler.getMillisUntilNextDeadline();
+	if (idleMs > 100) {
+		idleMs = 100;
+	}
+	delay(idleMs);
 }
 
 
@@ -0,0 +1,742 @@
+#include "EventStream.h"
+
+#include <math.h>
+#include <string.h>
+
+static const struct {
+	int32_t value;
+	const char *name;
+} resetReasons[] = {
+#define RESET_REASON_ENTRY(name, value) { value, "RESET_REASON_" #name },
+	CONNECTION_EVENT_RESET_REASONS(RESET_REASON_ENTRY)
+#undef RESET_REASON_ENTRY
+};
+
+// Fields kept from the JSON, and the slot of each in EventStreamParser::unescaped
+enum {
+	FIELD_NAME = 0,
+	FIELD_DATA,
+	FIELD_COREID,
+	FIELD_PUBLISHED_AT
+};
+
+static inline const char *skipSpace(const char *p, const char *end) {
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+		p++;
+	}
+	return p;
+}
+
+static inline bool fieldEquals(const char *str, size_t len, const char *literal, size_t literalLen) {
+	return len == literalLen && memcmp(str, literal, len) == 0;
+}
+
+#define FIELD_EQUALS(str, len, literal) fieldEquals(str, len, literal, sizeof(literal) - 1)
+
+
+EventStreamParser::EventStreamParser(Handler handler) : handler(handler) {
+}
+
+EventStreamParser::~EventStreamParser() {
+}
+
+void EventStreamParser::parse(const char *buf, size_t len) {
+	const char *end = buf + len;
+	bytes += len;
+
+	if (!partial.empty()) {
+		// Finish the line left over from the last block
+		const char *nl = (const char *)memchr(buf, '\n', len);
+		if (!nl) {
+			partial.append(buf, len);
+			return;
+		}
+		partial.append(buf, nl - buf);
+		parseLine(partial.data(), partial.size());
+		partial.clear();
+		buf = nl + 1;
+	}
+
+	while(buf < end) {
+		const char *nl = (const char *)memchr(buf, '\n', end - buf);
+		if (!nl) {
+			partial.assign(buf, end - buf);
+			break;
+		}
+		parseLine(buf, nl - buf);
+		buf = nl + 1;
+	}
+}
+
+void EventStreamParser::finish() {
+	if (!partial.empty()) {
+		parseLine(partial.data(), partial.size());
+		partial.clear();
+	}
+	sseName.clear();
+}
+
+bool EventStreamParser::parseFile(FILE *fp) {
+	std::vector<char> buf(READ_BLOCK_SIZE);
+	size_t count;
+
+	while((count = fread(buf.data(), 1, buf.size(), fp)) > 0) {
+		parse(buf.data(), count);
+	}
+	finish();
+	return !ferror(fp);
+}
+
+void EventStreamParser::parseLine(const char *line, size_t len) {
+	lines++;
+	if (len > 0 && line[len - 1] == '\r') {
+		len--;
+	}
+	const char *end = line + len;
+
+	if (len == 0) {
+		// End of a server-sent event
+		sseName.clear();
+		return;
+	}
+
+	switch(line[0]) {
+	case '{':
+		parseJson(line, len, StreamField{ NULL, 0 });
+		break;
+
+	case 'e':
+		if (len >= 6 && memcmp(line, "event:", 6) == 0) {
+			const char *p = skipSpace(line + 6, end);
+			sseName.assign(p, end - p);
+		}
+		break;
+
+	case 'd':
+		if (len >= 5 && memcmp(line, "data:", 5) == 0) {
+			const char *p = skipSpace(line + 5, end);
+			parseJson(p, end - p, StreamField{ sseName.data(), sseName.size() });
+		}
+		break;
+
+	default:
+		// Comments (:ok), id:, retry: and anything else
+		break;
+	}
+}
+
+void EventStreamParser::parseJson(const char *json, size_t len, StreamField sseName) {
+	const char *p = json, *end = json + len;
+	StreamEvent event = { sseName, { NULL, 0 }, { NULL, 0 }, { NULL, 0 } };
+
+	if (p >= end || *p++ != '{') {
+		return;
+	}
+	while(true) {
+		p = skipSpace(p, end);
+		if (p < end && *p == ',') {
+			p = skipSpace(p + 1, end);
+		}
+		if (p >= end || *p == '}') {
+			break;
+		}
+		if (*p != '"') {
+			return;
+		}
+
+		// Keys never have escapes in published event JSON
+		const char *key = p + 1;
+		const char *keyEnd = (const char *)memchr(key, '"', end - key);
+		if (!keyEnd) {
+			return;
+		}
+		p = skipSpace(keyEnd + 1, end);
+		if (p >= end || *p != ':') {
+			return;
+		}
+		p = skipSpace(p + 1, end);
+		if (p >= end) {
+			return;
+		}
+
+		if (*p != '"') {
+			// Number, boolean, null, or a nested value that isn't used
+			int depth = 0;
+			bool inString = false;
+			for(; p < end; p++) {
+				if (inString) {
+					if (*p == '\\') {
+						p++;
+					}
+					else
+					if (*p == '"') {
+						inString = false;
+					}
+				}
+				else
+				if (*p == '"') {
+					inString = true;
+				}
+				else
+				if (*p == '{' || *p == '[') {
+					depth++;
+				}
+				else
+				if (*p == '}' || *p == ']') {
+					if (depth == 0) {
+						break;
+					}
+					depth--;
+				}
+				else
+				if (*p == ',' && depth == 0) {
+					break;
+				}
+			}
+			continue;
+		}
+
+		// Find the closing quote, skipping escaped ones
+		const char *start = p + 1;
+		const char *q = start;
+		while(true) {
+			q = (const char *)memchr(q, '"', end - q);
+			if (!q) {
+				return;
+			}
+			const char *b = q;
+			while(b > start && b[-1] == '\\') {
+				b--;
+			}
+			if (((q - b) & 1) == 0) {
+				break;
+			}
+			q++;
+		}
+		p = q + 1;
+
+		size_t keyLen = keyEnd - key;
+		StreamField *field = NULL;
+		size_t slot = 0;
+		if (FIELD_EQUALS(key, keyLen, "data")) {
+			field = &event.data;
+			slot = FIELD_DATA;
+		}
+		else
+		if (FIELD_EQUALS(key, keyLen, "coreid")) {
+			field = &event.coreid;
+			slot = FIELD_COREID;
+		}
+		else
+		if (FIELD_EQUALS(key, keyLen, "published_at")) {
+			field = &event.publishedAt;
+			slot = FIELD_PUBLISHED_AT;
+		}
+		else
+		if (FIELD_EQUALS(key, keyLen, "name") || FIELD_EQUALS(key, keyLen, "event")) {
+			field = &event.name;
+			slot = FIELD_NAME;
+		}
+		if (field && !getString(start, q, slot, *field)) {
+			return;
+		}
+	}
+
+	if (!eventPrefix.empty() && !event.name.empty() &&
+		(event.name.len < eventPrefix.size() || memcmp(event.name.str, eventPrefix.data(), eventPrefix.size()) != 0)) {
+		return;
+	}
+	if (event.data.str == NULL) {
+		return;
+	}
+	events++;
+	handler(event);
+}
+
+// Sets field to the JSON string between start and end, without the quotes. Strings without escapes,
+// which is almost all of them, point into the input. Others are unescaped into unescaped[slot].
+bool EventStreamParser::getString(const char *start, const char *end, size_t slot, StreamField &field) {
+	if (!memchr(start, '\\', end - start)) {
+		field.str = start;
+		field.len = end - start;
+		return true;
+	}
+
+	std::string &out = unescaped[slot];
+	out.clear();
+	for(const char *p = start; p < end; p++) {
+		if (*p != '\\') {
+			out += *p;
+			continue;
+		}
+		if (++p >= end) {
+			return false;
+		}
+		switch(*p) {
+		case 'b': out += '\b'; break;
+		case 'f': out += '\f'; break;
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		case 't': out += '\t'; break;
+		case 'u': {
+			// Event data is ASCII; anything else is replaced
+			if (end - p < 5) {
+				return false;
+			}
+			unsigned value = 0;
+			if (sscanf(std::string(p + 1, 4).c_str(), "%4x", &value) != 1) {
+				return false;
+			}
+			out += (value < 0x80) ? (char)value : '?';
+			p += 4;
+			break;
+		}
+		default:
+			// \" \\ \/
+			out += *p;
+			break;
+		}
+	}
+	field.str = out.data();
+	field.len = out.size();
+	return true;
+}
+
+
+// Like parseInt(str, 10) for the decimal fields of the text encoding: optional sign, then digits
+static bool parseDecimal(const char *p, const char *end, int64_t &value) {
+	while(p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p++ == '-');
+	}
+	if (p >= end || *p < '0' || *p > '9') {
+		return false;
+	}
+	uint64_t result = 0;
+	for(; p < end && *p >= '0' && *p <= '9'; p++) {
+		result = result * 10 + (*p - '0');
+	}
+	value = negative ? -(int64_t)result : (int64_t)result;
+	return true;
+}
+
+// Text encoding: tsDate,tsMillis,eventCode,data; repeated
+static bool decodeText(const char *p, const char *end, std::vector<EventRecord> &records) {
+	bool result = true;
+
+	while(p < end) {
+		const char *semi = (const char *)memchr(p, ';', end - p);
+		const char *recEnd = semi ? semi : end;
+
+		// Exactly 4 fields, the same as decodeText() in event-decoder.js
+		const char *fields[5];
+		size_t numFields = 0;
+		const char *f = p;
+		while(numFields < 5) {
+			fields[numFields++] = f;
+			const char *comma = (const char *)memchr(f, ',', recEnd - f);
+			if (!comma) {
+				break;
+			}
+			f = comma + 1;
+		}
+		if (numFields == 4) {
+			int64_t values[4];
+			bool valid = true;
+			for(size_t ii = 0; ii < 4 && valid; ii++) {
+				const char *fieldEnd = (ii < 3) ? (fields[ii + 1] - 1) : recEnd;
+				valid = parseDecimal(fields[ii], fieldEnd, values[ii]);
+			}
+			if (valid) {
+				records.push_back(EventRecord{ (uint32_t)values[0], (uint32_t)values[1], (int32_t)values[2], (int32_t)values[3] });
+			}
+			else {
+				result = false;
+			}
+		}
+		p = recEnd + 1;
+	}
+	return result;
+}
+
+// Z85 digit values, 0xff for characters not in the alphabet
+static const uint8_t *z85Digits() {
+	static uint8_t digits[256];
+	static bool initialized = false;
+	if (!initialized) {
+		static const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+		memset(digits, 0xff, sizeof(digits));
+		for(size_t ii = 0; ii < sizeof(alphabet) - 1; ii++) {
+			digits[(uint8_t)alphabet[ii]] = (uint8_t)ii;
+		}
+		initialized = true;
+	}
+	return digits;
+}
+
+// Compact encoding (ConnectionEvents::ENCODING_COMPACT), after removing the leading ~.
+// Z85 encoded varints, 4 per record: zigzag(delta tsDate), zigzag(delta tsMillis), eventCode, zigzag(data)
+static bool decodeCompact(const char *p, const char *end, std::vector<EventRecord> &records) {
+	const uint8_t *digits = z85Digits();
+
+	// Reused between calls, as this is called for every event
+	static std::vector<uint8_t> bytes;
+	bytes.resize((end - p) * 4 / 5 + 4);
+	size_t numBytes = 0;
+	while(p < end) {
+		// A partial group of n bytes was sent as n + 1 characters; pad with the highest digit
+		size_t groupLen = ((end - p) < 5) ? (end - p) : 5;
+		uint64_t value = 0;
+		for(size_t ii = 0; ii < 5; ii++) {
+			uint8_t digit = (ii < groupLen) ? digits[(uint8_t)p[ii]] : 84;
+			if (digit == 0xff) {
+				return false;
+			}
+			value = value * 85 + digit;
+		}
+		for(size_t ii = 0; ii + 1 < groupLen; ii++) {
+			bytes[numBytes++] = (uint8_t)(value >> (8 * (3 - ii)));
+		}
+		p += groupLen;
+	}
+
+	size_t offset = 0;
+	auto readVarint = [&](uint32_t &value) {
+		value = 0;
+		for(unsigned shift = 0; ; shift += 7) {
+			if (offset >= numBytes) {
+				return false;
+			}
+			uint8_t b = bytes[offset++];
+			if (shift < 32) {
+				value |= (uint32_t)(b & 0x7f) << shift;
+			}
+			if ((b & 0x80) == 0) {
+				return true;
+			}
+		}
+	};
+	auto unzigzag = [](uint32_t value) {
+		return (int32_t)((value >> 1) ^ (0 - (value & 1)));
+	};
+
+	uint32_t prevDate = 0, prevMillis = 0;
+	while(offset < numBytes) {
+		uint32_t date, millis, code, data;
+		if (!readVarint(date) || !readVarint(millis) || !readVarint(code) || !readVarint(data)) {
+			return false;
+		}
+		EventRecord rec;
+		rec.tsDate = prevDate + (uint32_t)unzigzag(date);
+		rec.tsMillis = prevMillis + (uint32_t)unzigzag(millis);
+		rec.eventCode = (int32_t)code;
+		rec.data = unzigzag(data);
+		records.push_back(rec);
+
+		prevDate = rec.tsDate;
+		prevMillis = rec.tsMillis;
+	}
+	return true;
+}
+
+bool decodeEventData(const StreamField &data, std::vector<EventRecord> &records) {
+	if (data.len > 0 && data.str[0] == '~') {
+		return decodeCompact(data.str + 1, data.str + data.len, records);
+	}
+	else {
+		return decodeText(data.str, data.str + data.len, records);
+	}
+}
+
+const char *eventCodeName(int32_t eventCode) {
+	switch(eventCode) {
+#define EVENT_CODE_NAME(name, value) case value: return #name;
+	CONNECTION_EVENT_CODES(EVENT_CODE_NAME)
+#undef EVENT_CODE_NAME
+	}
+	return NULL;
+}
+
+const char *resetReasonName(int32_t resetReason) {
+	for(size_t ii = 0; ii < sizeof(resetReasons) / sizeof(resetReasons[0]); ii++) {
+		if (resetReasons[ii].value == resetReason) {
+			return resetReasons[ii].name;
+		}
+	}
+	return NULL;
+}
+
+void appendUnsigned(std::string &out, uint32_t value) {
+	char buf[10];
+	size_t len = 0;
+	do {
+		buf[sizeof(buf) - ++len] = '0' + (value % 10);
+		value /= 10;
+	} while(value > 0);
+	out.append(&buf[sizeof(buf) - len], len);
+}
+
+static inline void appendSigned(std::string &out, int32_t value) {
+	if (value < 0) {
+		out += '-';
+		appendUnsigned(out, 0 - (uint32_t)value);
+	}
+	else {
+		appendUnsigned(out, (uint32_t)value);
+	}
+}
+
+// ConnectionCheck::packPingResult()
+static void appendPingResult(std::string &out, uint32_t value) {
+	uint32_t sent = (value >> 28) & 0xf;
+	uint32_t received = (value >> 24) & 0xf;
+
+	out += "rtt=";
+	appendUnsigned(out, value & 0xffff);
+	out += "ms ttl=";
+	appendUnsigned(out, (value >> 16) & 0xff);
+	out += " received=";
+	appendUnsigned(out, received);
+	out += '/';
+	appendUnsigned(out, sent);
+	out += " loss=";
+	// Math.round()
+	appendSigned(out, sent ? (int32_t)floor(100.0 * ((double)sent - (double)received) / sent + 0.5) : 0);
+	out += '%';
+}
+
+// BatteryCheck::packSleepPlan()
+static void appendBatterySleep(std::string &out, int32_t data) {
+	int32_t rate = data >> 16;
+
+	appendUnsigned(out, data & 0x7fff);
+	out += "min rate=";
+	if (rate == -32768) {
+		out += "unknown";
+	}
+	else {
+		// (rate / 100).toFixed(2)
+		if (rate < 0) {
+			out += '-';
+			rate = -rate;
+		}
+		appendUnsigned(out, rate / 100);
+		out += '.';
+		out += (char)('0' + (rate / 10) % 10);
+		out += (char)('0' + rate % 10);
+		out += "%/h";
+	}
+	if (data & 0x8000) {
+		out += " predicted";
+	}
+}
+
+// PowerState::update()
+static void appendPowerTier(std::string &out, uint32_t value) {
+	static const char *tiers[] = { "NORMAL", "CONSERVE", "LOW", "CRITICAL" };
+	auto appendTier = [&out](uint32_t tier) {
+		if (tier < sizeof(tiers) / sizeof(tiers[0])) {
+			out += tiers[tier];
+		}
+		else {
+			appendUnsigned(out, tier);
+		}
+	};
+
+	appendTier(value & 0xff);
+	out += " from ";
+	appendTier((value >> 8) & 0xff);
+	out += " soc=";
+	appendUnsigned(out, (value >> 16) & 0xff);
+	out += '%';
+}
+
+// HeartbeatWatchdog::packStall()
+static void appendHeartbeatStall(std::string &out, uint32_t value) {
+	uint32_t channel = value >> 24;
+	uint32_t stage = (value >> 16) & 0xff;
+
+	out += "channel=";
+	if (channel >= 32) {
+		out += "user";
+		channel -= 32;
+	}
+	appendUnsigned(out, channel);
+	out += " stage=";
+	if (stage == 0xff) {
+		out += "none";
+	}
+	else {
+		appendUnsigned(out, stage);
+	}
+	out += ' ';
+	appendUnsigned(out, (value & 0xffff) / 10);
+	out += '.';
+	out += (char)('0' + (value & 0xffff) % 10);
+	out += 's';
+}
+
+// SessionCheck::packProbeResult()
+static void appendSessionResult(std::string &out, uint32_t value) {
+	out += "rtt=";
+	appendUnsigned(out, value & 0xffff);
+	out += "ms received=";
+	appendUnsigned(out, (value >> 24) & 0xf);
+	out += '/';
+	appendUnsigned(out, (value >> 28) & 0xf);
+	out += " lossAverage=";
+	appendUnsigned(out, (value >> 16) & 0xff);
+	out += '%';
+}
+
+void appendEventString(std::string &out, int32_t eventCode, int32_t data) {
+	const char *name = eventCodeName(eventCode);
+	if (!name) {
+		return;
+	}
+	out += name;
+
+	uint32_t value = (uint32_t)data;
+	switch(eventCode) {
+	case CODE_CELLULAR_READY:
+	case CODE_CLOUD_CONNECTED:
+		out += data ? " connected" : " disconnected";
+		break;
+
+	case CODE_PING_DNS:
+	case CODE_PING_API:
+		// data is the number of replies received
+		out += (data > 0) ? " success" : " failed";
+		break;
+
+	case CODE_RESET_REASON: {
+		out += ' ';
+		const char *reason = resetReasonName(data);
+		if (reason) {
+			out += reason;
+		}
+		break;
+	}
+
+	case CODE_TESTER_PING:
+	case CODE_TESTER_LOAD:
+	case CODE_TESTER_LOAD_ENQUEUED:
+	case CODE_TESTER_LOAD_DROPPED:
+	case CODE_TESTER_LOAD_PUBLISHED:
+	case CODE_TESTER_LOAD_BYTES:
+		out += ' ';
+		appendSigned(out, data);
+		break;
+
+	case CODE_PING_DNS_RTT:
+	case CODE_PING_API_RTT:
+		out += ' ';
+		appendPingResult(out, value);
+		break;
+
+	case CODE_RECOVERY_STEP: {
+		// ConnectionCheck::RecoveryAction in the low 8 bits, step number above that
+		static const char *actions[] = { "SESSION_RESTART", "CELLULAR_CYCLE", "MODEM_RESET", "SLEEP" };
+		out += ' ';
+		appendUnsigned(out, value >> 8);
+		out += ' ';
+		if ((value & 0xff) < sizeof(actions) / sizeof(actions[0])) {
+			out += actions[value & 0xff];
+		}
+		else {
+			appendUnsigned(out, value & 0xff);
+		}
+		break;
+	}
+
+	case CODE_SESSION_DEGRADED:
+		out += ' ';
+		appendSessionResult(out, value);
+		break;
+
+	case CODE_REPEAT:
+		// ConnectionEvents::packRepeat()
+		out += " x";
+		appendUnsigned(out, value & 0xffff);
+		out += ' ';
+		appendEventString(out, (int32_t)((value >> 24) & 0xff), (int32_t)((value >> 16) & 0xff));
+		break;
+
+	case CODE_TESTER_QUEUE:
+		// Tester::reportCommandQueue()
+		out += " maxDepth=";
+		appendUnsigned(out, value & 0xff);
+		out += " dropped=";
+		appendUnsigned(out, value >> 8);
+		break;
+
+	case CODE_BATTERY_SLEEP:
+		out += ' ';
+		appendBatterySleep(out, data);
+		break;
+
+	case CODE_POWER_TIER:
+		out += ' ';
+		appendPowerTier(out, value);
+		break;
+
+	case CODE_SLOW_LOOP:
+		// LoopProfiler::packSlowLoop()
+		out += " module=";
+		appendUnsigned(out, value >> 24);
+		out += ' ';
+		appendUnsigned(out, value & 0xffffff);
+		out += "ms";
+		break;
+
+	case CODE_HEARTBEAT_STALL:
+		out += ' ';
+		appendHeartbeatStall(out, value);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void appendDate(std::string &out, uint32_t tsDate) {
+	if (tsDate == 0) {
+		out += "no date";
+		return;
+	}
+
+	// Days since 1970 to a civil date (Howard Hinnant's days_from_civil, in reverse). gmtime_r and
+	// strftime are most of the run time otherwise.
+	uint32_t days = tsDate / 86400;
+	uint32_t secs = tsDate % 86400;
+	uint32_t z = days + 719468;
+	uint32_t era = z / 146097;
+	uint32_t doe = z - era * 146097;
+	uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	uint32_t mp = (5 * doy + 2) / 153;
+	uint32_t day = doy - (153 * mp + 2) / 5 + 1;
+	uint32_t month = (mp < 10) ? (mp + 3) : (mp - 9);
+	uint32_t year = yoe + era * 400 + ((month <= 2) ? 1 : 0);
+
+	char buf[24];
+	char *p = buf;
+	auto twoDigits = [&p](uint32_t value, char separator) {
+		*p++ = '0' + value / 10;
+		*p++ = '0' + value % 10;
+		*p++ = separator;
+	};
+	*p++ = '0' + (year / 1000) % 10;
+	*p++ = '0' + (year / 100) % 10;
+	twoDigits(year % 100, '-');
+	twoDigits(month, '-');
+	twoDigits(day, 'T');
+	twoDigits(secs / 3600, ':');
+	twoDigits((secs / 60) % 60, ':');
+	twoDigits(secs % 60, '.');
+	memcpy(p, "000Z", 4);
+	out.append(buf, (p + 4) - buf);
+}
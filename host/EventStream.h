@@ -0,0 +1,130 @@
+#ifndef __EVENTSTREAM_H
+#define __EVENTSTREAM_H
+
+// Parsing and decoding of recorded Particle event streams, for the native decoder
+//
+// This doesn't use the Device OS stand-in, only the event code list shared with the library.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ConnectionEventCodes.h"
+
+// Copy of ConnectionEvents::ConnectionEventCode, so this doesn't need the Device OS stand-in
+enum {
+#define EVENT_CODE_ENUM(name, value) CODE_##name = value,
+	CONNECTION_EVENT_CODES(EVENT_CODE_ENUM)
+#undef EVENT_CODE_ENUM
+};
+
+/**
+ * @brief A field of a published event. Points into the parser's input, so it's only valid during the handler.
+ */
+struct StreamField {
+	const char *str;
+	size_t len;
+
+	inline bool empty() const { return len == 0; };
+	inline std::string toString() const { return std::string(str, len); };
+};
+
+/**
+ * @brief One published event from a recorded stream
+ */
+struct StreamEvent {
+	StreamField name; // Empty if the recording doesn't include it
+	StreamField data;
+	StreamField coreid;
+	StreamField publishedAt;
+};
+
+/**
+ * @brief One record from the data of a connection event log publish
+ */
+struct EventRecord {
+	uint32_t tsDate;
+	uint32_t tsMillis;
+	int32_t eventCode;
+	int32_t data;
+};
+
+/**
+ * @brief Splits recorded event streams into events
+ *
+ * Two formats are accepted, and can be mixed:
+ *
+ * - Server-sent events, as saved from the event stream API (curl https://api.particle.io/v1/devices/events).
+ * An event: line gives the event name and the following data: line has the JSON with the event data.
+ * - JSON lines, one event object per line, as printed by particle subscribe.
+ *
+ * Input is processed in large blocks. Lines are found with memchr and the JSON fields are returned
+ * as pointers into the block, so nothing is copied except a line split across two blocks or a
+ * string that contains escapes. The JSON objects are expected to be flat, which they are for
+ * published events.
+ */
+class EventStreamParser {
+public:
+	typedef std::function<void(const StreamEvent &)> Handler;
+
+	EventStreamParser(Handler handler);
+	virtual ~EventStreamParser();
+
+	// Only pass events whose names start with prefix, the same as the event stream API does.
+	// Default: connEventStats. An empty prefix passes everything.
+	inline EventStreamParser &withEventPrefix(const char *prefix) { eventPrefix = prefix; return *this; };
+
+	// Parses len bytes of input. Lines can be split across calls.
+	void parse(const char *buf, size_t len);
+
+	// Parses the last line, if it didn't end with a newline
+	void finish();
+
+	// Parses all of fp, then calls finish(). Returns false on a read error.
+	bool parseFile(FILE *fp);
+
+	inline uint64_t getBytes() const { return bytes; };
+	inline uint64_t getLines() const { return lines; };
+	inline uint64_t getEvents() const { return events; };
+
+	static const size_t READ_BLOCK_SIZE = 1024 * 1024;
+
+private:
+	void parseLine(const char *line, size_t len);
+	void parseJson(const char *json, size_t len, StreamField sseName);
+	bool getString(const char *start, const char *end, size_t slot, StreamField &field);
+
+	Handler handler;
+	std::string eventPrefix = "connEventStats";
+	std::string partial;
+	std::string sseName;
+	std::string unescaped[4];
+	uint64_t bytes = 0;
+	uint64_t lines = 0;
+	uint64_t events = 0;
+};
+
+// Decodes the data of a connection event log publish, in either ConnectionEvents encoding, into
+// records (appended). Returns false if the data is malformed; records before the problem are kept.
+bool decodeEventData(const StreamField &data, std::vector<EventRecord> &records);
+
+// Name of an event code from ConnectionEventCodes.h, NULL if unknown
+const char *eventCodeName(int32_t eventCode);
+
+// Name of a Device OS reset reason, like RESET_REASON_PANIC, NULL if unknown
+const char *resetReasonName(int32_t resetReason);
+
+// Appends the description of an event, the same as eventToString() in event-decoder.js
+void appendEventString(std::string &out, int32_t eventCode, int32_t data);
+
+// Appends value in decimal
+void appendUnsigned(std::string &out, uint32_t value);
+
+// Appends the ISO 8601 UTC time, like 2018-05-11T13:38:02.000Z, or "no date" for 0
+void appendDate(std::string &out, uint32_t tsDate);
+
+#endif /* __EVENTSTREAM_H */
@@ -0,0 +1,288 @@
+#include "FleetAnalytics.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// FleetAnalytics::resetReasons is in this order, with other values counted in the last entry
+static const int32_t resetReasonValues[] = {
+#define RESET_REASON_VALUE(name, value) value,
+	CONNECTION_EVENT_RESET_REASONS(RESET_REASON_VALUE)
+#undef RESET_REASON_VALUE
+};
+static const size_t numResetReasonValues = sizeof(resetReasonValues) / sizeof(resetReasonValues[0]);
+static_assert(numResetReasonValues < FleetAnalytics::NUM_RESET_REASONS, "FleetAnalytics::NUM_RESET_REASONS too small");
+
+static size_t resetReasonIndex(int32_t resetReason) {
+	for(size_t ii = 0; ii < numResetReasonValues; ii++) {
+		if (resetReasonValues[ii] == resetReason) {
+			return ii;
+		}
+	}
+	return FleetAnalytics::NUM_RESET_REASONS - 1;
+}
+
+static inline double perDay(uint64_t count, uint64_t secs) {
+	return secs ? count * 86400.0 / secs : 0.0;
+}
+
+void FleetHistogram::add(uint32_t value) {
+	count++;
+	sum += value;
+	if (value > maxValue) {
+		maxValue = value;
+	}
+	buckets[LogHistogram::bucketIndex(value)]++;
+}
+
+uint32_t FleetHistogram::percentile(unsigned pct) const {
+	uint64_t target = (count * pct + 99) / 100;
+	uint64_t total = 0;
+	for(size_t ii = 0; ii < LogHistogram::NUM_BUCKETS; ii++) {
+		total += buckets[ii];
+		if (total >= target && total > 0) {
+			return LogHistogram::bucketLowerBound(ii);
+		}
+	}
+	return 0;
+}
+
+
+FleetAnalytics::FleetAnalytics() {
+}
+
+FleetAnalytics::~FleetAnalytics() {
+}
+
+void FleetAnalytics::add(const StreamField &coreid, const EventRecord &rec) {
+	// Records from one device come in runs of a publish or more, so cache the lookup. Pointers to
+	// unordered_map values stay valid when it grows.
+	if (!lastDevice || lastCoreid.size() != coreid.len || memcmp(lastCoreid.data(), coreid.str, coreid.len) != 0) {
+		lastCoreid.assign(coreid.str, coreid.len);
+		lastDevice = &devices[lastCoreid];
+	}
+	DeviceAnalytics &dev = *lastDevice;
+	records++;
+	dev.records++;
+
+	if (rec.eventCode == CODE_SETUP_STARTED && rec.tsDate == 0) {
+		// millis() starts over, so the old anchor doesn't apply
+		dev.anchorValid = false;
+	}
+
+	// Work out when this happened, in seconds
+	uint32_t now = 0;
+	if (rec.tsDate != 0) {
+		dev.anchorValid = true;
+		dev.anchorDate = rec.tsDate;
+		dev.anchorMillis = rec.tsMillis;
+		now = rec.tsDate;
+	}
+	else
+	if (dev.anchorValid && (int32_t)(rec.tsMillis - dev.anchorMillis) >= 0) {
+		now = dev.anchorDate + (rec.tsMillis - dev.anchorMillis) / 1000;
+	}
+
+	if (now == 0) {
+		// Use the last known time. If there isn't one yet, the record is counted but can't change the state.
+		undated++;
+		now = dev.lastTime;
+	}
+	else
+	if (dev.firstTime == 0) {
+		dev.firstTime = dev.lastTime = now;
+	}
+
+	if (rec.eventCode == CODE_SETUP_STARTED) {
+		// Rebooted sometime after the last record
+		disconnected(dev, dev.lastTime);
+	}
+	if (now > dev.lastTime) {
+		dev.lastTime = now;
+	}
+	now = dev.lastTime;
+
+	if (rec.eventCode == CODE_REPEAT) {
+		uint32_t value = (uint32_t)rec.data;
+		addRecord(dev, (value >> 24) & 0xff, (value >> 16) & 0xff, value & 0xffff, now, rec.tsMillis);
+	}
+	else {
+		addRecord(dev, rec.eventCode, rec.data, 1, now, rec.tsMillis);
+	}
+}
+
+void FleetAnalytics::addRecord(DeviceAnalytics &dev, int32_t eventCode, int32_t data, uint32_t count, uint32_t now, uint32_t millis) {
+	switch(eventCode) {
+	case CODE_SETUP_STARTED:
+		dev.boots += count;
+		dev.awaitingCloud = true;
+		stateKnown(dev, now);
+		break;
+
+	case CODE_CLOUD_CONNECTED:
+		if (data && dev.awaitingCloud) {
+			// millis() at the first connection after booting
+			dev.awaitingCloud = false;
+			dev.timeToCloudCount++;
+			dev.timeToCloudMsSum += millis;
+			timeToCloudMs.add(millis);
+		}
+		if (now == 0) {
+			// Before the first dated record, so there's nothing to measure from
+			break;
+		}
+		stateKnown(dev, now);
+		if (data) {
+			connected(dev, now);
+		}
+		else {
+			disconnected(dev, now);
+		}
+		break;
+
+	case CODE_REBOOT_NO_CLOUD:
+		dev.rebootNoCloud += count;
+		break;
+
+	case CODE_MODEM_RESET:
+		dev.modemResets += count;
+		break;
+
+	case CODE_SESSION_RESET:
+		dev.sessionResets += count;
+		break;
+
+	case CODE_RESET_REASON:
+		dev.resets += count;
+		resetReasons[resetReasonIndex(data)] += count;
+		break;
+
+	default:
+		break;
+	}
+}
+
+// Uptime is measured from the first record that says whether the device is connected
+void FleetAnalytics::stateKnown(DeviceAnalytics &dev, uint32_t now) {
+	if (dev.stateSince == 0) {
+		dev.stateSince = now;
+	}
+}
+
+void FleetAnalytics::connected(DeviceAnalytics &dev, uint32_t now) {
+	if (dev.cloudConnected) {
+		return;
+	}
+	dev.cloudConnected = true;
+	dev.connectedSince = now;
+
+	if (dev.inOutage) {
+		uint32_t secs = now - dev.outageSince;
+		dev.inOutage = false;
+		dev.outages++;
+		dev.outageSecs += secs;
+		if (secs > dev.maxOutageSecs) {
+			dev.maxOutageSecs = secs;
+		}
+		outageSecs.add(secs);
+	}
+}
+
+void FleetAnalytics::disconnected(DeviceAnalytics &dev, uint32_t now) {
+	if (!dev.cloudConnected) {
+		return;
+	}
+	dev.cloudConnected = false;
+	dev.connectedSecs += now - dev.connectedSince;
+	dev.inOutage = true;
+	dev.outageSince = now;
+}
+
+void FleetAnalytics::finish() {
+	for(auto &it : devices) {
+		DeviceAnalytics &dev = it.second;
+		if (dev.cloudConnected) {
+			// Up until the end of the log
+			dev.connectedSecs += dev.lastTime - dev.connectedSince;
+			dev.connectedSince = dev.lastTime;
+		}
+	}
+}
+
+void FleetAnalytics::printDevices(FILE *fp, const std::map<std::string, std::string> &names) const {
+	// Sorted by name, so the output doesn't depend on the hash table
+	std::vector<std::pair<std::string, const DeviceAnalytics *>> sorted;
+	for(const auto &it : devices) {
+		auto nameIt = names.find(it.first);
+		sorted.push_back(std::make_pair((nameIt != names.end()) ? nameIt->second : it.first, &it.second));
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	fprintf(fp, "device,records,days,uptimePct,outages,mttrSecs,maxOutageSecs,inOutage,boots,resets,rebootNoCloudPerDay,modemResetPerDay,sessionResetPerDay,timeToCloudMs\n");
+	for(const auto &it : sorted) {
+		const DeviceAnalytics &dev = *it.second;
+		uint32_t observed = dev.getObservedSecs();
+
+		fprintf(fp, "%s,%llu,%.2f,%.2f,%u,%.0f,%u,%d,%u,%u,%.2f,%.2f,%.2f,%.0f\n",
+			it.first.c_str(), (unsigned long long)dev.records, observed / 86400.0,
+			dev.getStateSecs() ? 100.0 * dev.connectedSecs / dev.getStateSecs() : 0.0,
+			dev.outages, dev.outages ? (double)dev.outageSecs / dev.outages : 0.0, dev.maxOutageSecs, dev.inOutage,
+			dev.boots, dev.resets, perDay(dev.rebootNoCloud, observed), perDay(dev.modemResets, observed),
+			perDay(dev.sessionResets, observed),
+			dev.timeToCloudCount ? (double)dev.timeToCloudMsSum / dev.timeToCloudCount : 0.0);
+	}
+}
+
+void FleetAnalytics::printSummary(FILE *fp) const {
+	uint64_t observedSecs = 0, stateSecs = 0, connectedSecs = 0;
+	uint64_t boots = 0, resets = 0, rebootNoCloud = 0, modemResets = 0, sessionResets = 0, inOutage = 0;
+	std::vector<double> uptimes;
+
+	for(const auto &it : devices) {
+		const DeviceAnalytics &dev = it.second;
+		observedSecs += dev.getObservedSecs();
+		stateSecs += dev.getStateSecs();
+		connectedSecs += dev.connectedSecs;
+		boots += dev.boots;
+		resets += dev.resets;
+		rebootNoCloud += dev.rebootNoCloud;
+		modemResets += dev.modemResets;
+		sessionResets += dev.sessionResets;
+		if (dev.inOutage) {
+			inOutage++;
+		}
+		if (dev.getStateSecs() > 0) {
+			uptimes.push_back(100.0 * dev.connectedSecs / dev.getStateSecs());
+		}
+	}
+	std::sort(uptimes.begin(), uptimes.end());
+	auto uptimePercentile = [&uptimes](unsigned pct) {
+		return uptimes.empty() ? 0.0 : uptimes[(uptimes.size() - 1) * pct / 100];
+	};
+
+	fprintf(fp, "devices: %zu, records: %llu (%llu undated), observed: %.1f device-days\n", devices.size(),
+		(unsigned long long)records, (unsigned long long)undated, observedSecs / 86400.0);
+	fprintf(fp, "uptime: %.2f%% of observed time, per device p1=%.2f%% p10=%.2f%% p50=%.2f%%\n",
+		stateSecs ? 100.0 * connectedSecs / stateSecs : 0.0, uptimePercentile(1), uptimePercentile(10), uptimePercentile(50));
+	fprintf(fp, "outages: %llu ended, %llu devices still in one at the end of the log\n",
+		(unsigned long long)outageSecs.count, (unsigned long long)inOutage);
+	fprintf(fp, "  MTTR %.0f sec, p50>=%u p90>=%u p99>=%u max=%u\n", outageSecs.mean(),
+		outageSecs.percentile(50), outageSecs.percentile(90), outageSecs.percentile(99), outageSecs.maxValue);
+	fprintf(fp, "time to cloud after boot (ms): n=%llu mean=%.0f p50>=%u p90>=%u p99>=%u max=%u\n",
+		(unsigned long long)timeToCloudMs.count, timeToCloudMs.mean(),
+		timeToCloudMs.percentile(50), timeToCloudMs.percentile(90), timeToCloudMs.percentile(99), timeToCloudMs.maxValue);
+	fprintf(fp, "per device-day: boots %.3f, resets %.3f, REBOOT_NO_CLOUD %.3f, MODEM_RESET %.3f, SESSION_RESET %.3f\n",
+		perDay(boots, observedSecs), perDay(resets, observedSecs), perDay(rebootNoCloud, observedSecs),
+		perDay(modemResets, observedSecs), perDay(sessionResets, observedSecs));
+
+	fprintf(fp, "reset reasons:\n");
+	for(size_t ii = 0; ii < NUM_RESET_REASONS; ii++) {
+		if (resetReasons[ii] == 0) {
+			continue;
+		}
+		const char *name = (ii < numResetReasonValues) ? resetReasonName(resetReasonValues[ii]) : NULL;
+		fprintf(fp, "  %-30s %10llu %6.2f%%\n", name ? name : "other", (unsigned long long)resetReasons[ii],
+			100.0 * resetReasons[ii] / resets);
+	}
+}
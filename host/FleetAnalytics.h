@@ -0,0 +1,118 @@
+#ifndef __FLEETANALYTICS_H
+#define __FLEETANALYTICS_H
+
+#include "EventStream.h"
+
+#include "LogHistogram.h"
+
+#include <map>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief LogHistogram buckets with 64-bit counts, for totals over a whole fleet
+ */
+struct FleetHistogram {
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint32_t maxValue = 0;
+	uint64_t buckets[LogHistogram::NUM_BUCKETS] = {};
+
+	void add(uint32_t value);
+
+	// Lower bound of the bucket containing the pct percentile, 0 if empty
+	uint32_t percentile(unsigned pct) const;
+
+	inline double mean() const { return count ? (double)sum / count : 0.0; };
+};
+
+/**
+ * @brief Connection state of one device, reconstructed from its connection event log
+ *
+ * This is a fixed size, so the memory used only depends on the number of devices, not the number of records.
+ */
+struct DeviceAnalytics {
+	// Reconstructed state
+	bool cloudConnected = false;
+	bool inOutage = false;
+	bool awaitingCloud = false;
+	bool anchorValid = false;
+	uint32_t anchorDate = 0; // Last record with a date in this boot, for dating records without one
+	uint32_t anchorMillis = 0;
+	uint32_t firstTime = 0;
+	uint32_t lastTime = 0;
+	uint32_t stateSince = 0; // When the connection state was first known
+	uint32_t connectedSince = 0;
+	uint32_t outageSince = 0;
+
+	// Totals
+	uint64_t records = 0;
+	uint64_t connectedSecs = 0;
+	uint32_t boots = 0;
+	uint32_t resets = 0; // RESET_REASON records
+	uint32_t rebootNoCloud = 0;
+	uint32_t modemResets = 0;
+	uint32_t sessionResets = 0;
+	uint32_t outages = 0; // Ended outages
+	uint64_t outageSecs = 0;
+	uint32_t maxOutageSecs = 0;
+	uint32_t timeToCloudCount = 0;
+	uint64_t timeToCloudMsSum = 0;
+
+	inline uint32_t getObservedSecs() const { return lastTime - firstTime; };
+	inline uint32_t getStateSecs() const { return stateSince ? (lastTime - stateSince) : 0; };
+};
+
+/**
+ * @brief Derives reliability metrics for each device and the whole fleet from decoded connection events
+ *
+ * Records are processed one at a time, in the order they were published, in a single pass. The
+ * state of each device is reconstructed from the CLOUD_CONNECTED and SETUP_STARTED events:
+ *
+ * - Uptime is measured from the first CLOUD_CONNECTED or SETUP_STARTED, as the state before that isn't known.
+ * - The device is up from a CLOUD_CONNECTED connected until a CLOUD_CONNECTED disconnected or the
+ * next boot. A reboot is assumed to end the connection at the time of the last record before it.
+ * - An outage runs from losing the cloud connection to the next CLOUD_CONNECTED connected, including
+ * any reboots in between. The mean outage duration is the MTTR. Outages still going at the end of
+ * the log are counted separately.
+ * - Time to cloud is the millis() value of the first CLOUD_CONNECTED connected after SETUP_STARTED.
+ * - Records logged before the time was set (date 0) are dated from millis() and the last dated
+ * record in the same boot; records that can't be dated are counted, but don't advance the clock.
+ *
+ * REPEAT records count as that many of the repeated event, and update the state once.
+ */
+class FleetAnalytics {
+public:
+	FleetAnalytics();
+	virtual ~FleetAnalytics();
+
+	void add(const StreamField &coreid, const EventRecord &rec);
+
+	// Call after the last record, before printing
+	void finish();
+
+	// One CSV line per device, with a header line
+	void printDevices(FILE *fp, const std::map<std::string, std::string> &names) const;
+
+	void printSummary(FILE *fp) const;
+
+	static const size_t NUM_RESET_REASONS = 16; // The ones in ConnectionEventCodes.h, then other values
+
+private:
+	void addRecord(DeviceAnalytics &dev, int32_t eventCode, int32_t data, uint32_t count, uint32_t now, uint32_t millis);
+	void stateKnown(DeviceAnalytics &dev, uint32_t now);
+	void connected(DeviceAnalytics &dev, uint32_t now);
+	void disconnected(DeviceAnalytics &dev, uint32_t now);
+
+	std::unordered_map<std::string, DeviceAnalytics> devices;
+	std::string lastCoreid;
+	DeviceAnalytics *lastDevice = NULL;
+
+	uint64_t records = 0;
+	uint64_t undated = 0;
+	FleetHistogram outageSecs;
+	FleetHistogram timeToCloudMs;
+	uint64_t resetReasons[NUM_RESET_REASONS] = {};
+};
+
+#endif /* __FLEETANALYTICS_H */
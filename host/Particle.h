@@ -0,0 +1,425 @@
+#ifndef __PARTICLE_H
+#define __PARTICLE_H
+
+// Host (Linux) stand-in for the parts of the Particle Device OS API used by this library.
+// It's only used to build the library off-device for the fleet simulator and benchmarks; when
+// building for a real device the Device OS Particle.h is used instead.
+//
+// Everything is driven by a virtual clock (HostClock). Nothing ever really waits: delay() and
+// blocking calls like Cellular.command() just advance the clock. Cellular, cloud, battery and
+// cloud messages are provided by a HostEnvironment that the simulator implements.
+//
+// System.reset() and deep sleep throw a HostReset exception. The simulator catches it, destroys
+// the firmware objects and runs setup() again, just like a real reboot. Variables declared
+// retained are placed in their own linker section so they can be preserved across these
+// simulated reboots and cleared when a new device is powered up.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <functional>
+#include <string>
+
+typedef uint32_t system_tick_t;
+
+#define retained __attribute__((section("retained_user")))
+
+// The host build is single-threaded, so these just run the block once
+#define ATOMIC_BLOCK() for(bool __atomicOnce = true; __atomicOnce; __atomicOnce = false)
+#define SINGLE_THREADED_BLOCK() ATOMIC_BLOCK()
+
+#define STARTUP(x)
+#define SYSTEM_THREAD(x)
+#define SYSTEM_MODE(x)
+
+enum {
+	D0 = 0, D1, D2, D3, D4, D5, D6, D7
+};
+
+typedef enum {
+	INPUT, OUTPUT, INPUT_PULLUP, INPUT_PULLDOWN
+} PinMode;
+
+typedef enum {
+	CHANGE, RISING, FALLING
+} InterruptMode;
+
+typedef enum {
+	SLEEP_MODE_WLAN = 0, SLEEP_MODE_DEEP = 1
+} Spark_Sleep_TypeDef;
+
+typedef enum {
+	SLEEP_NETWORK_OFF = 0, SLEEP_NETWORK_STANDBY = 1
+} SleepNetworkFlag;
+
+typedef enum {
+	PUBLIC = 0, PRIVATE = 1
+} PublishFlag;
+
+typedef enum {
+	ALL_DEVICES = 0, MY_DEVICES = 1
+} Spark_Subscription_Scope_TypeDef;
+
+typedef enum {
+	FEATURE_RETAINED_MEMORY = 1, FEATURE_RESET_INFO = 2
+} HAL_Feature;
+
+// Cellular.command() results
+enum {
+	WAIT = -1, RESP_OK = -2, RESP_ERROR = -3, RESP_PROMPT = -4, RESP_ABORTED = -5, NOT_FOUND = 0
+};
+
+// Line types passed to Cellular.command() callbacks
+enum {
+	TYPE_UNKNOWN = 0x000000, TYPE_OK = 0x110000, TYPE_ERROR = 0x120000, TYPE_PLUS = 0x210000
+};
+
+// System.resetReason() values
+enum {
+	RESET_REASON_NONE = 0,
+	RESET_REASON_UNKNOWN = 10,
+	RESET_REASON_PIN_RESET = 20,
+	RESET_REASON_POWER_MANAGEMENT = 30,
+	RESET_REASON_POWER_DOWN = 40,
+	RESET_REASON_POWER_BROWNOUT = 50,
+	RESET_REASON_WATCHDOG = 60,
+	RESET_REASON_UPDATE = 70,
+	RESET_REASON_UPDATE_ERROR = 80,
+	RESET_REASON_UPDATE_TIMEOUT = 90,
+	RESET_REASON_FACTORY_RESET = 100,
+	RESET_REASON_SAFE_MODE = 110,
+	RESET_REASON_DFU_MODE = 120,
+	RESET_REASON_PANIC = 130,
+	RESET_REASON_USER = 140
+};
+
+/**
+ * @brief Minimal Wiring String
+ */
+class String {
+public:
+	String() {};
+	String(const char *s) : str(s ? s : "") {};
+	String(const std::string &s) : str(s) {};
+
+	inline const char *c_str() const { return str.c_str(); };
+	inline unsigned int length() const { return str.length(); };
+	inline bool equals(const char *s) const { return str == s; };
+	inline bool startsWith(const String &s) const { return str.compare(0, s.str.length(), s.str) == 0; };
+
+	inline String operator+(const char *s) const { return String(str + s); };
+	inline String operator+(const String &s) const { return String(str + s.str); };
+	inline bool operator==(const String &s) const { return str == s.str; };
+
+private:
+	std::string str;
+};
+
+/**
+ * @brief Virtual clock shared by the whole host build
+ *
+ * now() is milliseconds since the simulation started. millis() is relative to the last
+ * simulated boot, like on a real device.
+ */
+class HostClock {
+public:
+	static inline uint64_t now() { return nowMs; };
+	static inline void set(uint64_t value) { nowMs = value; };
+
+	// Advances the clock, firing the application watchdog if it expires first
+	static void advance(uint64_t ms);
+
+	static inline system_tick_t millis() { return (system_tick_t)(nowMs - bootMs); };
+	static inline void boot() { bootMs = nowMs; };
+
+private:
+	static uint64_t nowMs;
+	static uint64_t bootMs;
+};
+
+/**
+ * @brief Thrown by System.reset(), deep sleep and safe mode. Never returns to the caller on a real device.
+ */
+class HostReset {
+public:
+	HostReset(int reason, long sleepSecs = 0) : reason(reason), sleepSecs(sleepSecs) {};
+
+	int reason;
+	long sleepSecs;
+};
+
+/**
+ * @brief Everything outside the MCU: the modem, the cellular network, the cloud and the battery.
+ *
+ * The simulator provides one of these for each simulated device and installs it with
+ * HostEnvironment::setCurrent().
+ */
+class HostEnvironment {
+public:
+	virtual ~HostEnvironment() {};
+
+	virtual bool cellularReady() = 0;
+	virtual bool cellularListening() { return false; };
+	virtual void cellularOn() {};
+	virtual void cellularOff() {};
+
+	// Returns a RESP_* code and advances the clock by however long the modem took.
+	// callback is called for each response line, like the Device OS Cellular.command callback.
+	virtual int cellularCommand(const char *cmd, system_tick_t timeout, std::function<void(int type, const char *buf, int len)> callback) { return RESP_OK; };
+
+	virtual bool cloudConnected() = 0;
+	virtual void cloudConnect() {};
+	virtual void cloudDisconnect() {};
+
+	// Returns false if the publish failed. The host Particle class delivers events to matching
+	// subscriptions when cloudEcho() says so.
+	virtual bool publish(const char *eventName, const char *data) = 0;
+
+	// Return true if a publish by this device should be delivered back to its own subscriptions,
+	// and set delayMs to the round trip time.
+	virtual bool cloudEcho(const char *eventName, uint32_t &delayMs) { return false; };
+
+	virtual float batterySoC() { return 80.0; };
+	virtual float batteryVoltage() { return 4.0; };
+	virtual bool powerGood() { return true; };
+
+	// Wall clock time (Unix time) or 0 if the real-time clock has not been set yet
+	virtual time_t timeNow() { return 0; };
+
+	inline static HostEnvironment *getCurrent() { return current; };
+	inline static void setCurrent(HostEnvironment *value) { current = value; };
+
+private:
+	static HostEnvironment *current;
+};
+
+
+class Logger {
+public:
+	void trace(const char *fmt, ...);
+	void info(const char *fmt, ...);
+	void warn(const char *fmt, ...);
+	void error(const char *fmt, ...);
+
+	// Log output is discarded unless this is set, as formatting is slow when simulating a large fleet
+	static bool enabled;
+
+private:
+	void log(const char *level, const char *fmt, va_list ap);
+};
+extern Logger Log;
+
+
+class CellularClass {
+public:
+	bool ready();
+	bool listening();
+	void on();
+	void off();
+
+	int command(const char *format, ...);
+	int command(system_tick_t timeout, const char *format, ...);
+
+	template<typename T>
+	int command(int (*callback)(int type, const char *buf, int len, T *param), T *param, system_tick_t timeout, const char *format, ...) {
+		char cmd[256];
+		va_list ap;
+		va_start(ap, format);
+		vsnprintf(cmd, sizeof(cmd), format, ap);
+		va_end(ap);
+		return doCommand(cmd, timeout, [callback, param](int type, const char *buf, int len) {
+			callback(type, buf, len, param);
+		});
+	}
+
+	int doCommand(const char *cmd, system_tick_t timeout, std::function<void(int type, const char *buf, int len)> callback);
+};
+extern CellularClass Cellular;
+
+
+class CloudClass {
+public:
+	bool connected();
+	void connect();
+	void disconnect();
+	void process();
+
+	bool publish(const char *eventName, const char *data, PublishFlag flags = PUBLIC);
+	inline bool publish(const String &eventName, const char *data, PublishFlag flags = PUBLIC) { return publish(eventName.c_str(), data, flags); };
+
+	bool subscribe(const char *prefix, std::function<void(const char *, const char *)> handler, Spark_Subscription_Scope_TypeDef scope = ALL_DEVICES);
+
+	template<typename T>
+	bool subscribe(const String &prefix, void (T::*handler)(const char *, const char *), T *instance, Spark_Subscription_Scope_TypeDef scope = ALL_DEVICES) {
+		return subscribe(prefix.c_str(), [handler, instance](const char *eventName, const char *data) {
+			(instance->*handler)(eventName, data);
+		}, scope);
+	}
+
+	bool function(const char *name, std::function<int(String)> handler);
+
+	template<typename T>
+	bool function(const char *name, int (T::*handler)(String), T *instance) {
+		return function(name, [handler, instance](String arg) {
+			return (instance->*handler)(arg);
+		});
+	}
+
+	// Host only: calls a function registered with Particle.function(). Returns -1 if not registered.
+	int callFunction(const char *name, const char *arg);
+
+	// Host only: removes all subscriptions, functions and undelivered events, for a reboot
+	void clear();
+};
+extern CloudClass Particle;
+
+
+class TimeClass {
+public:
+	time_t now();
+	bool isValid();
+};
+extern TimeClass Time;
+
+
+class SystemClass {
+public:
+	void reset();
+	void enterSafeMode();
+	void sleep(Spark_Sleep_TypeDef mode, long seconds, SleepNetworkFlag flag = SLEEP_NETWORK_OFF);
+	void sleep(uint16_t wakeUpPin, InterruptMode edgeTriggerMode, long seconds, SleepNetworkFlag flag = SLEEP_NETWORK_OFF);
+	int resetReason();
+	String deviceID();
+	void enableFeature(HAL_Feature feature) {};
+
+	// The DWT cycle counter on the device. Here it's micros(), which only changes when the clock is advanced.
+	uint32_t ticks();
+	inline uint32_t ticksPerMicrosecond() { return 1; };
+
+	// Host only
+	static int hostResetReason;
+	static String hostDeviceID;
+};
+extern SystemClass System;
+
+
+class FuelGauge {
+public:
+	float getSoC();
+	float getVCell();
+};
+
+class PMIC {
+public:
+	bool isPowerGood();
+};
+
+
+/**
+ * @brief EEPROM emulation. Like on the device, it's kept across resets and sleep; the simulator
+ * erases it for each new device.
+ */
+class EEPROMClass {
+public:
+	inline size_t length() const { return HOST_EEPROM_SIZE; };
+
+	uint8_t read(int index) const;
+	void write(int index, uint8_t value);
+
+	template<typename T>
+	T &get(int index, T &value) const {
+		memcpy(&value, &hostData[index], sizeof(T));
+		return value;
+	}
+
+	template<typename T>
+	const T &put(int index, const T &value) {
+		memcpy(&hostData[index], &value, sizeof(T));
+		hostWrites++;
+		return value;
+	}
+
+	void clear();
+
+	// Host only
+	static const size_t HOST_EEPROM_SIZE = 2047; // Same as the Electron
+	uint8_t hostData[HOST_EEPROM_SIZE];
+	uint64_t hostWrites = 0; // Number of write() and put() calls
+};
+extern EEPROMClass EEPROM;
+
+
+// Software timer. On the device the callbacks run on the timer thread. Here they're called from
+// HostClock::advance(), so a timer still fires while loop() is in delay() or a slow
+// Cellular.command(), like it would on the device. They don't fire while stop mode sleeping.
+class Timer {
+public:
+	typedef std::function<void(void)> timer_callback_fn;
+
+	Timer(unsigned period, timer_callback_fn callback, bool oneShot = false);
+
+	template <typename T>
+	Timer(unsigned period, void (T::*handler)(), T &instance, bool oneShot = false) :
+		Timer(period, std::bind(handler, &instance), oneShot) {};
+
+	virtual ~Timer();
+
+	bool start(unsigned block = 0);
+	bool stop(unsigned block = 0);
+	bool reset(unsigned block = 0) { return start(block); };
+	bool changePeriod(unsigned period, unsigned block = 0);
+	bool isActive() const { return active; };
+
+	// Host only: called by HostClock::advance(). Sets when to the earliest time an active timer is
+	// due, or returns false if none are active.
+	static bool hostNextDue(uint64_t &when);
+
+	// Host only: calls the callbacks of the timers due at or before the current time
+	static void hostFire();
+
+private:
+	unsigned period;
+	timer_callback_fn callback;
+	bool oneShot;
+	bool active = false;
+	uint64_t dueAt = 0;
+	Timer *next;
+
+	static Timer *first;
+};
+
+class ApplicationWatchdog {
+public:
+	ApplicationWatchdog(unsigned timeoutMs, std::function<void(void)> fn, unsigned stackSize = 512);
+	~ApplicationWatchdog();
+
+	void checkin();
+
+	// Host only: called by HostClock::advance(). If a watchdog expires at or before toMs the clock
+	// is set to when it expired and its callback is called (which normally calls System.reset()).
+	static void hostAdvance(uint64_t toMs);
+
+	// Host only: called after each loop() returns, like Device OS does
+	static void hostCheckinAll();
+
+private:
+	unsigned timeoutMs;
+	std::function<void(void)> fn;
+	uint64_t lastCheckin;
+	ApplicationWatchdog *next;
+
+	static ApplicationWatchdog *first;
+};
+
+
+inline system_tick_t millis() { return HostClock::millis(); }
+inline unsigned long micros() { return (unsigned long)HostClock::millis() * 1000; }
+inline void delay(unsigned long ms) { HostClock::advance(ms); }
+inline void pinMode(uint16_t pin, PinMode mode) {}
+
+#endif /* __PARTICLE_H */
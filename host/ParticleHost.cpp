@@ -0,0 +1,392 @@
+// Implementation of the host stand-in for the Device OS API. See Particle.h.
+
+#include "Particle.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+uint64_t HostClock::nowMs = 0;
+uint64_t HostClock::bootMs = 0;
+
+HostEnvironment *HostEnvironment::current = NULL;
+
+bool Logger::enabled = false;
+int SystemClass::hostResetReason = RESET_REASON_POWER_DOWN;
+String SystemClass::hostDeviceID = "000000000000000000000000";
+
+ApplicationWatchdog *ApplicationWatchdog::first = NULL;
+
+Logger Log;
+CellularClass Cellular;
+CloudClass Particle;
+TimeClass Time;
+SystemClass System;
+EEPROMClass EEPROM;
+
+// Cloud state that's lost on reboot
+typedef struct {
+	uint64_t deliverAt;
+	std::string eventName;
+	std::string data;
+} PendingEvent;
+
+static std::vector<std::pair<std::string, std::function<void(const char *, const char *)> > > subscriptions;
+static std::vector<std::pair<std::string, std::function<int(String)> > > functions;
+static std::vector<PendingEvent> pendingEvents;
+
+// static
+void HostClock::advance(uint64_t ms) {
+	uint64_t toMs = nowMs + ms;
+
+	// Timers and application watchdogs fire in the order they're due
+	uint64_t timerAt = 0;
+	while(Timer::hostNextDue(timerAt) && timerAt <= toMs) {
+		ApplicationWatchdog::hostAdvance((timerAt > nowMs) ? timerAt : nowMs);
+		Timer::hostFire();
+	}
+	ApplicationWatchdog::hostAdvance(toMs);
+}
+
+
+void Logger::trace(const char *fmt, ...) {
+	if (enabled) {
+		va_list ap;
+		va_start(ap, fmt);
+		log("TRACE", fmt, ap);
+		va_end(ap);
+	}
+}
+
+void Logger::info(const char *fmt, ...) {
+	if (enabled) {
+		va_list ap;
+		va_start(ap, fmt);
+		log("INFO", fmt, ap);
+		va_end(ap);
+	}
+}
+
+void Logger::warn(const char *fmt, ...) {
+	if (enabled) {
+		va_list ap;
+		va_start(ap, fmt);
+		log("WARN", fmt, ap);
+		va_end(ap);
+	}
+}
+
+void Logger::error(const char *fmt, ...) {
+	if (enabled) {
+		va_list ap;
+		va_start(ap, fmt);
+		log("ERROR", fmt, ap);
+		va_end(ap);
+	}
+}
+
+void Logger::log(const char *level, const char *fmt, va_list ap) {
+	fprintf(stderr, "%010lu [app] %s: ", (unsigned long)millis(), level);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+}
+
+
+bool CellularClass::ready() {
+	return HostEnvironment::getCurrent()->cellularReady();
+}
+
+bool CellularClass::listening() {
+	return HostEnvironment::getCurrent()->cellularListening();
+}
+
+void CellularClass::on() {
+	HostEnvironment::getCurrent()->cellularOn();
+}
+
+void CellularClass::off() {
+	HostEnvironment::getCurrent()->cellularOff();
+}
+
+int CellularClass::command(const char *format, ...) {
+	char cmd[256];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(cmd, sizeof(cmd), format, ap);
+	va_end(ap);
+	return doCommand(cmd, 10000, NULL);
+}
+
+int CellularClass::command(system_tick_t timeout, const char *format, ...) {
+	char cmd[256];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(cmd, sizeof(cmd), format, ap);
+	va_end(ap);
+	return doCommand(cmd, timeout, NULL);
+}
+
+int CellularClass::doCommand(const char *cmd, system_tick_t timeout, std::function<void(int type, const char *buf, int len)> callback) {
+	return HostEnvironment::getCurrent()->cellularCommand(cmd, timeout, callback);
+}
+
+
+bool CloudClass::connected() {
+	return HostEnvironment::getCurrent()->cloudConnected();
+}
+
+void CloudClass::connect() {
+	HostEnvironment::getCurrent()->cloudConnect();
+}
+
+void CloudClass::disconnect() {
+	HostEnvironment::getCurrent()->cloudDisconnect();
+}
+
+// Delivers events published by this device back to its own subscriptions once the simulated
+// round trip time has elapsed. The simulator calls this between calls to loop().
+void CloudClass::process() {
+	if (pendingEvents.empty() || !connected()) {
+		return;
+	}
+
+	for(size_t ii = 0; ii < pendingEvents.size(); ) {
+		if (pendingEvents[ii].deliverAt > HostClock::now()) {
+			ii++;
+			continue;
+		}
+		PendingEvent ev = pendingEvents[ii];
+		pendingEvents.erase(pendingEvents.begin() + ii);
+
+		for(size_t jj = 0; jj < subscriptions.size(); jj++) {
+			if (ev.eventName.compare(0, subscriptions[jj].first.length(), subscriptions[jj].first) == 0) {
+				subscriptions[jj].second(ev.eventName.c_str(), ev.data.c_str());
+			}
+		}
+	}
+}
+
+bool CloudClass::publish(const char *eventName, const char *data, PublishFlag flags) {
+	HostEnvironment *env = HostEnvironment::getCurrent();
+	if (!env->cloudConnected() || !env->publish(eventName, data)) {
+		return false;
+	}
+
+	uint32_t delayMs;
+	if (env->cloudEcho(eventName, delayMs)) {
+		PendingEvent ev;
+		ev.deliverAt = HostClock::now() + delayMs;
+		ev.eventName = eventName;
+		ev.data = data;
+		pendingEvents.push_back(ev);
+	}
+	return true;
+}
+
+bool CloudClass::subscribe(const char *prefix, std::function<void(const char *, const char *)> handler, Spark_Subscription_Scope_TypeDef scope) {
+	subscriptions.push_back(std::make_pair(std::string(prefix), handler));
+	return true;
+}
+
+bool CloudClass::function(const char *name, std::function<int(String)> handler) {
+	functions.push_back(std::make_pair(std::string(name), handler));
+	return true;
+}
+
+int CloudClass::callFunction(const char *name, const char *arg) {
+	for(size_t ii = 0; ii < functions.size(); ii++) {
+		if (functions[ii].first == name) {
+			return functions[ii].second(String(arg));
+		}
+	}
+	return -1;
+}
+
+void CloudClass::clear() {
+	subscriptions.clear();
+	functions.clear();
+	pendingEvents.clear();
+}
+
+
+time_t TimeClass::now() {
+	return HostEnvironment::getCurrent()->timeNow();
+}
+
+bool TimeClass::isValid() {
+	return HostEnvironment::getCurrent()->timeNow() != 0;
+}
+
+
+void SystemClass::reset() {
+	throw HostReset(RESET_REASON_USER);
+}
+
+void SystemClass::enterSafeMode() {
+	throw HostReset(RESET_REASON_SAFE_MODE);
+}
+
+void SystemClass::sleep(Spark_Sleep_TypeDef mode, long seconds, SleepNetworkFlag flag) {
+	throw HostReset(RESET_REASON_POWER_MANAGEMENT, seconds);
+}
+
+void SystemClass::sleep(uint16_t wakeUpPin, InterruptMode edgeTriggerMode, long seconds, SleepNetworkFlag flag) {
+	// Stop mode sleep: execution continues afterwards, but the modem is turned off unless
+	// SLEEP_NETWORK_STANDBY. The application watchdog does not run while sleeping.
+	HostEnvironment *env = HostEnvironment::getCurrent();
+	if (flag != SLEEP_NETWORK_STANDBY) {
+		env->cellularOff();
+	}
+	HostClock::set(HostClock::now() + (uint64_t)seconds * 1000);
+	ApplicationWatchdog::hostCheckinAll();
+	if (flag != SLEEP_NETWORK_STANDBY) {
+		env->cellularOn();
+	}
+}
+
+int SystemClass::resetReason() {
+	return hostResetReason;
+}
+
+String SystemClass::deviceID() {
+	return hostDeviceID;
+}
+
+uint32_t SystemClass::ticks() {
+	return (uint32_t)micros();
+}
+
+
+float FuelGauge::getSoC() {
+	return HostEnvironment::getCurrent()->batterySoC();
+}
+
+float FuelGauge::getVCell() {
+	return HostEnvironment::getCurrent()->batteryVoltage();
+}
+
+bool PMIC::isPowerGood() {
+	return HostEnvironment::getCurrent()->powerGood();
+}
+
+
+uint8_t EEPROMClass::read(int index) const {
+	return hostData[index];
+}
+
+void EEPROMClass::write(int index, uint8_t value) {
+	hostData[index] = value;
+	hostWrites++;
+}
+
+void EEPROMClass::clear() {
+	// Erased flash reads as 0xff
+	memset(hostData, 0xff, sizeof(hostData));
+}
+
+
+Timer *Timer::first;
+
+Timer::Timer(unsigned period, timer_callback_fn callback, bool oneShot) :
+	period(period), callback(callback), oneShot(oneShot), next(first) {
+	first = this;
+}
+
+Timer::~Timer() {
+	for(Timer **pp = &first; *pp; pp = &(*pp)->next) {
+		if (*pp == this) {
+			*pp = next;
+			break;
+		}
+	}
+}
+
+bool Timer::start(unsigned block) {
+	active = true;
+	dueAt = HostClock::now() + period;
+	return true;
+}
+
+bool Timer::stop(unsigned block) {
+	active = false;
+	return true;
+}
+
+bool Timer::changePeriod(unsigned period, unsigned block) {
+	this->period = period;
+	return start(block);
+}
+
+// static
+bool Timer::hostNextDue(uint64_t &when) {
+	bool found = false;
+	for(Timer *t = first; t; t = t->next) {
+		if (t->active && (!found || t->dueAt < when)) {
+			when = t->dueAt;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// static
+void Timer::hostFire() {
+	uint64_t now = HostClock::now();
+	for(Timer *t = first; t; t = t->next) {
+		if (t->active && t->dueAt <= now) {
+			if (t->oneShot) {
+				t->active = false;
+			}
+			else {
+				// Ticks missed while stop mode sleeping are skipped, not made up
+				t->dueAt += t->period;
+				if (t->dueAt <= now) {
+					t->dueAt = now + t->period;
+				}
+			}
+			// May throw HostReset, which ends the loop
+			t->callback();
+		}
+	}
+}
+
+
+ApplicationWatchdog::ApplicationWatchdog(unsigned timeoutMs, std::function<void(void)> fn, unsigned stackSize) :
+	timeoutMs(timeoutMs), fn(fn), lastCheckin(HostClock::now()), next(first) {
+	first = this;
+}
+
+ApplicationWatchdog::~ApplicationWatchdog() {
+	for(ApplicationWatchdog **pp = &first; *pp; pp = &(*pp)->next) {
+		if (*pp == this) {
+			*pp = next;
+			break;
+		}
+	}
+}
+
+void ApplicationWatchdog::checkin() {
+	lastCheckin = HostClock::now();
+}
+
+// static
+void ApplicationWatchdog::hostAdvance(uint64_t toMs) {
+	for(ApplicationWatchdog *wd = first; wd; wd = wd->next) {
+		uint64_t expiresAt = wd->lastCheckin + wd->timeoutMs;
+		if (expiresAt <= toMs) {
+			if (expiresAt > HostClock::now()) {
+				HostClock::set(expiresAt);
+			}
+			wd->lastCheckin = HostClock::now();
+			wd->fn();
+		}
+	}
+	HostClock::set(toMs);
+}
+
+// static
+void ApplicationWatchdog::hostCheckinAll() {
+	for(ApplicationWatchdog *wd = first; wd; wd = wd->next) {
+		wd->checkin();
+	}
+}
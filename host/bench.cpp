@@ -0,0 +1,361 @@
+// Microbenchmarks for the event logging and serialization hot paths
+//
+// These run on the host using the Device OS stand-in, so the absolute numbers are much smaller
+// than on the Cortex-M3 in an Electron. They're intended for comparing changes: if a change makes
+// one of these slower on the host, it will be slower on the device as well.
+//
+// Usage:
+//	./build/bench [iterations]
+
+#include "Particle.h"
+
+#include "BatteryCheck.h"
+#include "Breadcrumbs.h"
+#include "ConnectionCheck.h"
+#include "ConnectionEvents.h"
+#include "LoopProfiler.h"
+#include "ModuleScheduler.h"
+#include "SessionCheck.h"
+#include "Tester.h"
+
+#include <time.h>
+
+// Provided by the linker for the section the retained macro uses
+extern char __start_retained_user[];
+extern char __stop_retained_user[];
+
+/**
+ * @brief Always connected, and remembers the size of each publish
+ */
+class BenchEnvironment : public HostEnvironment {
+public:
+	virtual bool cellularReady() { return true; };
+	virtual bool cloudConnected() { return true; };
+	virtual bool publish(const char *eventName, const char *data) {
+		publishes++;
+		publishBytes += strlen(data);
+		return true;
+	};
+	virtual time_t timeNow() { return 1538352000 + (time_t)(HostClock::now() / 1000); };
+
+	unsigned long publishes = 0;
+	unsigned long publishBytes = 0;
+};
+
+static BenchEnvironment env;
+
+static inline uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Cost of the timing calls themselves, subtracted from single operation measurements
+static uint64_t timerOverheadNs() {
+	const int reps = 100000;
+	uint64_t total = 0;
+	for(int ii = 0; ii < reps; ii++) {
+		uint64_t start = nowNs();
+		total += nowNs() - start;
+	}
+	return total / reps;
+}
+
+static void clearEventLog() {
+	memset(__start_retained_user, 0, __stop_retained_user - __start_retained_user);
+}
+
+// Adds count events with realistic codes and data
+static void fillEventLog(ConnectionEvents &connectionEvents, size_t count) {
+	for(size_t ii = 0; ii < count; ii++) {
+		HostClock::advance(1234);
+		connectionEvents.add(ConnectionEvents::CONNECTION_EVENT_CELLULAR_READY + (ii % 2), ii & 1);
+	}
+}
+
+static void printResult(const char *name, double nsPerOp, unsigned long ops, const char *extra = "") {
+	printf("%-40s %10.1f ns/op %10lu ops  %s\n", name, nsPerOp, ops, extra);
+}
+
+static void benchAdd(ConnectionEvents &connectionEvents, unsigned long iterations, uint64_t overhead) {
+	// Under capacity: adds into an empty log, cleared after every 31 adds so it never becomes full
+	{
+		uint64_t total = 0;
+		unsigned long ops = 0;
+		while(ops < iterations) {
+			clearEventLog();
+			uint64_t start = nowNs();
+			for(size_t ii = 0; ii < CONNECTION_EVENTS_MAX_EVENTS - 1; ii++) {
+				connectionEvents.add(ConnectionEvents::CONNECTION_EVENT_TESTER_PING, (int)ii);
+			}
+			total += nowNs() - start - overhead;
+			ops += CONNECTION_EVENTS_MAX_EVENTS - 1;
+		}
+		printResult("add (under capacity)", (double)total / ops, ops);
+	}
+
+	// At capacity: every add discards the oldest event
+	{
+		clearEventLog();
+		fillEventLog(connectionEvents, CONNECTION_EVENTS_MAX_EVENTS);
+
+		uint64_t start = nowNs();
+		for(unsigned long ii = 0; ii < iterations; ii++) {
+			connectionEvents.add(ConnectionEvents::CONNECTION_EVENT_TESTER_PING, (int)ii);
+		}
+		uint64_t total = nowNs() - start - overhead;
+		printResult("add (at capacity, evicting oldest)", (double)total / iterations, iterations);
+	}
+
+	// Single add at specific fill levels
+	const size_t fillLevels[] = { 0, 8, 16, 24, 31 };
+	for(size_t level = 0; level < sizeof(fillLevels) / sizeof(fillLevels[0]); level++) {
+		unsigned long reps = iterations / 10 + 1;
+		uint64_t total = 0;
+		for(unsigned long ii = 0; ii < reps; ii++) {
+			clearEventLog();
+			fillEventLog(connectionEvents, fillLevels[level]);
+
+			uint64_t start = nowNs();
+			connectionEvents.add(ConnectionEvents::CONNECTION_EVENT_TESTER_PING, (int)ii);
+			uint64_t elapsed = nowNs() - start;
+			total += (elapsed > overhead) ? (elapsed - overhead) : 0;
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "add (fill level %u/%u)", (unsigned)fillLevels[level], (unsigned)CONNECTION_EVENTS_MAX_EVENTS);
+		printResult(name, (double)total / reps, reps);
+	}
+}
+
+static void benchAddRepeat(unsigned long iterations, uint64_t overhead) {
+	// The same event over and over, each collapsed into the REPEAT record after the first one
+	ConnectionEvents connectionEvents("connEventStats");
+	clearEventLog();
+
+	const int code = ConnectionEvents::CONNECTION_EVENT_SESSION_EVENT_LOST;
+	connectionEvents.add(code);
+	connectionEvents.add(code);
+
+	uint64_t start = nowNs();
+	for(unsigned long ii = 0; ii < iterations; ii++) {
+		connectionEvents.add(code);
+	}
+	uint64_t total = nowNs() - start - overhead;
+
+	char extra[64];
+	snprintf(extra, sizeof(extra), "%u records in the log", (unsigned)connectionEvents.getEventCount());
+	printResult("add (repeat, collapsed)", (double)total / iterations, iterations, extra);
+}
+
+static void benchMark(unsigned long iterations, uint64_t overhead) {
+	// New stage each time, then the same stage over and over, which only updates the time
+	clearEventLog();
+	Breadcrumbs breadcrumbs;
+	breadcrumbs.setup();
+
+	uint64_t start = nowNs();
+	for(unsigned long ii = 0; ii < iterations; ii++) {
+		Breadcrumbs::mark((uint8_t)(BREADCRUMB_CONNECTION_MONITOR + (ii & 1)));
+	}
+	uint64_t total = nowNs() - start - overhead;
+	printResult("Breadcrumbs::mark()", (double)total / iterations, iterations);
+
+	start = nowNs();
+	for(unsigned long ii = 0; ii < iterations; ii++) {
+		Breadcrumbs::mark(BREADCRUMB_CONNECTION_MONITOR);
+	}
+	total = nowNs() - start - overhead;
+	printResult("Breadcrumbs::mark() (same stage)", (double)total / iterations, iterations);
+}
+
+static void benchLoop(ConnectionEvents &connectionEvents, const char *name, unsigned long iterations, uint64_t overhead) {
+	// Each loop() call publishes one batch from a full log. The log is refilled, and the clock
+	// advanced past the publish rate limit, outside of the timed part.
+	unsigned long reps = iterations / 10 + 1;
+	uint64_t total = 0;
+	unsigned long publishes = 0, publishBytes = 0;
+
+	clearEventLog();
+	for(unsigned long ii = 0; ii < reps; ii++) {
+		if (connectionEvents.getEventCount() == 0) {
+			fillEventLog(connectionEvents, CONNECTION_EVENTS_MAX_EVENTS);
+		}
+		HostClock::advance(ConnectionEvents::PUBLISH_MIN_PERIOD_MS);
+
+		unsigned long beforeBytes = env.publishBytes;
+		unsigned long beforePublishes = env.publishes;
+
+		uint64_t start = nowNs();
+		connectionEvents.loop();
+		uint64_t elapsed = nowNs() - start;
+		total += (elapsed > overhead) ? (elapsed - overhead) : 0;
+
+		if (env.publishes != beforePublishes) {
+			publishes++;
+			publishBytes += env.publishBytes - beforeBytes;
+		}
+	}
+
+	// Records per publish: a full log of 32 records takes this many publishes to send
+	unsigned long records = 0, fullLogPublishes = 0;
+	clearEventLog();
+	fillEventLog(connectionEvents, CONNECTION_EVENTS_MAX_EVENTS);
+	while(connectionEvents.getEventCount() > 0 && fullLogPublishes < 100) {
+		HostClock::advance(ConnectionEvents::PUBLISH_MIN_PERIOD_MS);
+		unsigned long before = env.publishes;
+		connectionEvents.loop();
+		fullLogPublishes += env.publishes - before;
+	}
+	records = CONNECTION_EVENTS_MAX_EVENTS;
+
+	char extra[128];
+	snprintf(extra, sizeof(extra), "%.1f bytes/publish, %.1f records/publish",
+		publishes ? (double)publishBytes / publishes : 0.0,
+		fullLogPublishes ? (double)records / fullLogPublishes : 0.0);
+	printResult(name, (double)total / reps, reps, extra);
+}
+
+static void benchProcessOptions(Tester &tester, unsigned long iterations, uint64_t overhead) {
+	const char *commands[] = { "ping start 30", "ping stop", "sleep stop 15", "unknownCommand a b c d" };
+
+	for(size_t cmd = 0; cmd < sizeof(commands) / sizeof(commands[0]); cmd++) {
+		char buf[64];
+		uint64_t total = 0;
+
+		for(unsigned long ii = 0; ii < iterations; ii++) {
+			// processOptions modifies the buffer as it parses it
+			strcpy(buf, commands[cmd]);
+
+			uint64_t start = nowNs();
+			tester.processOptions(buf);
+			uint64_t elapsed = nowNs() - start;
+			total += (elapsed > overhead) ? (elapsed - overhead) : 0;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "processOptions \"%s\"", commands[cmd]);
+		printResult(name, (double)total / iterations, iterations);
+	}
+}
+
+static void benchCommandQueue(Tester &tester, unsigned long iterations, uint64_t overhead) {
+	// A burst of function calls queued from the system thread, then run by loop()
+	const size_t burst = Tester::COMMAND_QUEUE_SIZE;
+	uint64_t total = 0;
+
+	for(unsigned long ii = 0; ii < iterations; ii++) {
+		uint64_t start = nowNs();
+		for(size_t jj = 0; jj < burst; jj++) {
+			tester.functionHandler("ping stop");
+		}
+		tester.loop();
+		uint64_t elapsed = nowNs() - start;
+		total += (elapsed > overhead) ? (elapsed - overhead) : 0;
+	}
+
+	char extra[64];
+	snprintf(extra, sizeof(extra), "%u dropped", (unsigned)tester.getCommandOverflows());
+	printResult("functionHandler + loop (per command)", (double)total / (iterations * burst), iterations * burst, extra);
+}
+
+static void benchModuleLoops(ConnectionEvents &connectionEvents, Tester &tester, unsigned long iterations, uint64_t overhead) {
+	// A connected device with nothing to do, with loop() called every millisecond. Compares calling
+	// every module's loop() against letting ModuleScheduler run only the ones that are due.
+	BatteryCheck batteryCheck;
+	SessionCheck sessionCheck(3600);
+	ConnectionCheck connectionCheck;
+	clearEventLog();
+
+	// Nothing echoes the session check event here, so mark the session as recently confirmed so
+	// a check isn't started (and failed, resetting the modem) during the measurements
+	sessionCheck.setup();
+	SessionCheck::reportCloudActivity();
+
+	{
+		uint64_t total = 0;
+		for(unsigned long ii = 0; ii < iterations; ii++) {
+			HostClock::advance(1);
+			uint64_t start = nowNs();
+			batteryCheck.loop();
+			sessionCheck.loop();
+			connectionCheck.loop();
+			connectionEvents.loop();
+			tester.loop();
+			uint64_t elapsed = nowNs() - start;
+			total += (elapsed > overhead) ? (elapsed - overhead) : 0;
+		}
+		printResult("every module loop() (idle, 1 ms)", (double)total / iterations, iterations);
+	}
+
+	{
+		ModuleScheduler moduleScheduler;
+		moduleScheduler.withModule(batteryCheck).withModule(sessionCheck).withModule(connectionCheck)
+			.withModule(connectionEvents).withModule(tester);
+
+		uint64_t total = 0;
+		for(unsigned long ii = 0; ii < iterations; ii++) {
+			HostClock::advance(1);
+			uint64_t start = nowNs();
+			moduleScheduler.loop();
+			uint64_t elapsed = nowNs() - start;
+			total += (elapsed > overhead) ? (elapsed - overhead) : 0;
+		}
+		printResult("ModuleScheduler loop() (idle, 1 ms)", (double)total / iterations, iterations);
+	}
+
+	{
+		LoopProfiler loopProfiler;
+		loopProfiler.setup();
+		ModuleScheduler moduleScheduler;
+		moduleScheduler.withModule(batteryCheck).withModule(sessionCheck).withModule(connectionCheck)
+			.withModule(connectionEvents).withModule(tester).withProfiler(loopProfiler);
+
+		uint64_t total = 0;
+		for(unsigned long ii = 0; ii < iterations; ii++) {
+			HostClock::advance(1);
+			uint64_t start = nowNs();
+			moduleScheduler.loop();
+			uint64_t elapsed = nowNs() - start;
+			total += (elapsed > overhead) ? (elapsed - overhead) : 0;
+		}
+		printResult("ModuleScheduler loop() (profiled)", (double)total / iterations, iterations);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long iterations = 1000000;
+	if (argc >= 2) {
+		iterations = strtoul(argv[1], NULL, 0);
+		if (iterations == 0) {
+			printf("usage: bench [iterations]\n");
+			return 1;
+		}
+	}
+
+	HostEnvironment::setCurrent(&env);
+	HostClock::set(0);
+	HostClock::boot();
+
+	uint64_t overhead = timerOverheadNs();
+	printf("timer overhead %lu ns (subtracted)\n", (unsigned long)overhead);
+
+	// The log is filled with a few repeating codes, which would otherwise just be collapsed into
+	// REPEAT records
+	ConnectionEvents connectionEvents("connEventStats");
+	connectionEvents.withRepeatWindow(0);
+	benchAdd(connectionEvents, iterations, overhead);
+	benchAddRepeat(iterations, overhead);
+	benchMark(iterations, overhead);
+	benchLoop(connectionEvents, "loop (text encoding, full log)", iterations, overhead);
+
+	connectionEvents.withEncoding(ConnectionEvents::ENCODING_COMPACT);
+	benchLoop(connectionEvents, "loop (compact encoding, full log)", iterations, overhead);
+
+	Tester tester("testerFn");
+	benchProcessOptions(tester, iterations / 10 + 1, overhead);
+	benchCommandQueue(tester, iterations / 10 + 1, overhead);
+
+	benchModuleLoops(connectionEvents, tester, iterations / 10 + 1, overhead);
+
+	return 0;
+}
@@ -0,0 +1,197 @@
+// Native decoder for recorded connection event log publishes
+//
+// Does the same thing as the node.js event-decoder, but reads recorded event streams from files
+// or stdin instead of subscribing, and is fast enough to go through months of fleet data. The
+// output is the same CSV: device name, time (UTC), millis, event.
+//
+// Recordings can be server-sent events, as saved by:
+//	curl -N https://api.particle.io/v1/devices/events/connEventStats?access_token=$AUTH_TOKEN > events.txt
+//
+// or JSON lines, one event per line, as printed by particle subscribe.
+//
+// With --analyze, the events aren't printed. Instead, uptime, outage and reset metrics are worked out
+// for each device and the whole fleet in the same pass (see FleetAnalytics.h).
+//
+// Usage:
+//	./build/eventdecoder [options] [file...]
+//
+// Run with --help for all of the options.
+
+#include "EventStream.h"
+#include "FleetAnalytics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/time.h>
+
+static void usage() {
+	printf("usage: eventdecoder [options] [file...]\n");
+	printf("Reads stdin if there are no files, or for a file named -\n");
+	printf("  --event PREFIX           only decode events whose names start with PREFIX (default connEventStats)\n");
+	printf("  --names FILE             device names, one deviceId,name per line; devices not listed use the device ID\n");
+	printf("  --analyze                print fleet reliability metrics instead of the events\n");
+	printf("  --device-report FILE     with --analyze, also write the metrics for each device to FILE as CSV\n");
+	printf("  --stats                  print throughput and error counts to stderr when done\n");
+}
+
+// Reads a CSV of deviceId,name
+static bool loadNames(const char *path, std::map<std::string, std::string> &names) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return false;
+	}
+	char line[256];
+	while(fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		char *comma = strchr(line, ',');
+		if (comma) {
+			*comma = 0;
+			names[line] = comma + 1;
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	const char *eventPrefix = "connEventStats";
+	std::map<std::string, std::string> names;
+	std::vector<const char *> files;
+	bool stats = false;
+	bool analyze = false;
+	const char *deviceReport = NULL;
+
+	for(int ii = 1; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		const char *value = (ii + 1 < argc) ? argv[ii + 1] : "";
+
+		if (arg == "--event") { eventPrefix = value; ii++; }
+		else if (arg == "--names") {
+			if (!loadNames(value, names)) {
+				fprintf(stderr, "could not read %s\n", value);
+				return 1;
+			}
+			ii++;
+		}
+		else if (arg == "--analyze") { analyze = true; }
+		else if (arg == "--device-report") { deviceReport = value; analyze = true; ii++; }
+		else if (arg == "--stats") { stats = true; }
+		else if (arg == "-" || arg[0] != '-') { files.push_back(argv[ii]); }
+		else {
+			usage();
+			return (arg == "--help") ? 0 : 1;
+		}
+	}
+	if (files.empty()) {
+		files.push_back("-");
+	}
+
+	// Output is built up in a buffer and written in large blocks
+	std::string out;
+	out.reserve(EventStreamParser::READ_BLOCK_SIZE + 4096);
+
+	std::vector<EventRecord> records;
+	std::string lastCoreid, lastDeviceName;
+	uint32_t lastDate = 0;
+	std::string lastDateStr = "no date";
+	uint64_t numRecords = 0, malformed = 0;
+	FleetAnalytics analytics;
+
+	EventStreamParser parser([&](const StreamEvent &event) {
+		// Events from one device tend to come in runs, so cache the name lookup
+		if (lastCoreid.size() != event.coreid.len || memcmp(lastCoreid.data(), event.coreid.str, event.coreid.len) != 0) {
+			lastCoreid.assign(event.coreid.str, event.coreid.len);
+			auto it = names.find(lastCoreid);
+			lastDeviceName = (it != names.end()) ? it->second : lastCoreid;
+		}
+
+		records.clear();
+		if (!decodeEventData(event.data, records)) {
+			fprintf(stderr, "malformed event data from %s: %s\n", lastCoreid.c_str(), event.data.toString().c_str());
+			malformed++;
+		}
+		numRecords += records.size();
+
+		if (analyze) {
+			for(const EventRecord &rec : records) {
+				analytics.add(event.coreid, rec);
+			}
+			return;
+		}
+		for(const EventRecord &rec : records) {
+			if (rec.tsDate != lastDate) {
+				lastDate = rec.tsDate;
+				lastDateStr.clear();
+				appendDate(lastDateStr, rec.tsDate);
+			}
+			out += lastDeviceName;
+			out += ',';
+			out += lastDateStr;
+			out += ',';
+			appendUnsigned(out, rec.tsMillis);
+			out += ',';
+			appendEventString(out, rec.eventCode, rec.data);
+			out += '\n';
+		}
+		if (out.size() >= EventStreamParser::READ_BLOCK_SIZE) {
+			fwrite(out.data(), 1, out.size(), stdout);
+			out.clear();
+		}
+	});
+	parser.withEventPrefix(eventPrefix);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	int result = 0;
+	for(const char *path : files) {
+		FILE *fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+		if (!fp) {
+			fprintf(stderr, "could not open %s\n", path);
+			result = 1;
+			continue;
+		}
+		if (!parser.parseFile(fp)) {
+			fprintf(stderr, "error reading %s\n", path);
+			result = 1;
+		}
+		if (fp != stdin) {
+			fclose(fp);
+		}
+	}
+	fwrite(out.data(), 1, out.size(), stdout);
+
+	if (analyze) {
+		analytics.finish();
+		analytics.printSummary(stdout);
+
+		if (deviceReport) {
+			FILE *fp = fopen(deviceReport, "w");
+			if (fp) {
+				analytics.printDevices(fp, names);
+				fclose(fp);
+			}
+			else {
+				fprintf(stderr, "could not write %s\n", deviceReport);
+				result = 1;
+			}
+		}
+	}
+	fflush(stdout);
+
+	gettimeofday(&end, NULL);
+	double elapsedSecs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+	if (stats) {
+		fprintf(stderr, "%llu bytes, %llu lines, %llu events, %llu records, %llu malformed in %.3f sec (%.1f MB/sec)\n",
+			(unsigned long long)parser.getBytes(), (unsigned long long)parser.getLines(),
+			(unsigned long long)parser.getEvents(), (unsigned long long)numRecords, (unsigned long long)malformed,
+			elapsedSecs, (elapsedSecs > 0) ? parser.getBytes() / elapsedSecs / 1000000.0 : 0.0);
+	}
+	return result;
+}
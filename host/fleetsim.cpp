@@ -0,0 +1,1057 @@
+// Fleet simulator for the electronsample library
+//
+// Runs the same set of modules as examples/1-full-electronsample on a large number of simulated
+// devices, each with its own simulated modem, cellular network, cloud and retained memory, all on
+// a virtual clock. Network outages, stuck modems and broken cloud sessions are injected as
+// discrete events and the simulator reports how much publishing the library does and how
+// quickly devices recover.
+//
+// The library keeps its state in globals and static members, so devices are simulated one at a
+// time. Retained memory is cleared between devices and preserved across simulated reboots.
+//
+// Usage:
+//	./build/fleetsim --devices 1000 --hours 24 --fleet-outage 6,30
+//
+// Run with --help for all of the options.
+
+#include "Particle.h"
+
+#include "AppWatchdogWrapper.h"
+#include "BatteryCheck.h"
+#include "Breadcrumbs.h"
+#include "ConnectionCheck.h"
+#include "ConnectionEvents.h"
+#include "ConnectionEventSpool.h"
+#include "HeartbeatWatchdog.h"
+#include "LogHistogram.h"
+#include "LoopProfiler.h"
+#include "ModuleScheduler.h"
+#include "PowerState.h"
+#include "PublishScheduler.h"
+#include "SessionCheck.h"
+#include "Tester.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/time.h>
+
+// Provided by the linker for the section the retained macro uses
+extern char __start_retained_user[];
+extern char __stop_retained_user[];
+
+// Unix time when the simulation starts (2018-10-01T00:00:00Z)
+static const time_t SIM_EPOCH = 1538352000;
+static const uint64_t HANG_MS = 10 * 60000; // How long a hung AT+CFUN=16 blocks, with --hang
+
+// With --record, every event that reaches the cloud is written here as a JSON line, like particle subscribe
+static FILE *recordFile = NULL;
+
+typedef struct {
+	int devices = 100;
+	double hours = 24.0;
+	unsigned long seed = 1;
+	unsigned long stepMs = 250;
+	double outagesPerDay = 2.0;
+	double meanOutageMin = 10.0;
+	double stuckProbability = 0.1;
+	double sessionBreaksPerDay = 0.2;
+	long sessionMinSecs = 15 * 60;
+	long sessionMaxSecs = 2 * 3600;
+	size_t sessionProbes = 3;
+	double echoLoss = 0.0;
+	double fleetOutageHour = -1.0;
+	double fleetOutageMin = 30.0;
+	double registerSecs = 20.0;
+	double handshakeSecs = 5.0;
+	unsigned long rttMs = 400;
+	float soc = 80.0;
+	bool powerGood = true;
+	double drainPctPerHour = 0.0; // While awake; 0 keeps the SoC fixed at soc
+	double sleepDrainPctPerHour = 0.05;
+	double solarPctPerHour = 0.0; // Peak charge rate at midday
+	double socNoise = 0.0; // Standard deviation of the fuel gauge reading
+	bool powerTiers = false;
+	bool profile = false;
+	bool heartbeat = false;
+	double hangProbability = 0.0; // Of each AT+CFUN=16 never returning
+	bool compact = false;
+	bool scheduler = true;
+	bool moduleScheduler = true;
+	bool spool = true;
+	double testerCallHour = -1.0;
+	std::string testerCall;
+	size_t batchFillBytes = 0;
+	unsigned long batchMaxHoldMs = 0;
+	bool verbose = false;
+} SimConfig;
+
+// One module's entries from the loopStats publishes, added up
+typedef struct {
+	uint64_t calls = 0;
+	uint64_t slow = 0;
+	uint32_t maxUs = 0;
+	std::vector<uint32_t> p99Us; // From each publish
+} ModuleLoopTotals;
+
+// Things that are counted across the whole fleet
+typedef struct {
+	uint64_t publishes = 0;
+	uint64_t publishBytes = 0;
+	uint64_t rateLimited = 0;
+	std::map<std::string, uint64_t> publishesByName;
+	std::map<int, uint64_t> resetsByReason;
+	uint64_t modemResets = 0;
+	uint64_t hangs = 0; // AT+CFUN=16 commands that didn't return, with --hang
+	uint64_t hangResets = 0; // Of those, the ones a watchdog reset
+	uint64_t hangResetMs = 0; // Total time from the hang to the reset
+	uint64_t pings = 0;
+	uint64_t cloudDownMs = 0;
+	uint64_t simulatedMs = 0;
+	uint64_t loopCalls = 0;
+	uint64_t eventsDiscarded = 0;
+	ConnectionEventStats events = {}; // Summed over all of the devices
+	uint64_t eepromWrites = 0;
+	uint64_t asleepMs = 0;
+	uint64_t brownouts = 0; // Times the battery ran out while awake
+	uint64_t brownoutMs = 0;
+	uint64_t powerTierMs[NUM_POWER_TIERS] = {}; // Time awake in each tier, with --power-tiers
+	uint64_t sessionProbesSent = 0;
+	uint64_t sessionProbesReceived = 0;
+	LogHistogram sessionRtt = LogHistogram(); // Each device's moving average round trip time at the end of the run
+	std::vector<uint64_t> recoveryMs;
+	std::map<uint64_t, uint64_t> reconnectsByMinute;
+	std::map<std::string, LogHistogram> histograms; // Merged from the connHistograms publishes
+	std::vector<std::string> moduleNames; // In ModuleScheduler order, for the loopStats publishes
+	std::map<size_t, ModuleLoopTotals> loopTotals; // Merged from the loopStats publishes, by module index
+	std::map<unsigned, uint64_t> trailsByLastStage; // Breadcrumb trails published, by the newest stage
+} FleetStats;
+
+// Injected environment events
+enum SimEventType {
+	SIM_EVENT_OUTAGE_START,
+	SIM_EVENT_OUTAGE_END,
+	SIM_EVENT_SESSION_BREAK,
+	SIM_EVENT_TESTER_CALL
+};
+
+typedef struct {
+	uint64_t at;
+	SimEventType type;
+} SimEvent;
+
+struct SimEventCompare {
+	bool operator()(const SimEvent &a, const SimEvent &b) const { return a.at > b.at; };
+};
+
+/**
+ * @brief The firmware under test, wired up the same way as the full example
+ */
+class SimFirmware {
+public:
+	SimFirmware(const SimConfig &config, FleetStats &stats) : stats(stats), connectionEvents("connEventStats"), sessionCheck(3600), tester("testerFn", D2), batteryCheck(15.0, 3600), watchdog(60000) {
+		if (config.scheduler) {
+			publishScheduler = new PublishScheduler();
+		}
+		if (config.compact) {
+			connectionEvents.withEncoding(ConnectionEvents::ENCODING_COMPACT);
+		}
+		if (config.batchFillBytes != 0) {
+			connectionEvents.withBatching(config.batchFillBytes, config.batchMaxHoldMs);
+		}
+		if (config.moduleScheduler) {
+			moduleScheduler = new ModuleScheduler();
+		}
+		if (config.powerTiers) {
+			powerState = new PowerState();
+		}
+		if (config.profile && config.moduleScheduler) {
+			loopProfiler = new LoopProfiler();
+		}
+		if (config.heartbeat && config.moduleScheduler) {
+			heartbeatWatchdog = new HeartbeatWatchdog();
+		}
+		sessionCheck.withCheckPeriodRange(config.sessionMinSecs, config.sessionMaxSecs).withProbeCount(config.sessionProbes);
+		if (config.spool) {
+			connectionEvents.withSpool(spool);
+			useSpool = true;
+		}
+	}
+
+	void setup() {
+		breadcrumbs.setup();
+		if (publishScheduler) {
+			publishScheduler->setup();
+		}
+		if (useSpool) {
+			spool.setup();
+		}
+		connectionEvents.setup();
+		if (powerState) {
+			powerState->setup();
+		}
+		batteryCheck.setup();
+		sessionCheck.setup();
+		connectionCheck.setup();
+		tester.setup();
+		if (moduleScheduler) {
+			moduleScheduler->withModule(batteryCheck).withModule(sessionCheck).withModule(connectionCheck)
+				.withModule(connectionEvents).withModule(tester);
+			if (publishScheduler) {
+				moduleScheduler->add(*publishScheduler);
+			}
+			moduleScheduler->add(breadcrumbs);
+			if (loopProfiler) {
+				loopProfiler->setup();
+				moduleScheduler->withModule(*loopProfiler).withProfiler(*loopProfiler);
+			}
+			if (heartbeatWatchdog) {
+				heartbeatWatchdog->setup();
+				moduleScheduler->withWatchdog(*heartbeatWatchdog);
+			}
+			if (stats.moduleNames.empty()) {
+				stats.moduleNames = { "BatteryCheck", "SessionCheck", "ConnectionCheck", "ConnectionEvents", "Tester" };
+				if (publishScheduler) {
+					stats.moduleNames.push_back("PublishScheduler");
+				}
+				stats.moduleNames.push_back("Breadcrumbs");
+				stats.moduleNames.push_back("LoopProfiler");
+			}
+		}
+		Particle.connect();
+	}
+
+	void loop() {
+		if (moduleScheduler) {
+			moduleScheduler->loop();
+			return;
+		}
+		batteryCheck.loop();
+		sessionCheck.loop();
+		connectionCheck.loop();
+		connectionEvents.loop();
+		tester.loop();
+		if (publishScheduler) {
+			publishScheduler->loop();
+		}
+		breadcrumbs.loop();
+	}
+
+	// How long until loop() should be called again
+	unsigned long getIdleMs(const SimConfig &config) {
+		if (!moduleScheduler) {
+			return config.stepMs;
+		}
+		unsigned long idleMs = moduleScheduler->getMillisUntilNextDeadline();
+		return (idleMs > 0) ? idleMs : 1;
+	}
+
+	~SimFirmware() {
+		// Called on each simulated reboot, as the count isn't retained
+		ConnectionEventStats events = connectionEvents.getStats();
+		stats.eventsDiscarded += events.discarded;
+		stats.events.added += events.added;
+		stats.events.collapsed += events.collapsed;
+		stats.events.spooled += events.spooled;
+		stats.events.published += events.published;
+		delete moduleScheduler;
+		delete publishScheduler;
+		delete powerState;
+		delete loopProfiler;
+		delete heartbeatWatchdog;
+	}
+
+	FleetStats &stats;
+	ModuleScheduler *moduleScheduler = NULL;
+	PublishScheduler *publishScheduler = NULL;
+	PowerState *powerState = NULL;
+	LoopProfiler *loopProfiler = NULL;
+	HeartbeatWatchdog *heartbeatWatchdog = NULL;
+	Breadcrumbs breadcrumbs;
+	ConnectionEventSpool spool;
+	bool useSpool = false;
+	ConnectionEvents connectionEvents;
+	SessionCheck sessionCheck;
+	ConnectionCheck connectionCheck;
+	Tester tester;
+	BatteryCheck batteryCheck;
+	AppWatchdogWrapper watchdog;
+};
+
+/**
+ * @brief One simulated device: the modem, the network it's attached to, and the cloud
+ */
+class SimDevice : public HostEnvironment {
+public:
+	SimDevice(const SimConfig &config, FleetStats &stats, int index) : config(config), stats(stats), rng(config.seed * 1000003 + index) {
+		uint64_t endMs = (uint64_t)(config.hours * 3600000.0);
+
+		// Random outages for just this device
+		if (config.outagesPerDay > 0) {
+			std::exponential_distribution<double> interval(config.outagesPerDay / 86400000.0);
+			std::exponential_distribution<double> duration(1.0 / (config.meanOutageMin * 60000.0));
+			for(uint64_t t = (uint64_t)interval(rng); t < endMs; t += (uint64_t)interval(rng)) {
+				scheduleOutage(t, (uint64_t)duration(rng) + 1000);
+			}
+		}
+
+		// An outage that affects the whole fleet at the same time, like a carrier problem
+		if (config.fleetOutageHour >= 0) {
+			scheduleOutage((uint64_t)(config.fleetOutageHour * 3600000.0), (uint64_t)(config.fleetOutageMin * 60000.0));
+		}
+
+		if (config.sessionBreaksPerDay > 0) {
+			std::exponential_distribution<double> interval(config.sessionBreaksPerDay / 86400000.0);
+			for(uint64_t t = (uint64_t)interval(rng); t < endMs; t += (uint64_t)interval(rng)) {
+				events.push(SimEvent{t, SIM_EVENT_SESSION_BREAK});
+			}
+		}
+
+		if (config.testerCallHour >= 0) {
+			events.push(SimEvent{(uint64_t)(config.testerCallHour * 3600000.0), SIM_EVENT_TESTER_CALL});
+		}
+	}
+
+	// Called when the device is powered up or wakes from deep sleep. The modem is power cycled.
+	void powerOn() {
+		pendingUrcs.clear();
+		modemOn = true;
+		stuck = false;
+		sessionBroken = false;
+		wantCloud = false;
+		cellularAt = HostClock::now() + registerDelay();
+		update();
+	}
+
+	// Called after System.reset(). Device OS reconnects but the modem is not power cycled.
+	void warmReset() {
+		wantCloud = false;
+		sessionBroken = false;
+		cellularAt = HostClock::now() + registerDelay();
+		update();
+	}
+
+	void sleep(long secs) {
+		pendingUrcs.clear();
+		modemOn = false;
+		update();
+		updateBattery();
+		asleep = true;
+		HostClock::set(HostClock::now() + (uint64_t)secs * 1000);
+		updateBattery();
+		asleep = false;
+		stats.asleepMs += (uint64_t)secs * 1000;
+		processEvents();
+	}
+
+	// Handles injected events that are due
+	void processEvents() {
+		while(!events.empty() && events.top().at <= HostClock::now()) {
+			SimEvent ev = events.top();
+			events.pop();
+
+			switch(ev.type) {
+			case SIM_EVENT_OUTAGE_START:
+				if (outageDepth++ == 0 && modemOn) {
+					// Some modems don't recover by themselves after losing the network
+					std::bernoulli_distribution stuckDist(config.stuckProbability);
+					if (stuckDist(rng)) {
+						stuck = true;
+					}
+				}
+				break;
+
+			case SIM_EVENT_OUTAGE_END:
+				if (--outageDepth == 0) {
+					cellularAt = HostClock::now() + registerDelay();
+					if (!cloudState) {
+						recoveryStart = HostClock::now();
+					}
+				}
+				break;
+
+			case SIM_EVENT_SESSION_BREAK:
+				if (cloudState) {
+					sessionBroken = true;
+				}
+				break;
+
+			case SIM_EVENT_TESTER_CALL:
+				// Functions can only be called while the device is connected, so try again later
+				if (cloudState && !sessionBroken) {
+					Particle.callFunction("testerFn", config.testerCall.c_str());
+				}
+				else {
+					events.push(SimEvent{HostClock::now() + 10000, SIM_EVENT_TESTER_CALL});
+				}
+				break;
+			}
+		}
+		update();
+	}
+
+	void finish() {
+		update();
+		updateBattery();
+		if (!cloudState) {
+			stats.cloudDownMs += HostClock::now() - cloudChangedAt;
+		}
+		stats.simulatedMs += HostClock::now();
+	}
+
+	virtual bool cellularReady() {
+		update();
+		return cellularState;
+	}
+
+	virtual void cellularOn() {
+		if (!modemOn) {
+			modemOn = true;
+			stuck = false;
+			cellularAt = HostClock::now() + registerDelay();
+		}
+		update();
+	}
+
+	virtual void cellularOff() {
+		modemOn = false;
+		update();
+	}
+
+	virtual int cellularCommand(const char *cmd, system_tick_t timeout, std::function<void(int type, const char *buf, int len)> callback) {
+		if (!modemOn) {
+			return RESP_ERROR;
+		}
+		deliverUrcs(callback);
+
+		if (strncmp(cmd, "AT+CFUN=16", 10) == 0) {
+			// Silent reset of the modem and SIM; it has to register again
+			stats.modemResets++;
+			pendingUrcs.clear();
+			if (config.hangProbability > 0) {
+				std::bernoulli_distribution hangDist(config.hangProbability);
+				if (hangDist(rng)) {
+					// The modem stops responding and the command doesn't return until a watchdog resets
+					stats.hangs++;
+					hangStart = HostClock::now();
+					HostClock::advance(HANG_MS);
+					hangStart = 0;
+				}
+			}
+			HostClock::advance(2000);
+			stuck = false;
+			sessionBroken = false;
+			cellularAt = HostClock::now() + registerDelay();
+			update();
+			return RESP_OK;
+		}
+
+		if (strncmp(cmd, "AT+UPING=", 9) == 0) {
+			// Returns OK right away. The modem sends a +UUPING line for each reply, or +UUPINGER
+			// if there were none, which are read during later commands.
+			stats.pings++;
+			char host[64];
+			int count = 4, size = 32;
+			unsigned long echoTimeout = 5000;
+			if (sscanf(cmd, "AT+UPING=\"%63[^\"]\",%d,%d,%lu", host, &count, &size, &echoTimeout) < 1) {
+				return RESP_ERROR;
+			}
+			uint64_t now = HostClock::now();
+			if (!cellularState || outageDepth > 0) {
+				pendingUrcs.push_back(std::make_pair(now + count * echoTimeout, std::string("+UUPINGER: 17")));
+			}
+			else {
+				std::uniform_real_distribution<double> jitter(0.75, 1.5);
+				const char *ip = (strcmp(host, "8.8.8.8") == 0) ? "8.8.8.8" : "52.0.0.1";
+				for(int ii = 0; ii < count; ii++) {
+					unsigned long rtt = (unsigned long)(config.rttMs * jitter(rng));
+					char line[160];
+					snprintf(line, sizeof(line), "+UUPING: %d,%d,\"%s\",\"%s\",52,%lu", ii + 1, size, host, ip, rtt);
+					pendingUrcs.push_back(std::make_pair(now + ii * 1000 + rtt, std::string(line)));
+				}
+			}
+			HostClock::advance(10);
+			return RESP_OK;
+		}
+
+		HostClock::advance(10);
+		deliverUrcs(callback);
+		return RESP_OK;
+	}
+
+	virtual bool cloudConnected() {
+		update();
+		return cloudState;
+	}
+
+	virtual void cloudConnect() {
+		if (!wantCloud) {
+			wantCloud = true;
+			cloudAt = std::max(cloudAt, HostClock::now() + handshakeDelay());
+		}
+		update();
+	}
+
+	virtual void cloudDisconnect() {
+		wantCloud = false;
+		update();
+	}
+
+	virtual bool publish(const char *eventName, const char *data) {
+		// The cloud allows an average of 1 publish per second with bursts of up to 4
+		uint64_t now = HostClock::now();
+		publishTokens = std::min(4.0, publishTokens + (now - lastTokenAt) / 1000.0);
+		lastTokenAt = now;
+
+		stats.publishes++;
+		stats.publishBytes += strlen(eventName) + strlen(data);
+		stats.publishesByName[(strchr(eventName, '/') != NULL) ? strchr(eventName, '/') + 1 : eventName]++;
+
+		// The device counts whole milliseconds, so allow for rounding here
+		if (publishTokens < 1.0 - 1e-9) {
+			stats.rateLimited++;
+			return true;
+		}
+		publishTokens -= 1.0;
+
+		if (recordFile) {
+			time_t t = SIM_EPOCH + (time_t)(now / 1000);
+			struct tm tm;
+			char publishedAt[32];
+			gmtime_r(&t, &tm);
+			strftime(publishedAt, sizeof(publishedAt), "%Y-%m-%dT%H:%M:%S", &tm);
+			fprintf(recordFile, "{\"name\":\"%s\",\"data\":\"%s\",\"ttl\":60,\"published_at\":\"%s.%03dZ\",\"coreid\":\"%s\"}\n",
+				eventName, data, publishedAt, (int)(now % 1000), System.deviceID().c_str());
+		}
+
+		if (strcmp(eventName, "connHistograms") == 0) {
+			mergeHistogram(data);
+		}
+		if (strcmp(eventName, "loopStats") == 0) {
+			mergeLoopStats(data);
+		}
+		if (strcmp(eventName, "breadcrumbs") == 0) {
+			// reason,index:stage-ms,... The newest entry is the first one of index 0
+			int reason;
+			unsigned index, stage;
+			if (sscanf(data, "%d,%u:%x", &reason, &index, &stage) == 3 && index == 0) {
+				stats.trailsByLastStage[stage]++;
+			}
+		}
+
+		if (strcmp(eventName, "spark/device/session/end") == 0) {
+			// The cloud ends the session and the device has to handshake again
+			sessionBroken = false;
+			cloudAt = now + handshakeDelay();
+			update();
+		}
+		return true;
+	}
+
+	virtual bool cloudEcho(const char *eventName, uint32_t &delayMs) {
+		std::uniform_real_distribution<double> jitter(0.75, 1.5);
+		std::bernoulli_distribution lost(config.echoLoss);
+		delayMs = (uint32_t)(config.rttMs * jitter(rng));
+		return !sessionBroken && !lost(rng);
+	}
+
+	virtual float batterySoC() {
+		updateBattery();
+		std::normal_distribution<double> noise(0.0, config.socNoise);
+		double reading = battery + ((config.socNoise > 0) ? noise(rng) : 0.0);
+		return (float)std::max(0.1, std::min(100.0, reading));
+	}
+
+	virtual float batteryVoltage() {
+		updateBattery();
+		return (float)(3.4 + 0.8 * battery / 100.0);
+	}
+
+	virtual bool powerGood() {
+		// A solar panel on VIN counts as external power once it's producing enough
+		return config.powerGood || (config.solarPctPerHour > 0 && solarRate(HostClock::now()) > 0.25 * config.solarPctPerHour);
+	}
+
+	virtual time_t timeNow() {
+		// The real-time clock is set by the cloud and keeps running across resets
+		return timeSynced ? (SIM_EPOCH + (time_t)(HostClock::now() / 1000)) : 0;
+	}
+
+	uint64_t hangStart = 0; // When the current hung command started, 0 if none
+
+private:
+	// Charge rate from the solar panel in percent per hour, following the sun from 6:00 to 18:00 UTC
+	double solarRate(uint64_t ms) {
+		double hour = fmod((SIM_EPOCH % 86400) / 3600.0 + ms / 3600000.0, 24.0);
+		return (hour > 6.0 && hour < 18.0) ? config.solarPctPerHour * sin(M_PI * (hour - 6.0) / 12.0) : 0.0;
+	}
+
+	// Charges or drains the simulated battery up to now, in steps of up to 5 minutes
+	void updateBattery() {
+		if (config.drainPctPerHour <= 0 && config.solarPctPerHour <= 0) {
+			return;
+		}
+		uint64_t now = HostClock::now();
+		while(batteryAt < now) {
+			uint64_t step = std::min((uint64_t)300000, now - batteryAt);
+			double rate = solarRate(batteryAt + step / 2) - (asleep ? config.sleepDrainPctPerHour : config.drainPctPerHour);
+			battery = std::max(0.0, std::min(100.0, battery + rate * step / 3600000.0));
+			batteryAt += step;
+
+			if (battery <= 0.0 && !asleep) {
+				if (!brownedOut) {
+					brownedOut = true;
+					stats.brownouts++;
+				}
+				stats.brownoutMs += step;
+			}
+			else {
+				brownedOut = false;
+			}
+		}
+	}
+
+	// name,count,maxValue,bucket:count,...
+	void mergeHistogram(const char *data) {
+		char name[32];
+		unsigned long count, maxValue;
+		int offset;
+		if (sscanf(data, "%31[^,],%lu,%lu%n", name, &count, &maxValue, &offset) != 3) {
+			return;
+		}
+		LogHistogram &hist = stats.histograms[name];
+		hist.maxValue = std::max(hist.maxValue, (uint32_t)maxValue);
+
+		unsigned bucket, bucketCount;
+		int len;
+		for(const char *cp = data + offset; sscanf(cp, ",%u:%u%n", &bucket, &bucketCount, &len) == 2; cp += len) {
+			if (bucket < LogHistogram::NUM_BUCKETS) {
+				hist.buckets[bucket] = (uint16_t)std::min(0xffffU, hist.buckets[bucket] + bucketCount);
+				hist.count += bucketCount;
+			}
+		}
+	}
+
+	// index:calls,maxUs,p50Us,p90Us,p99Us,slow;...
+	void mergeLoopStats(const char *data) {
+		unsigned index;
+		unsigned long calls, maxUs, p50, p90, p99, slow;
+		int len;
+		for(const char *cp = data; sscanf(cp, "%u:%lu,%lu,%lu,%lu,%lu,%lu%n", &index, &calls, &maxUs, &p50, &p90, &p99, &slow, &len) == 7; cp += len) {
+			ModuleLoopTotals &totals = stats.loopTotals[index];
+			totals.calls += calls;
+			totals.slow += slow;
+			totals.maxUs = std::max(totals.maxUs, (uint32_t)maxUs);
+			totals.p99Us.push_back((uint32_t)p99);
+			if (cp[len] == ';') {
+				len++;
+			}
+		}
+	}
+
+	// Passes the unsolicited results that are due to the callback of the command being run
+	void deliverUrcs(std::function<void(int type, const char *buf, int len)> callback) {
+		uint64_t now = HostClock::now();
+		while(!pendingUrcs.empty() && pendingUrcs.front().first <= now) {
+			std::string line = "\r\n" + pendingUrcs.front().second + "\r\n";
+			pendingUrcs.pop_front();
+			if (callback) {
+				callback(TYPE_PLUS, line.c_str(), line.length());
+			}
+		}
+	}
+
+	void scheduleOutage(uint64_t start, uint64_t duration) {
+		events.push(SimEvent{start, SIM_EVENT_OUTAGE_START});
+		events.push(SimEvent{start + duration, SIM_EVENT_OUTAGE_END});
+	}
+
+	uint64_t registerDelay() {
+		std::uniform_real_distribution<double> dist(0.5, 1.5);
+		return (uint64_t)(config.registerSecs * 1000.0 * dist(rng));
+	}
+
+	uint64_t handshakeDelay() {
+		std::uniform_real_distribution<double> dist(0.5, 1.5);
+		return (uint64_t)(config.handshakeSecs * 1000.0 * dist(rng));
+	}
+
+	// Recalculates the cellular and cloud state for the current time
+	void update() {
+		uint64_t now = HostClock::now();
+
+		bool cellularNow = modemOn && !stuck && outageDepth == 0 && now >= cellularAt;
+		if (cellularNow && !cellularState) {
+			cloudAt = std::max(cloudAt, now + handshakeDelay());
+		}
+		cellularState = cellularNow;
+
+		bool cloudNow = cellularState && wantCloud && now >= cloudAt;
+		if (cloudNow != cloudState) {
+			if (cloudNow) {
+				stats.cloudDownMs += now - cloudChangedAt;
+				stats.reconnectsByMinute[now / 60000]++;
+				if (recoveryStart != 0) {
+					stats.recoveryMs.push_back(now - recoveryStart);
+					recoveryStart = 0;
+				}
+				timeSynced = true;
+			}
+			cloudState = cloudNow;
+			cloudChangedAt = now;
+		}
+	}
+
+	const SimConfig &config;
+	FleetStats &stats;
+	std::mt19937 rng;
+	std::priority_queue<SimEvent, std::vector<SimEvent>, SimEventCompare> events;
+
+	bool modemOn = false;
+	std::deque<std::pair<uint64_t, std::string> > pendingUrcs; // Ordered by time
+	bool stuck = false;
+	bool sessionBroken = false;
+	bool wantCloud = false;
+	bool timeSynced = false;
+	int outageDepth = 0;
+	uint64_t cellularAt = 0;
+	uint64_t cloudAt = 0;
+
+	bool cellularState = false;
+	bool cloudState = false;
+	uint64_t cloudChangedAt = 0;
+	uint64_t recoveryStart = 0;
+
+	double publishTokens = 4.0;
+	uint64_t lastTokenAt = 0;
+
+	double battery = config.soc; // Actual SoC; the fuel gauge adds noise
+	uint64_t batteryAt = 0;
+	bool asleep = false;
+	bool brownedOut = false;
+};
+
+static void runDevice(const SimConfig &config, FleetStats &stats, int index) {
+	uint64_t endMs = (uint64_t)(config.hours * 3600000.0);
+
+	// New device: clear retained memory and EEPROM, start the clock, power up
+	memset(__start_retained_user, 0, __stop_retained_user - __start_retained_user);
+	EEPROM.clear();
+	uint64_t eepromWritesStart = EEPROM.hostWrites;
+	HostClock::set(0);
+	SystemClass::hostResetReason = RESET_REASON_POWER_DOWN;
+
+	char deviceId[25];
+	snprintf(deviceId, sizeof(deviceId), "%024x", index);
+	SystemClass::hostDeviceID = deviceId;
+
+	SimDevice device(config, stats, index);
+	HostEnvironment::setCurrent(&device);
+	device.powerOn();
+
+	while(HostClock::now() < endMs) {
+		Particle.clear();
+		HostClock::boot();
+
+		try {
+			SimFirmware firmware(config, stats);
+			firmware.setup();
+
+			while(HostClock::now() < endMs) {
+				device.processEvents();
+				firmware.loop();
+				stats.loopCalls++;
+				ApplicationWatchdog::hostCheckinAll();
+				Particle.process();
+
+				unsigned long idleMs = firmware.getIdleMs(config);
+				if (firmware.powerState) {
+					stats.powerTierMs[firmware.powerState->getTier()] += idleMs;
+				}
+				HostClock::advance(idleMs);
+			}
+		}
+		catch(HostReset &reset) {
+			stats.resetsByReason[reset.reason]++;
+			if (device.hangStart != 0) {
+				stats.hangResets++;
+				stats.hangResetMs += HostClock::now() - device.hangStart;
+				device.hangStart = 0;
+			}
+			SystemClass::hostResetReason = reset.reason;
+
+			if (reset.sleepSecs > 0) {
+				device.sleep(reset.sleepSecs);
+				device.powerOn();
+			}
+			else {
+				device.warmReset();
+			}
+		}
+	}
+	device.finish();
+	HostEnvironment::setCurrent(NULL);
+	stats.eepromWrites += EEPROM.hostWrites - eepromWritesStart;
+
+	const SessionRetainedData &session = SessionCheck::getRetainedData();
+	stats.sessionProbesSent += session.probesSent;
+	stats.sessionProbesReceived += session.probesReceived;
+	if (session.probesReceived > 0) {
+		stats.sessionRtt.add(session.rttAverageMs);
+	}
+}
+
+static uint64_t percentile(std::vector<uint64_t> &values, double pct) {
+	if (values.empty()) {
+		return 0;
+	}
+	size_t index = (size_t)(pct / 100.0 * (values.size() - 1) + 0.5);
+	return values[index];
+}
+
+static const char *resetReasonName(int reason) {
+	switch(reason) {
+	case RESET_REASON_POWER_MANAGEMENT: return "POWER_MANAGEMENT (sleep)";
+	case RESET_REASON_USER: return "USER (System.reset)";
+	case RESET_REASON_SAFE_MODE: return "SAFE_MODE";
+	default: return "other";
+	}
+}
+
+static void printStats(const SimConfig &config, FleetStats &stats, double elapsedSecs) {
+	double deviceDays = stats.simulatedMs / 86400000.0;
+
+	printf("devices: %d, simulated %.1f hours each in %.1f s (%.0fx real time)\n",
+		config.devices, config.hours, elapsedSecs, (stats.simulatedMs / 1000.0) / elapsedSecs);
+
+	printf("publishes: %llu (%.1f per device-day), %.0f bytes per device-day, %llu rate limited\n",
+		(unsigned long long)stats.publishes, stats.publishes / deviceDays, stats.publishBytes / deviceDays,
+		(unsigned long long)stats.rateLimited);
+	for(auto it = stats.publishesByName.begin(); it != stats.publishesByName.end(); it++) {
+		printf("  %-28s %10llu (%.1f per device-day)\n", it->first.c_str(), (unsigned long long)it->second, it->second / deviceDays);
+	}
+
+	printf("resets:\n");
+	for(auto it = stats.resetsByReason.begin(); it != stats.resetsByReason.end(); it++) {
+		printf("  %-28s %10llu (%.2f per device-day)\n", resetReasonName(it->first), (unsigned long long)it->second, it->second / deviceDays);
+	}
+	printf("modem resets (AT+CFUN=16): %llu, pings: %llu\n", (unsigned long long)stats.modemResets, (unsigned long long)stats.pings);
+	if (config.hangProbability > 0) {
+		printf("hung AT+CFUN=16: %llu, %llu reset by a watchdog after %.1f s on average\n", (unsigned long long)stats.hangs,
+			(unsigned long long)stats.hangResets, stats.hangResets ? stats.hangResetMs / 1000.0 / stats.hangResets : 0.0);
+	}
+
+	printf("loop() calls: %.0f per device-hour\n", stats.loopCalls / (deviceDays * 24.0));
+
+	printf("connection events: %llu added, %llu collapsed, %llu spooled, %llu discarded, %llu published; EEPROM writes: %.1f per device-day\n",
+		(unsigned long long)stats.events.added, (unsigned long long)stats.events.collapsed, (unsigned long long)stats.events.spooled,
+		(unsigned long long)stats.eventsDiscarded, (unsigned long long)stats.events.published, stats.eepromWrites / deviceDays);
+
+	printf("cloud availability: %.3f%%\n", 100.0 - (100.0 * stats.cloudDownMs / stats.simulatedMs));
+	if (config.drainPctPerHour > 0 || config.solarPctPerHour > 0) {
+		printf("battery: asleep %.2f%% of the time, %llu brownouts (%.1f min at 0%% while awake per device-day)\n",
+			100.0 * stats.asleepMs / stats.simulatedMs, (unsigned long long)stats.brownouts, stats.brownoutMs / 60000.0 / deviceDays);
+	}
+	if (config.powerTiers) {
+		uint64_t awakeMs = 0;
+		for(size_t ii = 0; ii < NUM_POWER_TIERS; ii++) {
+			awakeMs += stats.powerTierMs[ii];
+		}
+		printf("power tiers (%% of time awake): normal %.2f%%, conserve %.2f%%, low %.2f%%, critical %.2f%%\n",
+			100.0 * stats.powerTierMs[POWER_TIER_NORMAL] / awakeMs, 100.0 * stats.powerTierMs[POWER_TIER_CONSERVE] / awakeMs,
+			100.0 * stats.powerTierMs[POWER_TIER_LOW] / awakeMs, 100.0 * stats.powerTierMs[POWER_TIER_CRITICAL] / awakeMs);
+	}
+
+	std::sort(stats.recoveryMs.begin(), stats.recoveryMs.end());
+	printf("time to reconnect after outage ends (s): n=%lu p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+		(unsigned long)stats.recoveryMs.size(),
+		percentile(stats.recoveryMs, 50) / 1000.0, percentile(stats.recoveryMs, 90) / 1000.0,
+		percentile(stats.recoveryMs, 99) / 1000.0, percentile(stats.recoveryMs, 100) / 1000.0);
+
+	printf("connection histograms from the devices (s):\n");
+	for(auto it = stats.histograms.begin(); it != stats.histograms.end(); it++) {
+		const LogHistogram &hist = it->second;
+		printf("  %-10s n=%lu p50>=%.1f p90>=%.1f p99>=%.1f max=%.1f\n", it->first.c_str(), (unsigned long)hist.count,
+			hist.percentile(50) / 1000.0, hist.percentile(90) / 1000.0, hist.percentile(99) / 1000.0, hist.maxValue / 1000.0);
+	}
+
+	const LogHistogram &rtt = stats.sessionRtt;
+	printf("session probes: %llu sent, %.2f%% lost, device average rtt (ms) n=%lu p50>=%lu p90>=%lu max=%lu\n",
+		(unsigned long long)stats.sessionProbesSent,
+		stats.sessionProbesSent ? 100.0 * (stats.sessionProbesSent - stats.sessionProbesReceived) / stats.sessionProbesSent : 0.0,
+		(unsigned long)rtt.count, (unsigned long)rtt.percentile(50), (unsigned long)rtt.percentile(90), (unsigned long)rtt.maxValue);
+
+	if (config.profile) {
+		printf("loop() time by module, from the loopStats publishes (ms):\n");
+		for(auto it = stats.loopTotals.begin(); it != stats.loopTotals.end(); it++) {
+			ModuleLoopTotals &totals = it->second;
+			std::sort(totals.p99Us.begin(), totals.p99Us.end());
+			const char *name = (it->first < stats.moduleNames.size()) ? stats.moduleNames[it->first].c_str() : "?";
+			printf("  %-18s calls=%llu slow=%llu p99 median>=%.1f worst>=%.1f max=%.1f\n", name,
+				(unsigned long long)totals.calls, (unsigned long long)totals.slow,
+				totals.p99Us[totals.p99Us.size() / 2] / 1000.0, totals.p99Us.back() / 1000.0, totals.maxUs / 1000.0);
+		}
+	}
+
+	if (!stats.trailsByLastStage.empty()) {
+		printf("breadcrumb trails published, by the last stage before the reset:\n");
+		for(auto it = stats.trailsByLastStage.begin(); it != stats.trailsByLastStage.end(); it++) {
+			printf("  0x%02x %10llu\n", it->first, (unsigned long long)it->second);
+		}
+	}
+
+	uint64_t peakMinute = 0, peakCount = 0;
+	for(auto it = stats.reconnectsByMinute.begin(); it != stats.reconnectsByMinute.end(); it++) {
+		if (it->second > peakCount) {
+			peakMinute = it->first;
+			peakCount = it->second;
+		}
+	}
+	printf("peak cloud connections in one minute: %llu at minute %llu\n", (unsigned long long)peakCount, (unsigned long long)peakMinute);
+}
+
+static void usage() {
+	printf("usage: fleetsim [options]\n");
+	printf("  --devices N              number of devices to simulate (default 100)\n");
+	printf("  --hours H                simulated time per device (default 24)\n");
+	printf("  --seed N                 random seed (default 1)\n");
+	printf("  --step MS                time between calls to loop() with --no-module-scheduler (default 250)\n");
+	printf("  --outages-per-day N      random per-device outages (default 2)\n");
+	printf("  --outage-min N           mean per-device outage duration in minutes (default 10)\n");
+	printf("  --stuck P                probability the modem needs a reset after an outage (default 0.1)\n");
+	printf("  --session-breaks N       broken cloud sessions per device per day (default 0.2)\n");
+	printf("  --session-period MIN,MAX SessionCheck::withCheckPeriodRange(MIN, MAX) in seconds (default 900,7200)\n");
+	printf("  --session-probes N       SessionCheck::withProbeCount(N) (default 3)\n");
+	printf("  --echo-loss P            probability the cloud drops an event sent back to the device (default 0)\n");
+	printf("  --fleet-outage H,M       outage for the whole fleet at hour H lasting M minutes\n");
+	printf("  --register-secs N        mean time to register on the cellular network (default 20)\n");
+	printf("  --handshake-secs N       mean time to connect to the cloud (default 5)\n");
+	printf("  --rtt MS                 cloud round trip time (default 400)\n");
+	printf("  --soc N                  battery state of charge (default 80)\n");
+	printf("  --battery                no external power\n");
+	printf("  --drain PCT              battery drain while awake in percent per hour (default 0, SoC stays at --soc)\n");
+	printf("  --sleep-drain PCT        battery drain in deep sleep in percent per hour (default 0.05)\n");
+	printf("  --solar PCT              peak solar charge rate at midday UTC in percent per hour (default 0)\n");
+	printf("  --soc-noise PCT          standard deviation of the fuel gauge SoC reading (default 0)\n");
+	printf("  --power-tiers            use a PowerState, so the modules save power as the battery drops\n");
+	printf("  --profile                use a LoopProfiler and report the loop() time of each module\n");
+	printf("  --heartbeat              use a HeartbeatWatchdog, so a module that's stuck resets after 20 s\n");
+	printf("  --hang P                 probability that an AT+CFUN=16 hangs and blocks loop() for 10 minutes (default 0)\n");
+	printf("  --no-scheduler           don't use a PublishScheduler\n");
+	printf("  --no-module-scheduler    call every module's loop() every --step ms instead of using a ModuleScheduler\n");
+	printf("  --tester-call H,ARGS     call the Tester function with ARGS at hour H, like \"1,load rate 5 600\"\n");
+	printf("  --no-spool               don't use a ConnectionEventSpool\n");
+	printf("  --compact                use ConnectionEvents::ENCODING_COMPACT\n");
+	printf("  --batching BYTES,MS      ConnectionEvents::withBatching(BYTES, MS)\n");
+	printf("  --record FILE            write the events that reach the cloud to FILE as JSON lines, for eventdecoder\n");
+	printf("  --verbose                log output from the library (use with --devices 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+	SimConfig config;
+
+	for(int ii = 1; ii < argc; ii++) {
+		std::string arg = argv[ii];
+		const char *value = (ii + 1 < argc) ? argv[ii + 1] : "";
+
+		if (arg == "--devices") { config.devices = atoi(value); ii++; }
+		else if (arg == "--hours") { config.hours = atof(value); ii++; }
+		else if (arg == "--seed") { config.seed = strtoul(value, NULL, 0); ii++; }
+		else if (arg == "--step") { config.stepMs = strtoul(value, NULL, 0); ii++; }
+		else if (arg == "--outages-per-day") { config.outagesPerDay = atof(value); ii++; }
+		else if (arg == "--outage-min") { config.meanOutageMin = atof(value); ii++; }
+		else if (arg == "--stuck") { config.stuckProbability = atof(value); ii++; }
+		else if (arg == "--session-breaks") { config.sessionBreaksPerDay = atof(value); ii++; }
+		else if (arg == "--session-period") {
+			if (sscanf(value, "%ld,%ld", &config.sessionMinSecs, &config.sessionMaxSecs) != 2) {
+				usage();
+				return 1;
+			}
+			ii++;
+		}
+		else if (arg == "--session-probes") { config.sessionProbes = strtoul(value, NULL, 0); ii++; }
+		else if (arg == "--echo-loss") { config.echoLoss = atof(value); ii++; }
+		else if (arg == "--fleet-outage") {
+			if (sscanf(value, "%lf,%lf", &config.fleetOutageHour, &config.fleetOutageMin) < 1) {
+				usage();
+				return 1;
+			}
+			ii++;
+		}
+		else if (arg == "--register-secs") { config.registerSecs = atof(value); ii++; }
+		else if (arg == "--handshake-secs") { config.handshakeSecs = atof(value); ii++; }
+		else if (arg == "--rtt") { config.rttMs = strtoul(value, NULL, 0); ii++; }
+		else if (arg == "--soc") { config.soc = atof(value); ii++; }
+		else if (arg == "--battery") { config.powerGood = false; }
+		else if (arg == "--drain") { config.drainPctPerHour = atof(value); ii++; }
+		else if (arg == "--sleep-drain") { config.sleepDrainPctPerHour = atof(value); ii++; }
+		else if (arg == "--solar") { config.solarPctPerHour = atof(value); ii++; }
+		else if (arg == "--soc-noise") { config.socNoise = atof(value); ii++; }
+		else if (arg == "--power-tiers") { config.powerTiers = true; }
+		else if (arg == "--profile") { config.profile = true; }
+		else if (arg == "--heartbeat") { config.heartbeat = true; }
+		else if (arg == "--hang") { config.hangProbability = atof(value); ii++; }
+		else if (arg == "--no-scheduler") { config.scheduler = false; }
+		else if (arg == "--no-module-scheduler") { config.moduleScheduler = false; }
+		else if (arg == "--tester-call") {
+			const char *comma = strchr(value, ',');
+			if (!comma) {
+				usage();
+				return 1;
+			}
+			config.testerCallHour = atof(value);
+			config.testerCall = comma + 1;
+			ii++;
+		}
+		else if (arg == "--no-spool") { config.spool = false; }
+		else if (arg == "--compact") { config.compact = true; }
+		else if (arg == "--batching") {
+			if (sscanf(value, "%zu,%lu", &config.batchFillBytes, &config.batchMaxHoldMs) != 2) {
+				usage();
+				return 1;
+			}
+			ii++;
+		}
+		else if (arg == "--record") {
+			recordFile = fopen(value, "w");
+			if (!recordFile) {
+				printf("could not write %s\n", value);
+				return 1;
+			}
+			ii++;
+		}
+		else if (arg == "--verbose") { config.verbose = true; }
+		else {
+			usage();
+			return (arg == "--help") ? 0 : 1;
+		}
+	}
+	if (config.devices <= 0 || config.stepMs == 0) {
+		usage();
+		return 1;
+	}
+	Logger::enabled = config.verbose;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	FleetStats stats;
+	for(int ii = 0; ii < config.devices; ii++) {
+		runDevice(config, stats, ii);
+	}
+
+	gettimeofday(&end, NULL);
+	double elapsedSecs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+	printStats(config, stats, elapsedSecs);
+
+	if (recordFile) {
+		fclose(recordFile);
+	}
+	return 0;
+}
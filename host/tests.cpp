@@ -0,0 +1,363 @@
+// Tests for the parts of the library that are hard to exercise with the fleet simulator, like the
+// event spool's EEPROM handling and the ModuleScheduler at the millis() wraparound
+//
+// They run on the host using the Device OS stand-in, including its EEPROM emulation and virtual
+// clock. Each test starts from a new device: retained memory and the EEPROM are cleared.
+//
+// Usage:
+//	./build/tests
+// Prints each failed check and exits with status 1 if there were any.
+
+#include "Particle.h"
+
+#include "ConnectionEventSpool.h"
+#include "ModuleScheduler.h"
+#include "PublishScheduler.h"
+
+#include <string>
+
+// Provided by the linker for the section the retained macro uses
+extern char __start_retained_user[];
+extern char __stop_retained_user[];
+
+/**
+ * @brief Connected when the test says so, with the real-time clock running from HostClock
+ */
+class TestEnvironment : public HostEnvironment {
+public:
+	virtual bool cellularReady() { return connected; };
+	virtual bool cloudConnected() { return connected; };
+	virtual bool publish(const char *eventName, const char *data) {
+		publishes++;
+		lastData = data;
+		return true;
+	};
+	virtual time_t timeNow() { return 1538352000 + (time_t)(HostClock::now() / 1000); };
+
+	bool connected = false;
+	int publishes = 0;
+	std::string lastData;
+};
+
+static TestEnvironment env;
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) do { \
+		checks++; \
+		if (!(cond)) { \
+			printf("%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); \
+			failures++; \
+		} \
+	} while(0)
+
+static void newDevice() {
+	env.connected = false;
+	env.publishes = 0;
+	memset(__start_retained_user, 0, __stop_retained_user - __start_retained_user);
+	EEPROM.clear();
+	HostClock::set(0);
+	HostClock::boot();
+}
+
+static ConnectionEventInfo makeEvent(int data) {
+	ConnectionEventInfo ev;
+	ev.tsDate = Time.now();
+	ev.tsMillis = millis();
+	ev.eventCode = ConnectionEvents::CONNECTION_EVENT_CLOUD_CONNECTED;
+	ev.data = data;
+	return ev;
+}
+
+// EEPROM offset of the record with sequence number seq, in a spool that uses the whole EEPROM
+static size_t spoolRecordOffset(const ConnectionEventSpool &spool, uint32_t seq) {
+	return sizeof(ConnectionEventSpoolHeader) + (seq % spool.getCapacity()) * sizeof(ConnectionEventSpoolRecord);
+}
+
+// Reads all of the events in the spool and checks their data is first, first + 1, ...
+static bool spoolContains(const ConnectionEventSpool &spool, int first, size_t count) {
+	ConnectionEventInfo events[128];
+	if (spool.getCount() != count || spool.read(events, 128) != count) {
+		return false;
+	}
+	for(size_t ii = 0; ii < count; ii++) {
+		if (events[ii].data != first + (int)ii) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void testSpoolAppendReadConsume() {
+	newDevice();
+
+	ConnectionEventSpool spool;
+	spool.setup();
+	CHECK(spool.getCapacity() == (EEPROM.length() - sizeof(ConnectionEventSpoolHeader)) / sizeof(ConnectionEventSpoolRecord));
+	CHECK(spool.getCount() == 0);
+
+	for(int ii = 0; ii < 10; ii++) {
+		CHECK(spool.append(makeEvent(ii)));
+	}
+	CHECK(spoolContains(spool, 0, 10));
+
+	// read() doesn't remove anything
+	ConnectionEventInfo events[4];
+	CHECK(spool.read(events, 4) == 4);
+	CHECK(events[0].data == 0 && events[3].data == 3);
+	CHECK(spool.getCount() == 10);
+
+	spool.consume(4);
+	CHECK(spoolContains(spool, 4, 6));
+
+	// After a reset, the slot scan finds the same events
+	ConnectionEventSpool spool2;
+	spool2.setup();
+	CHECK(spoolContains(spool2, 4, 6));
+
+	spool2.consume(6);
+	CHECK(spool2.getCount() == 0);
+	ConnectionEventSpool spool3;
+	spool3.setup();
+	CHECK(spool3.getCount() == 0);
+}
+
+static void testSpoolWrapAround() {
+	newDevice();
+
+	ConnectionEventSpool spool;
+	spool.withWriteBudget(100000);
+	spool.setup();
+	size_t capacity = spool.getCapacity();
+
+	// Go around the slots a few times, keeping it half full
+	int next = 0, oldest = 0;
+	for(size_t ii = 0; ii < capacity * 3; ii++) {
+		CHECK(spool.append(makeEvent(next++)));
+		if (spool.getCount() > capacity / 2) {
+			spool.consume(1);
+			oldest++;
+		}
+	}
+	CHECK(spoolContains(spool, oldest, next - oldest));
+
+	ConnectionEventSpool spool2;
+	spool2.withWriteBudget(100000);
+	spool2.setup();
+	CHECK(spoolContains(spool2, oldest, next - oldest));
+
+	// Fill it up. The oldest events are kept.
+	while(spool2.getCount() < capacity) {
+		CHECK(spool2.append(makeEvent(next++)));
+	}
+	CHECK(!spool2.append(makeEvent(next)));
+	CHECK(spoolContains(spool2, oldest, capacity));
+
+	ConnectionEventSpool spool3;
+	spool3.withWriteBudget(100000);
+	spool3.setup();
+	CHECK(spoolContains(spool3, oldest, capacity));
+}
+
+static void testSpoolCorruptRecord() {
+	newDevice();
+
+	ConnectionEventSpool spool;
+	spool.setup();
+	for(int ii = 0; ii < 5; ii++) {
+		CHECK(spool.append(makeEvent(ii)));
+	}
+
+	// Sequence numbers start at 1. A record in the middle with a bad checksum is skipped.
+	size_t offset = spoolRecordOffset(spool, 3) + offsetof(ConnectionEventSpoolRecord, ev.data);
+	EEPROM.write(offset, EEPROM.read(offset) ^ 0x40);
+
+	ConnectionEventInfo events[8];
+	CHECK(spool.read(events, 8) == 4);
+	CHECK(events[0].data == 0 && events[1].data == 1 && events[2].data == 3 && events[3].data == 4);
+
+	// consume() skips it as well, as if it had been read
+	spool.consume(2);
+	CHECK(spool.read(events, 8) == 2);
+	CHECK(events[0].data == 3 && events[1].data == 4);
+
+	// The newest record was cut off by a reset: the slot scan leaves it out
+	offset = spoolRecordOffset(spool, 5) + offsetof(ConnectionEventSpoolRecord, check);
+	EEPROM.write(offset, EEPROM.read(offset) ^ 0x01);
+
+	ConnectionEventSpool spool2;
+	spool2.setup();
+	CHECK(spoolContains(spool2, 3, 1));
+
+	// The next event goes in its slot
+	CHECK(spool2.append(makeEvent(100)));
+	CHECK(spool2.read(events, 8) == 2);
+	CHECK(events[0].data == 3 && events[1].data == 100);
+}
+
+static void testSpoolCorruptHeader() {
+	newDevice();
+
+	ConnectionEventSpool spool;
+	spool.setup();
+	for(int ii = 0; ii < 5; ii++) {
+		CHECK(spool.append(makeEvent(ii)));
+	}
+	spool.consume(2);
+
+	// The records still have valid checksums, but none of them are brought back
+	EEPROM.write(offsetof(ConnectionEventSpoolHeader, check), EEPROM.read(offsetof(ConnectionEventSpoolHeader, check)) ^ 0x01);
+
+	ConnectionEventSpool spool2;
+	spool2.setup();
+	CHECK(spool2.getCount() == 0);
+
+	ConnectionEventSpool spool3;
+	spool3.setup();
+	CHECK(spool3.getCount() == 0);
+
+	// New events are kept, and the old ones stay hidden
+	CHECK(spool3.append(makeEvent(100)));
+	ConnectionEventSpool spool4;
+	spool4.setup();
+	CHECK(spoolContains(spool4, 100, 1));
+}
+
+static void testSpoolWriteBudget() {
+	newDevice();
+
+	ConnectionEventSpool spool;
+	spool.withWriteBudget(20);
+	spool.setup();
+
+	int next = 0;
+	for(int ii = 0; ii < 20; ii++) {
+		CHECK(spool.append(makeEvent(next++)));
+	}
+	CHECK(!spool.append(makeEvent(next)));
+	CHECK(spool.getCount() == 20);
+
+	// The budget is in retained memory, so a reset doesn't refill it
+	ConnectionEventSpool spool2;
+	spool2.withWriteBudget(20);
+	spool2.setup();
+	CHECK(!spool2.append(makeEvent(next)));
+
+	// It refills at 20 per hour
+	HostClock::advance(30 * 60 * 1000);
+	for(int ii = 0; ii < 10; ii++) {
+		CHECK(spool2.append(makeEvent(next++)));
+	}
+	CHECK(!spool2.append(makeEvent(next)));
+	CHECK(spoolContains(spool2, 0, 30));
+}
+
+/**
+ * @brief Runs every periodMs and remembers how late its latest run was
+ */
+class PeriodicModule : public ScheduledModule {
+public:
+	PeriodicModule(unsigned long periodMs) : periodMs(periodMs) {};
+
+	void loop() {
+		uint32_t now = millis();
+		if (runs > 0 && (uint32_t)(now - dueAt) > maxLateMs) {
+			maxLateMs = now - dueAt;
+		}
+		if (runs > 0 && (int32_t)(now - dueAt) < 0) {
+			early++;
+		}
+		if (now >= 0x80000000) {
+			runsBeforeWrap++;
+		}
+		runs++;
+		dueAt = now + periodMs;
+	};
+
+	unsigned long getMillisUntilNextLoop() { return periodMs; };
+
+	unsigned long periodMs;
+	uint32_t dueAt = 0;
+	int runs = 0;
+	int runsBeforeWrap = 0;
+	int early = 0;
+	uint32_t maxLateMs = 0;
+};
+
+static void testSchedulerMillisWrap() {
+	newDevice();
+
+	// millis() is 32 bits and wraps around after 49.7 days. Start 5 seconds before that.
+	HostClock::set(0x100000000ULL - 5000);
+	CHECK(millis() == 0xffffffff - 4999);
+
+	ModuleScheduler scheduler;
+	PeriodicModule fast(100), medium(3000), slow(7000);
+	scheduler.add(fast);
+	scheduler.add(medium);
+	scheduler.add(slow);
+
+	// Deadlines before the wrap, across it and after it. The first run is at the start.
+	unsigned long maxUntilDeadline = 0;
+	for(int ii = 0; ii < 20000; ii++) {
+		scheduler.loop();
+		if (scheduler.getMillisUntilNextDeadline() > maxUntilDeadline) {
+			maxUntilDeadline = scheduler.getMillisUntilNextDeadline();
+		}
+		HostClock::set(HostClock::now() + 1);
+	}
+	CHECK(millis() == 15000);
+	CHECK(maxUntilDeadline <= fast.periodMs);
+
+	CHECK(fast.runs == 200 && fast.runsBeforeWrap == 50);
+	CHECK(medium.runs == 7 && medium.runsBeforeWrap == 2);
+	CHECK(slow.runs == 3 && slow.runsBeforeWrap == 1);
+	CHECK(fast.maxLateMs == 0 && medium.maxLateMs == 0 && slow.maxLateMs == 0);
+	CHECK(fast.early == 0 && medium.early == 0 && slow.early == 0);
+}
+
+static void testPublishQueueDataLength() {
+	newDevice();
+	env.connected = true;
+
+	PublishScheduler publishScheduler(1, 1000);
+	publishScheduler.setup();
+
+	// Uses the only token
+	CHECK(PublishScheduler::publish(PublishScheduler::PRIORITY_NORMAL, "test", "first"));
+	CHECK(env.publishes == 1);
+
+	// Data that fits is queued, data that would be cut off is rejected
+	std::string fits(PublishScheduler::MAX_QUEUED_DATA - 1, 'a');
+	std::string tooLong(PublishScheduler::MAX_QUEUED_DATA, 'b');
+	CHECK(PublishScheduler::publish(PublishScheduler::PRIORITY_NORMAL, "test", fits.c_str()));
+	CHECK(!PublishScheduler::publish(PublishScheduler::PRIORITY_LOW, "test", tooLong.c_str()));
+	CHECK(publishScheduler.getQueuedCount() == 1);
+	CHECK(publishScheduler.getDroppedCount() == 1);
+
+	HostClock::advance(1000);
+	publishScheduler.loop();
+	CHECK(env.publishes == 2);
+	CHECK(env.lastData == fits);
+
+	// With a token, data of any length is published right away
+	HostClock::advance(1000);
+	CHECK(PublishScheduler::publish(PublishScheduler::PRIORITY_NORMAL, "test", tooLong.c_str()));
+	CHECK(env.publishes == 3);
+	CHECK(env.lastData == tooLong);
+}
+
+int main(int argc, char *argv[]) {
+	HostEnvironment::setCurrent(&env);
+
+	testSpoolAppendReadConsume();
+	testSpoolWrapAround();
+	testSpoolCorruptRecord();
+	testSpoolCorruptHeader();
+	testSpoolWriteBudget();
+	testSchedulerMillisWrap();
+	testPublishQueueDataLength();
+
+	printf("%d checks, %d failed\n", checks, failures);
+	return (failures == 0) ? 0 : 1;
+}
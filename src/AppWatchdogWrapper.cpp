@@ -2,6 +2,7 @@
 
 #include "AppWatchdogWrapper.h"
 
+#include "Breadcrumbs.h"
 #include "ConnectionEvents.h"
 
 // Note: The 1800 parameter is because the default stack size is too small in 0.7.0
@@ -16,9 +17,9 @@ AppWatchdogWrapper::~AppWatchdogWrapper() {
 
 // static
 void AppWatchdogWrapper::watchdogCallback() {
-	// This isn't quite safe; connectionEvents.add should only be called from the main loop thread,
-	// but since by definition the main loop thread is stuck when the app watchdog fires, this is
-	// probably not that unsafe. (The application watchdog runs in a separate thread.)
-	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_APP_WATCHDOG);
+	// The application watchdog runs in a separate thread, and the loop thread could be stuck holding
+	// the log lock, so only write the event to retained memory. It's published after the reset.
+	ConnectionEvents::addEventBeforeReset(ConnectionEvents::CONNECTION_EVENT_APP_WATCHDOG);
+	Breadcrumbs::requestUpload();
 	System.reset();
 }
@@ -1,10 +1,24 @@
 #include "BatteryCheck.h"
 
 #include "ConnectionEvents.h"
+#include "PowerState.h"
+
+#include <math.h>
 
 static FuelGauge fuel;
 static PMIC pmic;
 
+retained BatteryRetainedData BatteryCheck::batteryRetainedData;
+
+// Below this, the battery isn't considered to be charging (percent per hour)
+static const float MIN_CHARGE_RATE = 0.1;
+
+// Check as often as possible when the SoC is this close to the threshold
+static const float NEAR_THRESHOLD_PCT = 3.0;
+
+// When it's still draining while asleep, sleep for this fraction of the projected time until empty
+static const float DRAIN_SLEEP_FRACTION = 0.5;
+
 BatteryCheck::BatteryCheck(float minimumSoC, long sleepTimeSecs) : minimumSoC(minimumSoC), sleepTimeSecs(sleepTimeSecs) {
 
 
@@ -14,25 +28,197 @@ BatteryCheck::~BatteryCheck() {
 }
 
 void BatteryCheck::setup() {
+	if (batteryRetainedData.magic != BATTERY_MAGIC) {
+		memset(&batteryRetainedData, 0, sizeof(batteryRetainedData));
+		batteryRetainedData.magic = BATTERY_MAGIC;
+	}
+	checkPeriodMs = minCheckPeriodMs;
+
 	checkAndSleepIfNecessary();
 }
 
 void BatteryCheck::loop() {
-	if (millis() - lastCheckMs >= CHECK_PERIOD_MS) {
+	if (millis() - lastCheckMs >= checkPeriodMs) {
 		lastCheckMs = millis();
 		checkAndSleepIfNecessary();
 	}
 }
 
+unsigned long BatteryCheck::getMillisUntilNextLoop() {
+	return millisUntil(lastCheckMs, checkPeriodMs);
+}
+
 void BatteryCheck::checkAndSleepIfNecessary() {
 	float soc = fuel.getSoC();
+	if (soc == 0.0) {
+		// No reading
+		return;
+	}
+	float vcell = fuel.getVCell();
+	bool powerGood = pmic.isPowerGood();
+
+	if (Time.isValid()) {
+		time_t now = Time.now();
+		updateTrend(now, soc, powerGood);
+		addSample(now, soc, vcell, powerGood);
+	}
+
+	// With a trend, the decisions below and PowerState all use the fitted value at now, which isn't
+	// as noisy as a single reading
+	if (trendValid) {
+		soc = fittedSoC;
+	}
+	updateCheckPeriod(soc);
+
+	// External power (USB or VIN) doesn't count if the battery is still draining, like with a solar
+	// panel that can't keep up
+	bool externalPower = powerGood && !(trendValid && ratePerHour < -MIN_CHARGE_RATE);
+	if (PowerState::getInstance()) {
+		PowerState::getInstance()->update(soc, externalPower);
+	}
 
-	// There is an SoC, it's less than the minimum, and there's no external power (USB or VIN)
-	if (soc != 0.0 && soc < minimumSoC && !pmic.isPowerGood()) {
-		ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_LOW_BATTERY_SLEEP, static_cast<int>(soc));
+	if (externalPower) {
+		batteryRetainedData.lowBattery = false;
+		return;
+	}
+
+	// After a low battery sleep, stay asleep until it's recovered by more than the hysteresis
+	float threshold = batteryRetainedData.lowBattery ? (minimumSoC + hysteresis) : minimumSoC;
+	bool low = (soc < threshold) || (minimumVoltage > 0.0 && vcell < minimumVoltage);
+
+	// Draining fast enough to go below the minimum before the next check
+	bool predicted = false;
+	if (!low && trendValid && ratePerHour < 0.0 && soc + ratePerHour * checkPeriodMs / 3600000.0 < minimumSoC) {
+		low = predicted = true;
+	}
 
-		System.sleep(SLEEP_MODE_DEEP, sleepTimeSecs);
+	if (!low) {
+		batteryRetainedData.lowBattery = false;
+		return;
 	}
+	batteryRetainedData.lowBattery = true;
 
+	long sleepSecs = getSleepSecs(soc);
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_LOW_BATTERY_SLEEP, static_cast<int>(soc));
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_BATTERY_SLEEP, packSleepPlan(sleepSecs, trendValid, ratePerHour, predicted));
+
+	System.sleep(SLEEP_MODE_DEEP, sleepSecs);
 }
 
+void BatteryCheck::addSample(time_t now, float soc, float vcell, bool powerGood) {
+	BatteryRetainedData &data = batteryRetainedData;
+
+	if (data.writeIndex > 0) {
+		// Only keep one sample per SAMPLE_INTERVAL_SECS, unless the power source changed
+		const BatterySample &newest = data.samples[(data.writeIndex - 1) % BATTERY_NUM_SAMPLES];
+		bool newestPowerGood = (newest.vcell & BATTERY_SAMPLE_POWER_GOOD) != 0;
+		if (now >= (time_t)newest.ts && now - (time_t)newest.ts < SAMPLE_INTERVAL_SECS && newestPowerGood == powerGood) {
+			return;
+		}
+	}
+
+	BatterySample &sample = data.samples[data.writeIndex % BATTERY_NUM_SAMPLES];
+	sample.ts = (uint32_t)now;
+	sample.soc = (uint16_t)(soc * 100.0 + 0.5);
+	sample.vcell = (uint16_t)(vcell * 1000.0 + 0.5) & ~BATTERY_SAMPLE_POWER_GOOD;
+	if (powerGood) {
+		sample.vcell |= BATTERY_SAMPLE_POWER_GOOD;
+	}
+	data.writeIndex++;
+}
+
+// Least squares fit of SoC against time over the current reading and the recent samples taken
+// with the same power source
+void BatteryCheck::updateTrend(time_t now, float soc, bool powerGood) {
+	const BatteryRetainedData &data = batteryRetainedData;
+	float sumT = 0.0, sumS = 0.0, sumTT = 0.0, sumTS = 0.0;
+	size_t count = 0;
+	time_t oldest = now;
+
+	auto addPoint = [&](float hours, float pct) {
+		sumT += hours;
+		sumS += pct;
+		sumTT += hours * hours;
+		sumTS += hours * pct;
+		count++;
+	};
+	addPoint(0.0, soc);
+
+	for(size_t ii = 0; ii < BATTERY_NUM_SAMPLES && ii < data.writeIndex; ii++) {
+		const BatterySample &sample = data.samples[(data.writeIndex - 1 - ii) % BATTERY_NUM_SAMPLES];
+		if (((sample.vcell & BATTERY_SAMPLE_POWER_GOOD) != 0) != powerGood ||
+			(time_t)sample.ts > now || now - (time_t)sample.ts > TREND_WINDOW_SECS) {
+			break;
+		}
+		addPoint(-(float)(now - (time_t)sample.ts) / 3600.0, sample.soc / 100.0);
+		oldest = sample.ts;
+	}
+
+	float denominator = count * sumTT - sumT * sumT;
+	trendValid = count >= TREND_MIN_SAMPLES && now - oldest >= TREND_MIN_SPAN_SECS && denominator > 0.0;
+	ratePerHour = trendValid ? (count * sumTS - sumT * sumS) / denominator : 0.0;
+	fittedSoC = trendValid ? (sumS - ratePerHour * sumT) / count : soc;
+}
+
+void BatteryCheck::updateCheckPeriod(float soc) {
+	float threshold = batteryRetainedData.lowBattery ? (minimumSoC + hysteresis) : minimumSoC;
+	unsigned long period = maxCheckPeriodMs;
+
+	if (!trendValid || soc < threshold + NEAR_THRESHOLD_PCT) {
+		period = minCheckPeriodMs;
+	}
+	else
+	if (ratePerHour != 0.0) {
+		// Often enough to see each half percent change
+		float ms = 0.5 / fabsf(ratePerHour) * 3600000.0;
+		if (ms < period) {
+			period = (unsigned long)ms;
+		}
+	}
+	checkPeriodMs = (period > minCheckPeriodMs) ? period : minCheckPeriodMs;
+}
+
+long BatteryCheck::getSleepSecs(float soc) const {
+	if (!trendValid) {
+		return sleepTimeSecs;
+	}
+
+	long secs = maxSleepSecs;
+	float resumeSoC = minimumSoC + hysteresis;
+	if (ratePerHour > MIN_CHARGE_RATE) {
+		// Until it's projected to be charged enough to stay awake
+		secs = (soc < resumeSoC) ? (long)((resumeSoC - soc) / ratePerHour * 3600.0) : 0;
+	}
+	else
+	if (ratePerHour < -MIN_CHARGE_RATE) {
+		// Still draining, even while asleep. Check again while there's some charge left, in case
+		// the power source has come back.
+		float emptySecs = soc / -ratePerHour * 3600.0;
+		if (emptySecs * DRAIN_SLEEP_FRACTION < secs) {
+			secs = (long)(emptySecs * DRAIN_SLEEP_FRACTION);
+		}
+	}
+
+	if (secs < minSleepSecs) {
+		secs = minSleepSecs;
+	}
+	if (secs > maxSleepSecs) {
+		secs = maxSleepSecs;
+	}
+	return secs;
+}
+
+// static
+int BatteryCheck::packSleepPlan(long sleepSecs, bool hasTrend, float ratePerHour, bool predicted) {
+	uint32_t mins = (uint32_t)((sleepSecs + 59) / 60);
+	if (mins > 0x7fff) {
+		mins = 0x7fff;
+	}
+
+	int32_t rate = BATTERY_RATE_UNKNOWN;
+	if (hasTrend) {
+		float scaled = ratePerHour * 100.0;
+		rate = (scaled > 32767.0) ? 32767 : (scaled < -32767.0) ? -32767 : (int32_t)lroundf(scaled);
+	}
+	return (int)(((uint32_t)(uint16_t)rate << 16) | (predicted ? 0x8000 : 0) | mins);
+}
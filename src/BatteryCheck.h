@@ -3,23 +3,124 @@
 
 #include "Particle.h"
 
-class BatteryCheck {
+#include "ModuleScheduler.h"
+
+// One reading of the battery, kept in retained memory
+typedef struct {
+	uint32_t ts; // Time.now()
+	uint16_t soc; // SoC * 100
+	uint16_t vcell; // mV, with BATTERY_SAMPLE_POWER_GOOD set if there was external power
+} BatterySample;
+
+const size_t BATTERY_NUM_SAMPLES = 16;
+const uint16_t BATTERY_SAMPLE_POWER_GOOD = 0x8000;
+
+// This structure is what's stored in retained memory. The samples are kept across deep sleep, so
+// the trend includes charging or draining while asleep.
+typedef struct {
+	uint32_t magic;
+	uint32_t writeIndex; // Total number of samples added; the newest is at (writeIndex - 1) % BATTERY_NUM_SAMPLES
+	uint8_t lowBattery; // Went to sleep because the battery was low, and hasn't recovered yet
+	uint8_t reserved[3];
+	BatterySample samples[BATTERY_NUM_SAMPLES];
+} BatteryRetainedData;
+
+/**
+ * @brief Puts the device to sleep when the battery is low
+ *
+ * The SoC, cell voltage and whether there's external power are sampled every SAMPLE_INTERVAL_SECS
+ * into retained memory, and a straight line fit over the recent samples gives the rate the battery
+ * is charging or draining. That's used to:
+ *
+ * - Add hysteresis: after a low battery sleep, the device keeps going back to sleep until the SoC is
+ * at least minimumSoC + the hysteresis, so a noisy reading near the threshold doesn't make it
+ * wake up and power the modem over and over.
+ * - Go to sleep early when the battery is draining fast enough to drop below minimumSoC before
+ * the next check.
+ * - Choose how long to sleep. When it's charging, the sleep lasts until the SoC is projected to
+ * reach the resume level. When it's still draining, it lasts half of the projected time until
+ * the battery is empty, so it's checked again while there's charge left. When it's steady, waking
+ * up early won't help, so it sleeps for the longest time allowed. Until there are enough samples,
+ * the sleepTimeSecs passed to the constructor is used.
+ * - Check more often when the SoC is changing quickly or is close to the threshold, and less often
+ * when it's steady.
+ * - Still sleep when there's external power but the battery is draining anyway, like a solar panel
+ * that can't keep up with the load.
+ *
+ * With a trend, all of these, and the SoC given to PowerState, use the SoC from the fit rather than
+ * the latest reading.
+ *
+ * Samples are only taken once the time is valid, since the trend is worked out from Time.now().
+ *
+ * If there's a PowerState object, each check also updates its power tier.
+ */
+class BatteryCheck : public ScheduledModule {
 public:
 	BatteryCheck(float minimumSoC = 15.0, long sleepTimeSecs = 3600);
 	virtual ~BatteryCheck();
 
+	// How far above minimumSoC the battery needs to be to stay awake after a low battery sleep. Default: 2.0
+	inline BatteryCheck &withHysteresis(float pct) { hysteresis = pct; return *this; };
+
+	// Limits for the sleep time when there's a trend. Default: 15 minutes to 6 hours
+	inline BatteryCheck &withSleepRange(long minSecs, long maxSecs) { minSleepSecs = minSecs; maxSleepSecs = maxSecs; return *this; };
+
+	// Limits for the check period. Default: 1 minute to 10 minutes
+	inline BatteryCheck &withCheckPeriodRange(unsigned long minMs, unsigned long maxMs) { minCheckPeriodMs = minMs; maxCheckPeriodMs = maxMs; return *this; };
+
+	// Also treat the battery as low when the cell voltage is below this. Default: 0 (not used)
+	inline BatteryCheck &withMinimumVoltage(float volts) { minimumVoltage = volts; return *this; };
+
 	void setup();
 
 	void loop();
 
+	unsigned long getMillisUntilNextLoop();
+
 	void checkAndSleepIfNecessary();
 
-	static const unsigned long CHECK_PERIOD_MS = 60000;
+	// Rate the SoC is changing, in percent per hour, positive when charging. Only valid if hasTrend() is true.
+	inline float getRatePerHour() const { return ratePerHour; };
+	inline bool hasTrend() const { return trendValid; };
+
+	inline unsigned long getCheckPeriod() const { return checkPeriodMs; };
+	inline bool isLowBattery() const { return batteryRetainedData.lowBattery != 0; };
+
+	static inline const BatteryRetainedData &getRetainedData() { return batteryRetainedData; };
+
+	// Packs the data of a CONNECTION_EVENT_BATTERY_SLEEP event: the sleep time in minutes in bits 0-14,
+	// bit 15 set if it was because of the trend rather than the SoC, and the rate in 0.01% per hour in
+	// bits 16-31 (signed), or BATTERY_RATE_UNKNOWN if there isn't a trend.
+	static int packSleepPlan(long sleepSecs, bool hasTrend, float ratePerHour, bool predicted);
+
+	static const uint32_t BATTERY_MAGIC = 0x3b1f0c01;
+	static const time_t SAMPLE_INTERVAL_SECS = 600;
+	static const time_t TREND_WINDOW_SECS = 4 * 3600; // Samples older than this aren't used
+	static const size_t TREND_MIN_SAMPLES = 3;
+	static const time_t TREND_MIN_SPAN_SECS = 1200;
+	static const int16_t BATTERY_RATE_UNKNOWN = -32768;
 
 private:
+	void addSample(time_t now, float soc, float vcell, bool powerGood);
+	void updateTrend(time_t now, float soc, bool powerGood);
+	void updateCheckPeriod(float soc);
+	long getSleepSecs(float soc) const;
+
 	float minimumSoC;
 	long sleepTimeSecs;
+	float hysteresis = 2.0;
+	long minSleepSecs = 15 * 60;
+	long maxSleepSecs = 6 * 3600;
+	unsigned long minCheckPeriodMs = 60000;
+	unsigned long maxCheckPeriodMs = 600000;
+	float minimumVoltage = 0.0;
 	unsigned long lastCheckMs = 0;
+	unsigned long checkPeriodMs = 60000;
+	float ratePerHour = 0.0;
+	float fittedSoC = 0.0; // SoC from the straight line fit at the time of the last check
+	bool trendValid = false;
+
+	static BatteryRetainedData batteryRetainedData;
 };
 
 #endif // __BATTERYCHECK_H
@@ -0,0 +1,111 @@
+#include "Breadcrumbs.h"
+
+#include "ConnectionEvents.h"
+#include "PublishScheduler.h"
+
+retained BreadcrumbsRetainedData Breadcrumbs::breadcrumbsRetainedData;
+
+
+Breadcrumbs::Breadcrumbs(const char *eventName) : eventName(eventName) {
+
+}
+
+Breadcrumbs::~Breadcrumbs() {
+
+}
+
+void Breadcrumbs::setup() {
+	if (breadcrumbsRetainedData.magic != BREADCRUMBS_MAGIC) {
+		// Cold boot, there's no trail
+		memset(&breadcrumbsRetainedData, 0, sizeof(breadcrumbsRetainedData));
+		breadcrumbsRetainedData.magic = BREADCRUMBS_MAGIC;
+	}
+	else
+	if (!breadcrumbsRetainedData.frozen) {
+		int resetReason = System.resetReason();
+		if (resetReason == RESET_REASON_PANIC || resetReason == RESET_REASON_WATCHDOG || breadcrumbsRetainedData.uploadRequested) {
+			// Keep the trail until it's been published
+			breadcrumbsRetainedData.resetReason = resetReason;
+			breadcrumbsRetainedData.frozen = 1;
+		}
+	}
+	breadcrumbsRetainedData.uploadRequested = 0;
+	trailIndex = 0;
+
+	mark(BREADCRUMB_SETUP);
+}
+
+void Breadcrumbs::loop() {
+	if (!breadcrumbsRetainedData.frozen || !Particle.connected()) {
+		return;
+	}
+
+	char buf[ConnectionEvents::PUBLISH_MAX_DATA + 1];
+	size_t index = trailIndex;
+	if (formatTrail(breadcrumbsRetainedData, index, buf, sizeof(buf))) {
+		if (!PublishScheduler::tryPublish(PublishScheduler::PRIORITY_NORMAL, eventName, buf, lastPublish)) {
+			// Not time yet, or it failed. Try the same entries again later.
+			return;
+		}
+		trailIndex = index;
+		if (formatTrail(breadcrumbsRetainedData, index, buf, sizeof(buf))) {
+			// More to send
+			return;
+		}
+	}
+
+	// All sent, start a new trail. Stage 0 isn't used, so mark() won't match a cleared entry.
+	memset(breadcrumbsRetainedData.crumbs, 0, sizeof(breadcrumbsRetainedData.crumbs));
+	breadcrumbsRetainedData.writeIndex = 0;
+	breadcrumbsRetainedData.frozen = 0;
+	trailIndex = 0;
+}
+
+unsigned long Breadcrumbs::getMillisUntilNextLoop() {
+	if (!breadcrumbsRetainedData.frozen) {
+		return NOT_SCHEDULED;
+	}
+	if (!Particle.connected()) {
+		return DISCONNECTED_POLL_MS;
+	}
+	return PublishScheduler::millisUntilCanPublish(lastPublish);
+}
+
+// static
+bool Breadcrumbs::formatTrail(const BreadcrumbsRetainedData &data, size_t &index, char *buf, size_t bufSize) {
+	size_t count = (data.writeIndex < MAX_BREADCRUMBS) ? data.writeIndex : MAX_BREADCRUMBS;
+	buf[0] = 0;
+	if (index >= count) {
+		return false;
+	}
+
+	size_t len = snprintf(buf, bufSize, "%d,%u:", (int)data.resetReason, (unsigned)index);
+	size_t headerLen = len;
+
+	for(; index < count; index++) {
+		uint32_t crumb = data.crumbs[(data.writeIndex - 1 - index) % MAX_BREADCRUMBS];
+		uint8_t stage = (uint8_t) crumb;
+		uint32_t deltaMs = 0;
+		if (index > 0) {
+			// Milliseconds before the next newer entry, which is the one before it in the publish
+			uint32_t newer = data.crumbs[(data.writeIndex - index) % MAX_BREADCRUMBS];
+			deltaMs = ((newer >> 8) - (crumb >> 8)) & 0xffffff;
+		}
+
+		char entry[16];
+		size_t entryLen;
+		if (deltaMs != 0) {
+			entryLen = snprintf(entry, sizeof(entry), "%s%x-%lu", (len > headerLen) ? "," : "", stage, (unsigned long)deltaMs);
+		}
+		else {
+			entryLen = snprintf(entry, sizeof(entry), "%s%x", (len > headerLen) ? "," : "", stage);
+		}
+		if (len + entryLen >= bufSize) {
+			// Continue in the next publish
+			break;
+		}
+		strcpy(&buf[len], entry);
+		len += entryLen;
+	}
+	return true;
+}
@@ -0,0 +1,131 @@
+#ifndef __BREADCRUMBS_H
+#define __BREADCRUMBS_H
+
+#include "Particle.h"
+
+#include "ModuleScheduler.h"
+
+// Number of breadcrumbs kept, a power of 2. Each one uses 4 bytes of retained memory.
+#ifndef BREADCRUMBS_MAX
+#define BREADCRUMBS_MAX 64
+#endif
+
+// The stages marked by the library. Values from BREADCRUMB_USER up are for your own code. 0 isn't
+// a valid stage.
+enum BreadcrumbStage {
+	BREADCRUMB_SETUP = 0x01, // Breadcrumbs::setup()
+
+	// ConnectionCheck
+	BREADCRUMB_CONNECTION_MONITOR = 0x10,
+	BREADCRUMB_CONNECTION_PING = 0x11,
+	BREADCRUMB_CONNECTION_RECOVERY_STEP = 0x12,
+	BREADCRUMB_CONNECTION_RECONNECT = 0x13,
+	BREADCRUMB_CONNECTION_MODEM_RESET_FLUSH = 0x14,
+	BREADCRUMB_CONNECTION_MODEM_RESET_DISCONNECT = 0x15,
+	BREADCRUMB_CONNECTION_MODEM_RESET_COMMAND = 0x16, // Before AT+CFUN=16
+	BREADCRUMB_CONNECTION_MODEM_RESET_SETTLE = 0x17, // After AT+CFUN=16 returned
+
+	// SessionCheck
+	BREADCRUMB_SESSION_START_CHECK = 0x20,
+	BREADCRUMB_SESSION_SEND_PROBE = 0x21,
+	BREADCRUMB_SESSION_FINISH_CHECK = 0x22,
+	BREADCRUMB_SESSION_CHECK_FAILED = 0x23,
+	BREADCRUMB_SESSION_RESET = 0x24,
+
+	// ConnectionEvents
+	BREADCRUMB_EVENTS_SPILL = 0x30,
+	BREADCRUMB_EVENTS_PUBLISH = 0x31, // Before Particle.publish()
+	BREADCRUMB_EVENTS_PUBLISHED = 0x32, // After Particle.publish() returned
+
+	BREADCRUMB_USER = 0x80
+};
+
+// This structure is what's stored in retained memory (16 + 4 * BREADCRUMBS_MAX bytes)
+typedef struct {
+	uint32_t magic;
+	uint32_t writeIndex; // Number of breadcrumbs written. The next one goes in crumbs[writeIndex % BREADCRUMBS_MAX].
+	int32_t resetReason; // Of the reset the frozen trail is from
+	uint8_t uploadRequested; // Set by requestUpload()
+	uint8_t frozen; // The trail is waiting to be published, and mark() does nothing
+	uint8_t reserved[2];
+	uint32_t crumbs[BREADCRUMBS_MAX]; // (millis() << 8) | stage
+} BreadcrumbsRetainedData;
+
+/**
+ * @brief A trail of the last stages the code went through, kept in retained memory so it can be
+ * uploaded after a crash
+ *
+ * mark() writes the stage and the low 24 bits of millis() to a ring of BREADCRUMBS_MAX entries.
+ * It's inline and only takes a few instructions, with no locks or formatting, so it can go on the
+ * hot paths. If the stage is the same as the last one, only the time is updated, so a stage
+ * that runs on every loop only takes one entry. The library marks the states of ConnectionCheck
+ * and SessionCheck and the publishes in ConnectionEvents; use values from BREADCRUMB_USER up for
+ * your own code. mark() is meant to be called from the loop thread. If two threads mark at the
+ * same time one of the breadcrumbs can be lost, but nothing worse.
+ *
+ * After a panic, a hardware watchdog reset, or a reset by AppWatchdogWrapper or
+ * HeartbeatWatchdog (which call requestUpload()), setup() freezes the trail and it's published
+ * once the cloud is connected. Until then mark() does nothing, so the trail survives more resets,
+ * like a recovery sleep, before the cloud is reached. If the device crashes again in the
+ * meantime, the first trail is kept. It's published newest first:
+ *
+ * reason,index:stage-ms,stage-ms,...
+ *
+ * reason is the reset reason, the same as in the RESET_REASON event. index is the position of the
+ * first entry of the publish in the trail, 0 for the newest, as the trail is split over more than
+ * one publish if it doesn't fit. stage is in hex. ms is how many milliseconds before the entry
+ * before it this one was marked, and is left out for the newest entry and when it's 0.
+ *
+ * Call setup() first in your setup(), and add it to the ModuleScheduler so it can publish, or
+ * call its loop() from yours.
+ */
+class Breadcrumbs : public ScheduledModule {
+public:
+	Breadcrumbs(const char *eventName = "breadcrumbs");
+	virtual ~Breadcrumbs();
+
+	void setup();
+	void loop();
+
+	unsigned long getMillisUntilNextLoop();
+
+	static inline void mark(uint8_t stage) {
+		if (breadcrumbsRetainedData.frozen) {
+			return;
+		}
+		uint32_t index = breadcrumbsRetainedData.writeIndex;
+		uint32_t crumb = ((uint32_t)millis() << 8) | stage;
+		uint32_t &last = breadcrumbsRetainedData.crumbs[(index - 1) % BREADCRUMBS_MAX];
+		if ((uint8_t)last == stage) {
+			last = crumb;
+		}
+		else {
+			breadcrumbsRetainedData.crumbs[index % BREADCRUMBS_MAX] = crumb;
+			breadcrumbsRetainedData.writeIndex = index + 1;
+		}
+	};
+
+	// Uploads the trail after the next reset, whatever the reset reason. Safe to call from any thread.
+	static inline void requestUpload() { breadcrumbsRetainedData.uploadRequested = 1; };
+
+	// Formats the entries of the trail in data, newest first, starting at index, and updates index
+	// to where the next publish should start. Returns false if there is nothing left to publish.
+	static bool formatTrail(const BreadcrumbsRetainedData &data, size_t &index, char *buf, size_t bufSize);
+
+	static inline const BreadcrumbsRetainedData &getRetainedData() { return breadcrumbsRetainedData; };
+
+	static const uint32_t BREADCRUMBS_MAGIC = 0xb7ead001;
+	static const size_t MAX_BREADCRUMBS = BREADCRUMBS_MAX;
+	static const unsigned long DISCONNECTED_POLL_MS = 1000; // How often to check for a cloud connection when there's a trail to publish
+
+private:
+	const char *eventName;
+	size_t trailIndex = 0; // First entry of the next publish, 0 for the newest
+	unsigned long lastPublish = 0;
+
+	static BreadcrumbsRetainedData breadcrumbsRetainedData;
+
+	static_assert((BREADCRUMBS_MAX & (BREADCRUMBS_MAX - 1)) == 0, "BREADCRUMBS_MAX must be a power of 2");
+};
+
+#endif /* __BREADCRUMBS_H */
@@ -0,0 +1,73 @@
+
+#include "CompactEncoding.h"
+
+static const char z85Chars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+
+// static
+size_t CompactEncoding::varintLength(uint32_t value) {
+	size_t len = 1;
+	while(value >= 0x80) {
+		value >>= 7;
+		len++;
+	}
+	return len;
+}
+
+// static
+size_t CompactEncoding::appendVarint(uint8_t *buf, uint32_t value) {
+	size_t len = 0;
+	while(value >= 0x80) {
+		buf[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = (uint8_t)value;
+	return len;
+}
+
+// static
+size_t CompactEncoding::z85Length(size_t binaryLen) {
+	size_t partial = binaryLen % 4;
+	return (binaryLen / 4) * 5 + ((partial != 0) ? (partial + 1) : 0);
+}
+
+// static
+size_t CompactEncoding::z85MaxBinary(size_t maxChars) {
+	size_t partial = maxChars % 5;
+	return (maxChars / 5) * 4 + ((partial != 0) ? (partial - 1) : 0);
+}
+
+// static
+size_t CompactEncoding::z85Encode(const uint8_t *src, size_t len, char *dst) {
+	size_t out = 0;
+
+	for(size_t ii = 0; ii < len; ii += 4) {
+		size_t groupLen = len - ii;
+		if (groupLen > 4) {
+			groupLen = 4;
+		}
+
+		// Big-endian 32-bit value, zero padded if this is the partial group at the end
+		uint32_t value = 0;
+		for(size_t jj = 0; jj < 4; jj++) {
+			value <<= 8;
+			if (jj < groupLen) {
+				value |= src[ii + jj];
+			}
+		}
+
+		char group[5];
+		for(int jj = 4; jj >= 0; jj--) {
+			group[jj] = z85Chars[value % 85];
+			value /= 85;
+		}
+
+		// A partial group of n bytes only needs the first n + 1 characters
+		size_t numChars = (groupLen == 4) ? 5 : (groupLen + 1);
+		for(size_t jj = 0; jj < numChars; jj++) {
+			dst[out++] = group[jj];
+		}
+	}
+	dst[out] = 0;
+
+	return out;
+}
@@ -0,0 +1,40 @@
+#ifndef __COMPACTENCODING_H
+#define __COMPACTENCODING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Helpers for building compact binary payloads that can be sent in a Particle.publish
+ *
+ * Integers are stored as varints (7 bits per byte, least significant group first, high bit set
+ * on all but the last byte). Signed values and deltas are zigzag encoded first so small negative
+ * numbers stay small.
+ *
+ * Since publish data must be a printable string, the binary data is then converted to text using
+ * the Z85 (base85) alphabet. A full group of 4 bytes becomes 5 characters; a final partial group
+ * of n bytes becomes n + 1 characters, the same way Ascii85 handles it.
+ */
+class CompactEncoding {
+public:
+	// Maps a signed value to an unsigned one: 0 -> 0, -1 -> 1, 1 -> 2, -2 -> 3, ...
+	inline static uint32_t zigzag(int32_t value) { return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31); };
+
+	// Number of bytes appendVarint() will use for value (1 - 5)
+	static size_t varintLength(uint32_t value);
+
+	// Stores value at buf and returns the number of bytes used
+	static size_t appendVarint(uint8_t *buf, uint32_t value);
+
+	// Number of Z85 characters (not including the null terminator) needed for binaryLen bytes
+	static size_t z85Length(size_t binaryLen);
+
+	// Largest number of binary bytes that can be encoded in maxChars Z85 characters
+	static size_t z85MaxBinary(size_t maxChars);
+
+	// Encodes len bytes from src into dst. dst must have room for z85Length(len) + 1 bytes.
+	// The result is null terminated. Returns the number of characters, not including the null.
+	static size_t z85Encode(const uint8_t *src, size_t len, char *dst);
+};
+
+#endif /* __COMPACTENCODING_H */
@@ -1,6 +1,9 @@
 
 
 #include "ConnectionCheck.h"
+#include "Breadcrumbs.h"
+#include "PowerState.h"
+#include "PublishScheduler.h"
 
 ConnectionCheck *ConnectionCheck::instance;
 
@@ -11,17 +14,100 @@ ConnectionCheck::ConnectionCheck()  {
 	if (connectionCheckRetainedData.magic != CONNECTION_CHECK_MAGIC) {
 		connectionCheckRetainedData.magic = CONNECTION_CHECK_MAGIC;
 		connectionCheckRetainedData.numFailures = 0;
+		connectionCheckRetainedData.jitterState = 0;
+		connectionCheckRetainedData.outageStartSecs = 0;
+		connectionCheckRetainedData.lastSummarySecs = 0;
+		connectionCheckRetainedData.bootToCellular.clear();
+		connectionCheckRetainedData.cellularToCloud.clear();
+		connectionCheckRetainedData.outage.clear();
 	}
 }
 ConnectionCheck::~ConnectionCheck() {
-
+	if (instance == this) {
+		instance = NULL;
+	}
 }
 
 void ConnectionCheck::setup() {
+	if (connectionCheckRetainedData.jitterState == 0) {
+		// Seed from the device ID so each device is different even if rand() isn't seeded
+		String deviceID = System.deviceID();
+		uint32_t seed = 2166136261UL;
+		for(const char *cp = deviceID.c_str(); *cp; cp++) {
+			seed = (seed ^ (uint8_t)*cp) * 16777619UL;
+		}
+		seed ^= (uint32_t)rand();
+		connectionCheckRetainedData.jitterState = (seed != 0) ? seed : 1;
+	}
 
+	// Not connected to the cloud yet, the wait for the next recovery step starts now
+	cloudCheckStart = millis();
+	recoveryWaitMs = getRecoveryWait(connectionCheckRetainedData.numFailures);
+}
+
+ConnectionCheck &ConnectionCheck::withRecoverySteps(const RecoveryAction *steps, size_t numSteps) {
+	if (numSteps > MAX_RECOVERY_STEPS) {
+		numSteps = MAX_RECOVERY_STEPS;
+	}
+	if (numSteps > 0) {
+		for(size_t ii = 0; ii < numSteps; ii++) {
+			recoverySteps[ii] = steps[ii];
+		}
+		numRecoverySteps = numSteps;
+	}
+	return *this;
 }
 
 void ConnectionCheck::loop() {
+	stateHandler(*this);
+}
+
+void ConnectionCheck::monitorState() {
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_MONITOR);
+	updateConnectionState();
+
+	publishHistograms();
+
+	if (!isCloudConnected) {
+		// Not connected to the cloud - check to see if we've spent long enough in this state to reboot
+		if (cloudWaitForReboot != 0 && millis() - cloudCheckStart >= recoveryWaitMs) {
+			// The time to wait to connect to the cloud has expired, take the next recovery step
+			RecoveryAction action = getRecoveryAction(connectionCheckRetainedData.numFailures);
+
+			if (action != RECOVERY_SESSION_RESTART && action != RECOVERY_CELLULAR_CYCLE &&
+				isCellularReady && cloudConnectDebug()) {
+				// Generate events about the state of the connection before rebooting. The reboot
+				// happens in pingState() once the pings are done.
+				stateHandler = &ConnectionCheck::pingState;
+				return;
+			}
+
+			takeRecoveryStep();
+		}
+	}
+
+
+	if (Cellular.listening()) {
+		// Entered listening mode (blinking blue). Could be from holding down the MODE button, or
+		// by repeated connection failures, see: https://github.com/spark/firmware/issues/687
+		if (listeningStart == 0) {
+			listeningStart = millis();
+			ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_LISTENING_ENTERED);
+
+			Log.info("entered listening mode");
+		}
+		else {
+			if (listenWaitForReboot != 0 && millis() - listeningStart >= listenWaitForReboot) {
+				// Reboot
+				ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_REBOOT_LISTENING);
+				fullModemReset();
+			}
+		}
+	}
+}
+
+// Logs changes in the cellular and cloud connection state
+void ConnectionCheck::updateConnectionState() {
 	// Check cellular status - used for event logging mostly
 	bool temp = Cellular.ready();
 	if (temp != isCellularReady) {
@@ -30,6 +116,14 @@ void ConnectionCheck::loop() {
 		ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_CELLULAR_READY, isCellularReady);
 
 		Log.info("cellular %s", isCellularReady ? "up" : "down");
+
+		if (isCellularReady) {
+			cellularReadyStart = millis();
+			if (!bootToCellularRecorded) {
+				bootToCellularRecorded = true;
+				connectionCheckRetainedData.bootToCellular.add(millis());
+			}
+		}
 	}
 
 	// Check cloud connection status
@@ -43,103 +137,494 @@ void ConnectionCheck::loop() {
 		if (isCloudConnected) {
 			// Upon succesful connection, clear the failure count
 			connectionCheckRetainedData.numFailures = 0;
+
+			if (isCellularReady) {
+				connectionCheckRetainedData.cellularToCloud.add(millis() - cellularReadyStart);
+			}
+			if (connectionCheckRetainedData.outageStartSecs != 0 && Time.isValid()) {
+				time_t outageSecs = Time.now() - connectionCheckRetainedData.outageStartSecs;
+				if (outageSecs >= 0) {
+					connectionCheckRetainedData.outage.add((outageSecs < 4000000) ? (uint32_t)outageSecs * 1000 : 0xffffffff);
+				}
+			}
+			connectionCheckRetainedData.outageStartSecs = 0;
 		}
 		else {
 			// Cloud just disconnected, start measuring how long we've been disconnected
 			cloudCheckStart = millis();
+			recoveryWaitMs = getRecoveryWait(connectionCheckRetainedData.numFailures);
+			startOutage();
 		}
 	}
+}
 
-	if (!isCloudConnected) {
-		// Not connected to the cloud - check to see if we've spent long enough in this state to reboot
-		if (cloudWaitForReboot != 0 && millis() - cloudCheckStart >= cloudWaitForReboot) {
-			// The time to wait to connect to the cloud has expired, reboot
+unsigned long ConnectionCheck::getMillisUntilNextLoop() {
+	if (modemResetInProgress || recoveryReconnecting) {
+		unsigned long remaining = millisUntil(stateTime, stateWaitMs);
+		return (remaining < MODEM_RESET_POLL_MS) ? remaining : MODEM_RESET_POLL_MS;
+	}
+	if (arePingsInProgress()) {
+		return (pollPeriodMs < PING_POLL_MS) ? pollPeriodMs : PING_POLL_MS;
+	}
 
-			if (isCellularReady) {
-				// Generate events about the state of the connection before rebooting.
-				cloudConnectDebug();
-			}
+	// Connection state changes are polled, but the reboot timers are run on time even if the poll
+	// period is long
+	unsigned long result = pollPeriodMs;
+	if (!isCloudConnected && cloudWaitForReboot != 0) {
+		unsigned long remaining = millisUntil(cloudCheckStart, recoveryWaitMs);
+		if (remaining < result) {
+			result = remaining;
+		}
+	}
+	if (listeningStart != 0 && listenWaitForReboot != 0) {
+		unsigned long remaining = millisUntil(listeningStart, listenWaitForReboot);
+		if (remaining < result) {
+			result = remaining;
+		}
+	}
+	if (publishingHistograms) {
+		// The rest of the histograms go out as soon as the rate limit allows
+		unsigned long remaining = PublishScheduler::millisUntilCanPublish(lastSummaryPublish);
+		if (remaining < result) {
+			result = remaining;
+		}
+	}
+	return result;
+}
+
+// Waits for the pings started by cloudConnectDebug() to finish, then resets the modem
+void ConnectionCheck::pingState() {
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_PING);
+	updateConnectionState();
+
+	if (arePingsInProgress()) {
+		// Read any results the modem has sent
+		Cellular.command(pingCallback, this, 1000, "AT\r\n");
+
+		const PingProbe &probe = probes[currentProbe];
+		bool done = probe.ended || probe.replies >= pingCount ||
+			millis() - probeStart >= (unsigned long)pingCount * pingTimeout + PING_EXTRA_TIME_MS;
+		if (!done) {
+			return;
+		}
+		finishProbe();
+		currentProbe++;
+		if (startNextProbe()) {
+			return;
+		}
+	}
+
+	stateHandler = &ConnectionCheck::monitorState;
+	if (isCloudConnected) {
+		// Connected while pinging
+		return;
+	}
+	takeRecoveryStep();
+}
 
-			// Keep the number of failures in a retained variable
-			connectionCheckRetainedData.numFailures++;
-
-			if (failureSleepSec > 0 && connectionCheckRetainedData.numFailures > 1) {
-				// failureSleepSec has been set to a non-zero value, so sleep for that
-				// many seconds after the first fullModemReset.
-				// This is useful when battery powered if the SIM has been paused or something
-				// is wrong with the SIM data or cloud such that a connection can be made.
-				// It sleeps for some period (maybe 10 - 15 minutes?) before trying again to
-				// avoid draining the battery continuously trying and failing to connect.
-				ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_FAILURE_SLEEP);
-				System.sleep(SLEEP_MODE_DEEP, failureSleepSec);
+// Called when the cloud could not be connected to in time. Takes the next step of the recovery
+// ladder and sets the time to wait before the one after it.
+void ConnectionCheck::takeRecoveryStep() {
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_RECOVERY_STEP);
+
+	// Keep the number of failures in a retained variable
+	uint32_t step = connectionCheckRetainedData.numFailures++;
+	RecoveryAction action = getRecoveryAction(step);
+
+	// When saving power, sleep and try again later instead of resetting the modem, which takes a
+	// lot of power to register again and is likely to fail the same way
+	const PowerTierPolicy &power = PowerState::getPolicy();
+	unsigned long sleepBaseSec = failureSleepSec;
+	if (power.recoverySleepSec != 0 && (action == RECOVERY_MODEM_RESET || action == RECOVERY_SLEEP)) {
+		action = RECOVERY_SLEEP;
+		if (sleepBaseSec < power.recoverySleepSec) {
+			sleepBaseSec = power.recoverySleepSec;
+		}
+	}
+
+	Log.info("recovery step %lu action %d", (unsigned long)step, (int)action);
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_RECOVERY_STEP, (int)((step << 8) | action));
+
+	cloudCheckStart = millis();
+	recoveryWaitMs = getRecoveryWait(connectionCheckRetainedData.numFailures);
+
+	switch(action) {
+	case RECOVERY_SESSION_RESTART:
+		// Start over with a new cloud session
+		Particle.disconnect();
+		recoveryCellularOff = false;
+		recoveryReconnecting = true;
+		setState(&ConnectionCheck::recoveryReconnectState, RECOVERY_RECONNECT_WAIT_MS);
+		break;
+
+	case RECOVERY_CELLULAR_CYCLE:
+		Particle.disconnect();
+		Cellular.off();
+		recoveryCellularOff = true;
+		recoveryReconnecting = true;
+		setState(&ConnectionCheck::recoveryReconnectState, RECOVERY_CELLULAR_OFF_MS);
+		break;
+
+	case RECOVERY_SLEEP:
+		if (sleepBaseSec > 0) {
+			// failureSleepSec has been set to a non-zero value, so sleep for that many seconds
+			// (doubling each time, up to 8 times) once the other steps haven't worked.
+			// This is useful when battery powered if the SIM has been paused or something
+			// is wrong with the SIM data or cloud such that a connection can be made.
+			// It sleeps for some period (maybe 10 - 15 minutes?) before trying again to
+			// avoid draining the battery continuously trying and failing to connect.
+			uint32_t sleeps = 0;
+			for(uint32_t ii = 0; ii < step; ii++) {
+				RecoveryAction previous = getRecoveryAction(ii);
+				if (previous == RECOVERY_SLEEP || (power.recoverySleepSec != 0 && previous == RECOVERY_MODEM_RESET)) {
+					sleeps++;
+				}
 			}
+			unsigned long sleepSec = sleepBaseSec << ((sleeps < 3) ? sleeps : 3);
+			sleepSec += (unsigned long)(((uint64_t)sleepSec * recoveryJitterPercent / 100 * nextJitter()) >> 32);
 
-			// Reboot
-			ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_REBOOT_NO_CLOUD);
-			fullModemReset();
+			ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_FAILURE_SLEEP);
+			System.sleep(SLEEP_MODE_DEEP, sleepSec);
+			break;
 		}
+		// Otherwise, reset the modem (fall through)
+
+	case RECOVERY_MODEM_RESET:
+	default:
+		// Reboot
+		ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_REBOOT_NO_CLOUD);
+		fullModemReset();
+		break;
 	}
+}
 
+// After a session restart or cellular off, connects again
+void ConnectionCheck::recoveryReconnectState() {
+	if (millis() - stateTime < stateWaitMs) {
+		return;
+	}
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_RECONNECT);
 
-	if (Cellular.listening()) {
-		// Entered listening mode (blinking blue). Could be from holding down the MODE button, or
-		// by repeated connection failures, see: https://github.com/spark/firmware/issues/687
-		if (listeningStart == 0) {
-			listeningStart = millis();
-			ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_LISTENING_ENTERED);
+	if (recoveryCellularOff) {
+		Cellular.on();
+		recoveryCellularOff = false;
+	}
+	Particle.connect();
 
-			Log.info("entered listening mode");
+	recoveryReconnecting = false;
+	stateHandler = &ConnectionCheck::monitorState;
+}
+
+ConnectionCheck::RecoveryAction ConnectionCheck::getRecoveryAction(uint32_t step) const {
+	return recoverySteps[(step < numRecoverySteps) ? step : (numRecoverySteps - 1)];
+}
+
+// How long to wait before taking recovery step, in milliseconds
+unsigned long ConnectionCheck::getRecoveryWait(uint32_t step) {
+	unsigned long wait = cloudWaitForReboot;
+	if (step > 0) {
+		wait = recoveryBackoffMs;
+		for(uint32_t ii = 1; ii < step && wait < recoveryBackoffMaxMs; ii++) {
+			wait *= 2;
 		}
-		else {
-			if (listenWaitForReboot != 0 && millis() - listeningStart >= listenWaitForReboot) {
-				// Reboot
-				ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_REBOOT_LISTENING);
-				fullModemReset();
-			}
+		if (wait > recoveryBackoffMaxMs) {
+			wait = recoveryBackoffMaxMs;
 		}
 	}
+
+	// Add up to recoveryJitterPercent at random
+	return wait + (unsigned long)(((uint64_t)wait * recoveryJitterPercent / 100 * nextJitter()) >> 32);
 }
 
+// xorshift32, so the sequence carries on across resets
+uint32_t ConnectionCheck::nextJitter() {
+	uint32_t x = connectionCheckRetainedData.jitterState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	connectionCheckRetainedData.jitterState = x;
+	return x;
+}
 
-// This is called when timing out connecting to the cloud. It adds some debugging events to
-// help log the current state for debugging purposes.
-// It returns true to force a modem reset immediately, false to use the normal logic for whether to reset the modem.
+// This is called when timing out connecting to the cloud. It starts pinging to generate some
+// debugging events to help log the current state for debugging purposes. The hosts are pinged one
+// at a time as the modem only does one AT+UPING at a time.
 bool ConnectionCheck::cloudConnectDebug() {
-	int res = Cellular.command(pingTimeout, "AT+UPING=\"8.8.8.8\"\r\n");
-	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_PING_DNS, res);
+	if (arePingsInProgress()) {
+		return true;
+	}
+
+	const char *hosts[NUM_PROBES] = { "8.8.8.8", "api.particle.io" };
+	for(size_t ii = 0; ii < NUM_PROBES; ii++) {
+		PingProbe &probe = probes[ii];
+		probe.host = hosts[ii];
+		probe.eventCode = (ii == 0) ? ConnectionEvents::CONNECTION_EVENT_PING_DNS : ConnectionEvents::CONNECTION_EVENT_PING_API;
+		probe.rttEventCode = (ii == 0) ? ConnectionEvents::CONNECTION_EVENT_PING_DNS_RTT : ConnectionEvents::CONNECTION_EVENT_PING_API_RTT;
+		probe.replies = probe.received = probe.ttl = 0;
+		probe.rttSum = 0;
+		probe.ended = false;
+	}
+
+	currentProbe = 0;
+	return startNextProbe();
+}
+
+// Starts pinging probes[currentProbe], or the one after it if that fails. Returns false if there
+// are no more hosts to ping.
+bool ConnectionCheck::startNextProbe() {
+	while(currentProbe < NUM_PROBES) {
+		// AT+UPING=<host>,<count>,<size>,<timeout>,<ttl> returns OK right away. The results come
+		// later as +UUPING (or +UUPINGER on error) lines.
+		int res = Cellular.command(pingCallback, this, 10000, "AT+UPING=\"%s\",%d,32,%lu,255\r\n",
+			probes[currentProbe].host, pingCount, pingTimeout);
+		if (res == RESP_OK) {
+			probeStart = millis();
+			wake();
+			return true;
+		}
+
+		// Could not start pinging, log it as no replies
+		Log.info("AT+UPING %s failed %d", probes[currentProbe].host, res);
+		finishProbe();
+		currentProbe++;
+	}
+	return false;
+}
+
+void ConnectionCheck::finishProbe() {
+	const PingProbe &probe = probes[currentProbe];
+
+	Log.info("ping %s sent=%d received=%d rttSum=%lu", probe.host, pingCount, probe.received, (unsigned long)probe.rttSum);
+
+	ConnectionEvents::addEvent(probe.eventCode, probe.received);
+	if (probe.received > 0) {
+		ConnectionEvents::addEvent(probe.rttEventCode, packPingResult(probe.rttSum / probe.received, probe.ttl, probe.received, pingCount));
+	}
+}
+
+// +UUPING: <retry_num>,<p_size>,<remote_hostname>,<remote_ip_addr>,<ttl>,<rtt>
+// +UUPINGER: <error_code>
+void ConnectionCheck::handlePingResponse(const char *line) {
+	if (!arePingsInProgress()) {
+		return;
+	}
+	PingProbe &probe = probes[currentProbe];
+
+	const char *cp = strstr(line, "+UUPING");
+	if (cp == NULL) {
+		return;
+	}
+	if (strncmp(cp, "+UUPINGER:", 10) == 0) {
+		probe.ended = true;
+		return;
+	}
+
+	int retryNum, size, ttl, rtt;
+	char host[64];
+	if (sscanf(cp, "+UUPING: %d,%d,\"%63[^\"]\",\"%*[^\"]\",%d,%d", &retryNum, &size, host, &ttl, &rtt) != 5 ||
+		strcmp(host, probe.host) != 0) {
+		return;
+	}
+
+	probe.replies++;
+	if (rtt >= 0) {
+		probe.received++;
+		probe.rttSum += rtt;
+		probe.ttl = ttl;
+	}
+}
+
+// static
+int ConnectionCheck::pingCallback(int type, const char *buf, int len, ConnectionCheck *connectionCheck) {
+	if (type == TYPE_PLUS || type == TYPE_UNKNOWN) {
+		// buf is not necessarily null-terminated
+		char line[128];
+		if (len >= (int)sizeof(line)) {
+			len = sizeof(line) - 1;
+		}
+		memcpy(line, buf, len);
+		line[len] = 0;
+
+		connectionCheck->handlePingResponse(line);
+	}
+	return WAIT;
+}
+
+// static
+int ConnectionCheck::packPingResult(unsigned avgRttMs, unsigned ttl, unsigned received, unsigned sent) {
+	if (avgRttMs > 0xffff) {
+		avgRttMs = 0xffff;
+	}
+	return (int)((avgRttMs & 0xffff) | ((ttl & 0xff) << 16) | ((received & 0xf) << 24) | ((sent & 0xf) << 28));
+}
 
-	res = Cellular.command(pingTimeout, "AT+UPING=\"api.particle.io\"\r\n");
-	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_PING_API, res);
 
-	// If pinging api.particle.io does not succeed, then reboot the modem right away
-	return (res != RESP_OK);
+// Remembers when the cloud connection was lost, in retained memory, if it's not already set
+void ConnectionCheck::startOutage() {
+	if (connectionCheckRetainedData.outageStartSecs == 0 && Time.isValid()) {
+		connectionCheckRetainedData.outageStartSecs = Time.now();
+	}
 }
 
+// Publishes the histograms every histogramPeriodSecs, one publish at a time at low priority
+void ConnectionCheck::publishHistograms() {
+	if (histogramPeriodSecs == 0 || !isCloudConnected || !Time.isValid()) {
+		return;
+	}
+
+	if (!publishingHistograms) {
+		time_t now = Time.now();
+		if (connectionCheckRetainedData.lastSummarySecs == 0) {
+			// Start the first period
+			connectionCheckRetainedData.lastSummarySecs = now;
+			return;
+		}
+		if (now - connectionCheckRetainedData.lastSummarySecs < histogramPeriodSecs) {
+			return;
+		}
+		publishingHistograms = true;
+		summaryHistogram = summaryBucket = 0;
+	}
+
+	char buf[ConnectionEvents::PUBLISH_MAX_DATA + 1];
+	size_t histogram = summaryHistogram, bucket = summaryBucket;
+	if (formatHistogram(histogram, bucket, buf, sizeof(buf))) {
+		if (!PublishScheduler::tryPublish(PublishScheduler::PRIORITY_LOW, histogramEventName, buf, lastSummaryPublish)) {
+			// Not time yet, or it failed. Try the same data again later.
+			return;
+		}
+		summaryHistogram = histogram;
+		summaryBucket = bucket;
+		if (summaryHistogram < 3) {
+			return;
+		}
+	}
+
+	// All sent, start the next period
+	connectionCheckRetainedData.bootToCellular.clear();
+	connectionCheckRetainedData.cellularToCloud.clear();
+	connectionCheckRetainedData.outage.clear();
+	connectionCheckRetainedData.lastSummarySecs = Time.now();
+	publishingHistograms = false;
+}
+
+// Formats the next publish of histogram data, starting at histogram and bucket, and updates them
+// to where the next publish should start. Returns false if there is nothing left to publish.
+bool ConnectionCheck::formatHistogram(size_t &histogram, size_t &bucket, char *buf, size_t bufSize) const {
+	const LogHistogram *histograms[3] = {
+		&connectionCheckRetainedData.bootToCellular,
+		&connectionCheckRetainedData.cellularToCloud,
+		&connectionCheckRetainedData.outage
+	};
+	const char *names[3] = { "cellular", "cloud", "outage" };
+
+	// Skip empty histograms
+	while(histogram < 3 && histograms[histogram]->count == 0) {
+		histogram++;
+		bucket = 0;
+	}
+	if (histogram >= 3) {
+		return false;
+	}
+
+	const LogHistogram &hist = *histograms[histogram];
+	size_t len = snprintf(buf, bufSize, "%s,%lu,%lu", names[histogram], (unsigned long)hist.count, (unsigned long)hist.maxValue);
+
+	for(; bucket < LogHistogram::NUM_BUCKETS; bucket++) {
+		if (hist.buckets[bucket] == 0) {
+			continue;
+		}
+		char entry[16];
+		size_t entryLen = snprintf(entry, sizeof(entry), ",%u:%u", (unsigned)bucket, (unsigned)hist.buckets[bucket]);
+		if (len + entryLen >= bufSize) {
+			// Continue in the next publish
+			return true;
+		}
+		strcpy(&buf[len], entry);
+		len += entryLen;
+	}
+
+	histogram++;
+	bucket = 0;
+	return true;
+}
 
-// reason is the reason code, one of the ConnectionEvents::CONNECTION_EVENT_* constants
-// forceResetMode will reset the modem even immediately instead of waiting for multiple failures
+// Starts the modem reset. The add() calls that happen before this are published first, if possible.
 void ConnectionCheck::fullModemReset() {
+	if (modemResetInProgress) {
+		return;
+	}
+	modemResetInProgress = true;
 
 	Log.info("resetting modem");
 
+	// The outage lasts until the cloud is connected again after the reset
+	startOutage();
+
 	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_MODEM_RESET);
 
+	if (ConnectionEvents::getInstance()) {
+		// Send the events now, even when batching
+		ConnectionEvents::getInstance()->flush();
+	}
+	setState(&ConnectionCheck::modemResetFlushState, modemResetFlushTimeout);
+}
+
+void ConnectionCheck::modemResetFlushState() {
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_MODEM_RESET_FLUSH);
+
+	bool done = !Particle.connected();
+	if (!done) {
+		done = (ConnectionEvents::getInstance() == NULL || ConnectionEvents::getInstance()->getEventCount() == 0) &&
+			(PublishScheduler::getInstance() == NULL || PublishScheduler::getInstance()->getQueuedCount() == 0);
+	}
+	if (!done && millis() - stateTime < stateWaitMs) {
+		// Still publishing
+		return;
+	}
+
 	// Disconnect from the cloud
 	Particle.disconnect();
+	setState(&ConnectionCheck::modemResetDisconnectState, modemResetDisconnectTimeout);
+}
+
+void ConnectionCheck::modemResetDisconnectState() {
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_MODEM_RESET_DISCONNECT);
 
-	// Wait up to 15 seconds to disconnect
-	unsigned long startTime = millis();
-	while(Particle.connected() && millis() - startTime < 15000) {
-		delay(100);
+	if (Particle.connected() && millis() - stateTime < stateWaitMs) {
+		// Still disconnecting
+		return;
 	}
+	setState(&ConnectionCheck::modemResetCommandState, 0);
+}
 
+void ConnectionCheck::modemResetCommandState() {
 	// Reset the modem and SIM card
 	// 16:MT silent reset (with detach from network and saving of NVM parameters), with reset of the SIM card
-	Cellular.command(30000, "AT+CFUN=16\r\n");
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_MODEM_RESET_COMMAND);
+	modemResetResult = Cellular.command(modemResetCommandTimeout, "AT+CFUN=16\r\n");
+	Breadcrumbs::mark(BREADCRUMB_CONNECTION_MODEM_RESET_SETTLE);
+
+	setState(&ConnectionCheck::modemResetSettleState, modemResetSettleTime);
+}
 
-	delay(1000);
+void ConnectionCheck::modemResetSettleState() {
+	if (millis() - stateTime < stateWaitMs) {
+		return;
+	}
+
+	if (modemResetCallback) {
+		modemResetCallback(modemResetResult);
+	}
 
 	// Go into deep sleep for 10 seconds to try to reset everything. This turns off the modem as well.
 	System.sleep(SLEEP_MODE_DEEP, 10);
 }
 
+void ConnectionCheck::setState(std::function<void(ConnectionCheck&)> handler, unsigned long waitMs) {
+	stateHandler = handler;
+	stateTime = millis();
+	stateWaitMs = waitMs;
+	wake();
+}
+
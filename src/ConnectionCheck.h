@@ -2,42 +2,222 @@
 #define __CONNECTIONCHECK_H
 
 #include "ConnectionEvents.h"
+#include "LogHistogram.h"
+#include "ModuleScheduler.h"
 
-// This structure is what's stored in retained memory
+// This structure is what's stored in retained memory (356 bytes)
 typedef struct {
 	uint32_t magic;
-	uint32_t numFailures;
+	uint32_t numFailures; // Recovery steps taken since the cloud was last connected
+	uint32_t jitterState; // Random number state for the recovery step jitter, different on each device
+	time_t outageStartSecs; // Time.now() when the cloud connection was lost, 0 = not lost
+	time_t lastSummarySecs; // Time.now() when the histograms were last published
+	LogHistogram bootToCellular; // milliseconds from boot until cellular is ready, once per boot
+	LogHistogram cellularToCloud; // milliseconds from cellular ready until the cloud is connected
+	LogHistogram outage; // milliseconds from losing the cloud connection until it's back, across resets
 } ConnectionCheckRetainedData;
 
-class ConnectionCheck {
+/**
+ * @brief Monitors the cellular and cloud connection and resets the modem when it can't connect
+ *
+ * The modem reset done by fullModemReset() runs from loop() as a series of states, so the rest of
+ * the application keeps running while it's in progress:
+ *
+ * - Flush: if cloud connected, wait up to the flush timeout for the connection events and any queued
+ * publishes to go out
+ * - Disconnect: disconnect from the cloud and wait up to the disconnect timeout for it to finish
+ * - Command: AT+CFUN=16 (silent reset of the modem and the SIM card). Cellular.command() is
+ * synchronous, so this one step blocks, but only for up to the command timeout.
+ * - Settle: wait for the modem to start resetting
+ *
+ * Then the completion callback is called and the device goes into deep sleep for 10 seconds, which
+ * also turns off the modem.
+ *
+ * When the cloud can't be reached, the modem reset isn't the first thing that's tried. There is a
+ * ladder of recovery steps, cheapest first (see withRecoverySteps()). The first step is taken after
+ * cloudWaitForReboot. If the cloud is still not connected, each following step is taken after a
+ * backoff that doubles each time, starting at 1 minute (withRecoveryBackoff()). The last step is
+ * repeated. Each wait has a random amount added, up to 50% (withRecoveryJitter()), different on each
+ * device, so a fleet that lost the cloud at the same time doesn't recover in lockstep. The step number
+ * is kept in retained memory, so the ladder continues after a reset or sleep. When the PowerState
+ * policy has a recoverySleepSec, modem reset steps become sleeps of at least that long.
+ *
+ * Before resetting because the cloud could not be reached, if cellular is up, it pings Google DNS
+ * (8.8.8.8) and then the Particle API server (api.particle.io) using AT+UPING. The pings also run
+ * from loop(): the command returns right away, and the +UUPING results that the modem sends for each
+ * echo reply are read from the responses to short AT commands. For each host a PING_DNS or PING_API
+ * event is added with the number of replies, and if there were any, a PING_DNS_RTT or PING_API_RTT
+ * event with the average round trip time, TTL and counts (see packPingResult()).
+ *
+ * It also keeps histograms of how long it takes to get cellular and cloud connectivity, and of how long
+ * outages last, in retained memory. Every 6 hours (withHistogramPeriod()) they're published as
+ * connHistograms events and cleared. Each publish has the histogram name, the number of values, the
+ * largest value in milliseconds, and bucket:count pairs for the non-empty buckets (see LogHistogram),
+ * for example:
+ *
+ * cloud,3,9120,25:1,26:2
+ *
+ * If the buckets for a histogram don't fit in one publish they're continued in another publish with
+ * the same name, count and largest value.
+ */
+class ConnectionCheck : public ScheduledModule {
 public:
+	// Called with the result of AT+CFUN=16 (RESP_OK, etc.) right before going into deep sleep
+	typedef std::function<void(int commandResult)> ModemResetCallback;
+
+	// The steps that can be taken to get the cloud connection back
+	enum RecoveryAction {
+		RECOVERY_SESSION_RESTART = 0,	// Disconnect from the cloud and connect again, starting a new session
+		RECOVERY_CELLULAR_CYCLE,		// Turn cellular off and on again and reconnect
+		RECOVERY_MODEM_RESET,			// fullModemReset()
+		RECOVERY_SLEEP					// Deep sleep for failureSleepSec, doubling up to 8 times that. A modem reset if failureSleepSec is 0.
+	};
+
 	ConnectionCheck();
 	virtual ~ConnectionCheck();
 
 	void setup();
 	void loop();
+	unsigned long getMillisUntilNextLoop();
+
+	// Starts a modem reset. Returns right away; the reset is done from loop(). Does nothing if a
+	// reset is already in progress.
 	void fullModemReset();
+	inline bool isModemResetInProgress() const { return modemResetInProgress; };
+
+	// Starts pinging to log the state of the connection. Returns false if the pings could not be
+	// started. The results are added as events when they're done.
 	bool cloudConnectDebug();
+	inline bool arePingsInProgress() const { return currentProbe < NUM_PROBES; };
+
+	// Packs the ping results for a host into the data of a PING_DNS_RTT or PING_API_RTT event:
+	// bits 0 - 15 average round trip time in milliseconds, 16 - 23 TTL of the last reply,
+	// 24 - 27 replies received, 28 - 31 echo requests sent
+	static int packPingResult(unsigned avgRttMs, unsigned ttl, unsigned received, unsigned sent);
 
 	inline ConnectionCheck &withListenWaitForReboot(unsigned long value) { listenWaitForReboot = value; return *this; };
 	inline ConnectionCheck &withCloudWaitForReboot(unsigned long value) { cloudWaitForReboot = value; return *this; };
 	inline ConnectionCheck &withPingTimeout(unsigned long value) { pingTimeout = value; return *this; };
+	inline ConnectionCheck &withPingCount(int value) { pingCount = (value < 1) ? 1 : ((value > 15) ? 15 : value); return *this; };
 	inline ConnectionCheck &withFailureSleepSec(unsigned long value) { failureSleepSec = value; return *this; };
 
+	// Sets the recovery steps. Up to MAX_RECOVERY_STEPS; the last one is repeated.
+	// The default is session restart, cellular off and on, modem reset, then sleep.
+	ConnectionCheck &withRecoverySteps(const RecoveryAction *steps, size_t numSteps);
+
+	// Wait before the second recovery step, doubled for each step after that up to maxMs
+	inline ConnectionCheck &withRecoveryBackoff(unsigned long initialMs, unsigned long maxMs) { recoveryBackoffMs = initialMs; recoveryBackoffMaxMs = maxMs; return *this; };
+
+	// Up to this percentage is added to each recovery wait at random
+	inline ConnectionCheck &withRecoveryJitter(unsigned percent) { recoveryJitterPercent = percent; return *this; };
+
+	// How often to check the cellular and cloud connection state when run from ModuleScheduler
+	inline ConnectionCheck &withPollPeriod(unsigned long value) { pollPeriodMs = value; return *this; };
+
+	// Timeouts for each of the steps of the modem reset, in milliseconds
+	inline ConnectionCheck &withModemResetFlushTimeout(unsigned long value) { modemResetFlushTimeout = value; return *this; };
+	inline ConnectionCheck &withModemResetDisconnectTimeout(unsigned long value) { modemResetDisconnectTimeout = value; return *this; };
+	inline ConnectionCheck &withModemResetCommandTimeout(unsigned long value) { modemResetCommandTimeout = value; return *this; };
+	inline ConnectionCheck &withModemResetSettleTime(unsigned long value) { modemResetSettleTime = value; return *this; };
+
+	inline ConnectionCheck &withModemResetCallback(ModemResetCallback value) { modemResetCallback = value; return *this; };
+
+	// How often to publish the connection time histograms, in seconds. 0 = never.
+	inline ConnectionCheck &withHistogramPeriod(time_t value) { histogramPeriodSecs = value; return *this; };
+	inline ConnectionCheck &withHistogramEventName(const char *value) { histogramEventName = value; return *this; };
+
+	static inline const ConnectionCheckRetainedData &getRetainedData() { return connectionCheckRetainedData; };
+
 	static inline ConnectionCheck *getInstance() { return instance; };
 
-	static const uint32_t CONNECTION_CHECK_MAGIC = 0x2e4ec594;
+	static const uint32_t CONNECTION_CHECK_MAGIC = 0x2e4ec596;
+	static const unsigned long MODEM_RESET_POLL_MS = 100; // How often to check while waiting during a modem reset
+	static const unsigned long PING_POLL_MS = 250; // How often to read ping results from the modem
+	static const unsigned long PING_EXTRA_TIME_MS = 5000; // Added to pingCount * pingTimeout for each host
+	static const size_t NUM_PROBES = 2;
+	static const size_t MAX_RECOVERY_STEPS = 8;
+	static const unsigned long RECOVERY_RECONNECT_WAIT_MS = 1000; // After disconnecting for a session restart
+	static const unsigned long RECOVERY_CELLULAR_OFF_MS = 5000; // Time to leave cellular off
 
 private:
+	// Results of pinging one host
+	typedef struct {
+		const char *host;
+		int eventCode; // CONNECTION_EVENT_PING_DNS or CONNECTION_EVENT_PING_API
+		int rttEventCode; // CONNECTION_EVENT_PING_DNS_RTT or CONNECTION_EVENT_PING_API_RTT
+		int replies; // +UUPING lines, including lost echos
+		int received;
+		int ttl;
+		uint32_t rttSum; // milliseconds
+		bool ended; // +UUPINGER received
+	} PingProbe;
+
+	void monitorState();
+	void updateConnectionState();
+	void pingState();
+	void takeRecoveryStep();
+	void recoveryReconnectState();
+	RecoveryAction getRecoveryAction(uint32_t step) const;
+	unsigned long getRecoveryWait(uint32_t step);
+	uint32_t nextJitter();
+	void publishHistograms();
+	bool formatHistogram(size_t &histogram, size_t &bucket, char *buf, size_t bufSize) const;
+	void startOutage();
+	bool startNextProbe();
+	void finishProbe();
+	void handlePingResponse(const char *line);
+	static int pingCallback(int type, const char *buf, int len, ConnectionCheck *connectionCheck);
+
+	void modemResetFlushState();
+	void modemResetDisconnectState();
+	void modemResetCommandState();
+	void modemResetSettleState();
+	void setState(std::function<void(ConnectionCheck&)> handler, unsigned long waitMs);
+
 	unsigned long listenWaitForReboot = 30000; // milliseconds
 	unsigned long cloudWaitForReboot = 180000; // milliseconds
-	unsigned long pingTimeout = 10000; // milliseconds
+	unsigned long pingTimeout = 5000; // milliseconds, for each echo request
+	int pingCount = 4; // echo requests for each host, up to 15
 	unsigned long failureSleepSec = 0; // seconds, 0 = none
 
+	RecoveryAction recoverySteps[MAX_RECOVERY_STEPS] = { RECOVERY_SESSION_RESTART, RECOVERY_CELLULAR_CYCLE, RECOVERY_MODEM_RESET, RECOVERY_SLEEP };
+	size_t numRecoverySteps = 4;
+	unsigned long recoveryBackoffMs = 60000; // milliseconds
+	unsigned long recoveryBackoffMaxMs = 30 * 60000; // milliseconds
+	unsigned recoveryJitterPercent = 50;
+	unsigned long recoveryWaitMs = 0; // How long after cloudCheckStart to take the next step
+	bool recoveryReconnecting = false; // In recoveryReconnectState()
+	bool recoveryCellularOff = false; // Cellular was turned off by the recovery step
+	unsigned long pollPeriodMs = 250; // milliseconds
+	unsigned long modemResetFlushTimeout = 5000; // milliseconds
+	unsigned long modemResetDisconnectTimeout = 15000; // milliseconds
+	unsigned long modemResetCommandTimeout = 10000; // milliseconds
+	unsigned long modemResetSettleTime = 1000; // milliseconds
+	ModemResetCallback modemResetCallback = NULL;
+
 	bool isCellularReady = false;
 	bool isCloudConnected = false;
 	unsigned long listeningStart = 0;
 	unsigned long cloudCheckStart = 0;
+	unsigned long cellularReadyStart = 0; // millis() value
+	bool bootToCellularRecorded = false;
+
+	time_t histogramPeriodSecs = 6 * 3600;
+	const char *histogramEventName = "connHistograms";
+	bool publishingHistograms = false;
+	size_t summaryHistogram = 0; // Next histogram to publish
+	size_t summaryBucket = 0; // Next bucket to publish
+	unsigned long lastSummaryPublish = 0; // millis() value
+
+	PingProbe probes[NUM_PROBES];
+	size_t currentProbe = NUM_PROBES; // NUM_PROBES = not pinging
+	unsigned long probeStart = 0; // millis() value
+
+	bool modemResetInProgress = false;
+	int modemResetResult = 0; // Result of AT+CFUN=16
+	unsigned long stateTime = 0; // millis() value
+	unsigned long stateWaitMs = 0; // Timeout for the current modem reset state
+	std::function<void(ConnectionCheck&)> stateHandler = &ConnectionCheck::monitorState;
 
 	static ConnectionCheck *instance;
 	static ConnectionCheckRetainedData connectionCheckRetainedData;
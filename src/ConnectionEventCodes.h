@@ -0,0 +1,69 @@
+#ifndef __CONNECTIONEVENTCODES_H
+#define __CONNECTIONEVENTCODES_H
+
+// The connection event codes, as an X-macro list of (name, value). This is the one place they're
+// defined: ConnectionEvents::ConnectionEventCode is generated from it as CONNECTION_EVENT_<name>, and
+// so is the name table in the native decoder (host/eventdecoder.cpp). The node.js decoder in
+// event-decoder has its own switch, so update that when adding a code here.
+//
+// The values are sent in the published data, so never renumber existing codes; add new ones at the end.
+#define CONNECTION_EVENT_CODES(X) \
+	X(SETUP_STARTED, 0) \
+	X(CELLULAR_READY, 1) \
+	X(CLOUD_CONNECTED, 2) \
+	X(LISTENING_ENTERED, 3) \
+	X(MODEM_RESET, 4) \
+	X(REBOOT_LISTENING, 5) \
+	X(REBOOT_NO_CLOUD, 6) \
+	X(PING_DNS, 7) \
+	X(PING_API, 8) \
+	X(APP_WATCHDOG, 9) \
+	X(TESTER_RESET, 10) \
+	X(TESTER_APP_WATCHDOG, 11) \
+	X(TESTER_SLEEP, 12) \
+	X(LOW_BATTERY_SLEEP, 13) \
+	X(SESSION_EVENT_LOST, 14) \
+	X(SESSION_RESET, 15) \
+	X(TESTER_RESET_SESSION, 16) \
+	X(TESTER_RESET_MODEM, 17) \
+	X(RESET_REASON, 18) \
+	X(TESTER_SAFE_MODE, 19) \
+	X(TESTER_PING, 20) \
+	X(STOP_SLEEP_WAKE, 21) \
+	X(FAILURE_SLEEP, 22) \
+	X(PING_DNS_RTT, 23) \
+	X(PING_API_RTT, 24) \
+	X(RECOVERY_STEP, 25) \
+	X(SESSION_DEGRADED, 26) \
+	X(REPEAT, 27) \
+	X(TESTER_LOAD, 28) \
+	X(TESTER_LOAD_ENQUEUED, 29) \
+	X(TESTER_LOAD_DROPPED, 30) \
+	X(TESTER_LOAD_PUBLISHED, 31) \
+	X(TESTER_LOAD_BYTES, 32) \
+	X(TESTER_QUEUE, 33) \
+	X(BATTERY_SLEEP, 34) \
+	X(POWER_TIER, 35) \
+	X(SLOW_LOOP, 36) \
+	X(HEARTBEAT_STALL, 37)
+
+// Device OS reset reasons, as logged in CONNECTION_EVENT_RESET_REASON. ConnectionEvents.cpp checks
+// these against the RESET_REASON_<name> constants at compile time.
+#define CONNECTION_EVENT_RESET_REASONS(X) \
+	X(NONE, 0) \
+	X(UNKNOWN, 10) \
+	X(PIN_RESET, 20) \
+	X(POWER_MANAGEMENT, 30) \
+	X(POWER_DOWN, 40) \
+	X(POWER_BROWNOUT, 50) \
+	X(WATCHDOG, 60) \
+	X(UPDATE, 70) \
+	X(UPDATE_ERROR, 80) \
+	X(UPDATE_TIMEOUT, 90) \
+	X(FACTORY_RESET, 100) \
+	X(SAFE_MODE, 110) \
+	X(DFU_MODE, 120) \
+	X(PANIC, 130) \
+	X(USER, 140)
+
+#endif /* __CONNECTIONEVENTCODES_H */
@@ -0,0 +1,155 @@
+#include "ConnectionEventSpool.h"
+
+retained ConnectionEventSpoolRetainedData ConnectionEventSpool::spoolRetainedData;
+
+
+ConnectionEventSpool::ConnectionEventSpool(size_t offset, size_t length) : offset(offset), length(length) {
+}
+
+ConnectionEventSpool::~ConnectionEventSpool() {
+}
+
+void ConnectionEventSpool::setup() {
+	if (length == 0 || offset + length > EEPROM.length()) {
+		length = EEPROM.length() - offset;
+	}
+	numSlots = (length > sizeof(ConnectionEventSpoolHeader)) ? (length - sizeof(ConnectionEventSpoolHeader)) / sizeof(ConnectionEventSpoolRecord) : 0;
+
+	if (spoolRetainedData.magic != RETAINED_MAGIC) {
+		spoolRetainedData.magic = RETAINED_MAGIC;
+		spoolRetainedData.tokens = writeBudget * 1000;
+		spoolRetainedData.lastRefillSecs = 0;
+	}
+
+	ConnectionEventSpoolHeader header;
+	EEPROM.get(offset, header);
+	bool validHeader = (header.magic == SPOOL_MAGIC && header.check == checksum(&header, offsetof(ConnectionEventSpoolHeader, check)));
+	readSeq = validHeader ? header.readSeq : 1;
+
+	// The newest valid record determines where the next one goes
+	writeSeq = readSeq;
+	for(size_t ii = 0; ii < numSlots; ii++) {
+		ConnectionEventSpoolRecord rec;
+		EEPROM.get(offset + sizeof(ConnectionEventSpoolHeader) + ii * sizeof(ConnectionEventSpoolRecord), rec);
+
+		if (rec.check == checksum(&rec, offsetof(ConnectionEventSpoolRecord, check)) &&
+			(rec.seq % numSlots) == ii && (int32_t)(rec.seq - writeSeq) >= 0) {
+			writeSeq = rec.seq + 1;
+		}
+	}
+
+	if (!validHeader) {
+		// Erased, or the header was lost. Records left over from before can still have valid
+		// checksums, so start after the newest of them; everything before readSeq is ignored.
+		Log.info("initializing event spool");
+		readSeq = writeSeq;
+		writeHeader();
+		return;
+	}
+
+	if (getCount() > numSlots) {
+		// Can't happen unless the area was resized; keep the newest
+		readSeq = writeSeq - numSlots;
+	}
+	if (getCount() > 0) {
+		Log.info("event spool has %u events", getCount());
+	}
+}
+
+bool ConnectionEventSpool::append(const ConnectionEventInfo &ev) {
+	if (getCount() >= numSlots) {
+		// Full. Keep the oldest events, as they're usually the most useful for figuring out what
+		// happened.
+		return false;
+	}
+	if (!takeWriteToken()) {
+		return false;
+	}
+
+	ConnectionEventSpoolRecord rec;
+	rec.seq = writeSeq;
+	rec.ev = ev;
+	rec.check = checksum(&rec, offsetof(ConnectionEventSpoolRecord, check));
+	EEPROM.put(slotOffset(writeSeq), rec);
+
+	writeSeq++;
+	return true;
+}
+
+size_t ConnectionEventSpool::read(ConnectionEventInfo *events, size_t maxEvents) const {
+	size_t count = 0;
+	for(uint32_t seq = readSeq; seq != writeSeq && count < maxEvents; seq++) {
+		ConnectionEventSpoolRecord rec;
+		if (readRecord(seq, rec)) {
+			events[count++] = rec.ev;
+		}
+	}
+	return count;
+}
+
+void ConnectionEventSpool::consume(size_t count) {
+	// Skip any records that couldn't be read back as well, as read() did
+	while(count > 0 && readSeq != writeSeq) {
+		ConnectionEventSpoolRecord rec;
+		if (readRecord(readSeq, rec)) {
+			count--;
+		}
+		readSeq++;
+	}
+	while(readSeq != writeSeq) {
+		ConnectionEventSpoolRecord rec;
+		if (readRecord(readSeq, rec)) {
+			break;
+		}
+		readSeq++;
+	}
+	writeHeader();
+}
+
+bool ConnectionEventSpool::takeWriteToken() {
+	// Refill using the real-time clock, which keeps running during sleep and across resets
+	uint32_t maxTokens = writeBudget * 1000;
+	if (Time.isValid()) {
+		time_t now = Time.now();
+		if (spoolRetainedData.lastRefillSecs == 0 || now < spoolRetainedData.lastRefillSecs) {
+			spoolRetainedData.lastRefillSecs = now;
+		}
+		else {
+			uint64_t add = (uint64_t)(now - spoolRetainedData.lastRefillSecs) * maxTokens / 3600;
+			if (add > 0) {
+				spoolRetainedData.tokens = (spoolRetainedData.tokens + add < maxTokens) ? (uint32_t)(spoolRetainedData.tokens + add) : maxTokens;
+				spoolRetainedData.lastRefillSecs = now;
+			}
+		}
+	}
+
+	if (spoolRetainedData.tokens < 1000) {
+		return false;
+	}
+	spoolRetainedData.tokens -= 1000;
+	return true;
+}
+
+void ConnectionEventSpool::writeHeader() {
+	ConnectionEventSpoolHeader header;
+	header.magic = SPOOL_MAGIC;
+	header.readSeq = readSeq;
+	header.check = checksum(&header, offsetof(ConnectionEventSpoolHeader, check));
+	EEPROM.put(offset, header);
+}
+
+bool ConnectionEventSpool::readRecord(uint32_t seq, ConnectionEventSpoolRecord &rec) const {
+	EEPROM.get(slotOffset(seq), rec);
+	return rec.seq == seq && rec.check == checksum(&rec, offsetof(ConnectionEventSpoolRecord, check));
+}
+
+// static
+uint32_t ConnectionEventSpool::checksum(const void *data, size_t len) {
+	// FNV-1a, seeded with the magic number so data from something else doesn't match
+	const uint8_t *p = (const uint8_t *)data;
+	uint32_t hash = 2166136261UL ^ SPOOL_MAGIC;
+	for(size_t ii = 0; ii < len; ii++) {
+		hash = (hash ^ p[ii]) * 16777619UL;
+	}
+	return hash;
+}
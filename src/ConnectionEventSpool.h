@@ -0,0 +1,93 @@
+#ifndef __CONNECTIONEVENTSPOOL_H
+#define __CONNECTIONEVENTSPOOL_H
+
+#include "Particle.h"
+
+#include "ConnectionEvents.h"
+
+// Stored at the start of the spool's EEPROM area
+typedef struct {
+	uint32_t magic; // SPOOL_MAGIC
+	uint32_t readSeq; // Sequence number of the oldest record not yet published
+	uint32_t check; // Checksum of the fields above
+} ConnectionEventSpoolHeader;
+
+// One record in the spool's EEPROM area (24 bytes)
+typedef struct {
+	uint32_t seq;
+	ConnectionEventInfo ev;
+	uint32_t check; // Checksum of the fields above, so a partly written record is ignored
+} ConnectionEventSpoolRecord;
+
+// The flash write budget is kept in retained memory so resetting or sleeping during an outage
+// doesn't give it a fresh start
+typedef struct {
+	uint32_t magic;
+	uint32_t tokens; // Records that can be written now, in 1/1000 of a record
+	time_t lastRefillSecs;
+} ConnectionEventSpoolRetainedData;
+
+/**
+ * @brief Overflow store in EEPROM for the connection event log
+ *
+ * When ConnectionEvents has a spool and the retained buffer fills up while the cloud is not connected,
+ * the oldest events are moved here instead of being discarded. Once connected, they're published
+ * before the events in retained memory, oldest first.
+ *
+ * The records are written as a log: each one has a sequence number, and record n goes in slot n %
+ * the number of slots, so writes are spread over the whole area. The only fixed location is the
+ * header, which is written once per publish while draining. The Device OS EEPROM emulation does its
+ * own wear leveling across two flash pages on top of this. On boot, the slots are scanned for the
+ * newest valid record, so nothing but the header needs to be kept up to date.
+ *
+ * When the spool is full, no more records are added, so the oldest events of a long outage are kept.
+ * The number of records written per hour is limited by withWriteBudget().
+ *
+ * On the Electron, the whole EEPROM (2047 bytes) holds 84 events.
+ */
+class ConnectionEventSpool {
+public:
+	// Uses length bytes of EEPROM starting at offset. A length of 0 uses the rest of the EEPROM.
+	ConnectionEventSpool(size_t offset = 0, size_t length = 0);
+	virtual ~ConnectionEventSpool();
+
+	// Maximum number of records written per hour, not counting the header. Default: 120
+	inline ConnectionEventSpool &withWriteBudget(size_t recordsPerHour) { writeBudget = recordsPerHour; return *this; };
+
+	// Call during setup(), before ConnectionEvents::setup()
+	void setup();
+
+	// Adds an event. Returns false if the spool is full or the write budget is used up.
+	bool append(const ConnectionEventInfo &ev);
+
+	// Copies up to maxEvents of the oldest events into events, without removing them. Returns the number copied.
+	size_t read(ConnectionEventInfo *events, size_t maxEvents) const;
+
+	// Removes the count oldest events, after they've been published
+	void consume(size_t count);
+
+	inline size_t getCount() const { return writeSeq - readSeq; };
+	inline size_t getCapacity() const { return numSlots; };
+
+	static const uint32_t SPOOL_MAGIC = 0x1f6e5a93;
+	static const uint32_t RETAINED_MAGIC = 0x7a24c1e5;
+
+private:
+	bool takeWriteToken();
+	void writeHeader();
+	bool readRecord(uint32_t seq, ConnectionEventSpoolRecord &rec) const;
+	static uint32_t checksum(const void *data, size_t len);
+
+	inline size_t slotOffset(uint32_t seq) const { return offset + sizeof(ConnectionEventSpoolHeader) + (seq % numSlots) * sizeof(ConnectionEventSpoolRecord); };
+
+	size_t offset;
+	size_t length;
+	size_t numSlots = 0;
+	size_t writeBudget = 120;
+	uint32_t readSeq = 1;
+	uint32_t writeSeq = 1;
+
+	static ConnectionEventSpoolRetainedData spoolRetainedData;
+};
+
+#endif /* __CONNECTIONEVENTSPOOL_H */
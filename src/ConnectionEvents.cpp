@@ -1,8 +1,17 @@
 
 #include "ConnectionEvents.h"
 
+#include "Breadcrumbs.h"
+#include "ConnectionEventSpool.h"
+#include "PowerState.h"
+#include "PublishScheduler.h"
 
-// This is where the retained memory is allocated. Currently 522 bytes.
+// The decoders print CONNECTION_EVENT_RESET_REASON using their own copy of the reset reason values
+#define CONNECTION_EVENT_RESET_REASON_CHECK(name, value) static_assert(RESET_REASON_##name == value, "RESET_REASON_" #name " changed");
+CONNECTION_EVENT_RESET_REASONS(CONNECTION_EVENT_RESET_REASON_CHECK)
+#undef CONNECTION_EVENT_RESET_REASON_CHECK
+
+// This is where the retained memory is allocated. Currently 524 bytes.
 // There are checks in ConnectionsEvents::setup() to initialize it on first
 // use and if the format changes dramatically.
 retained ConnectionEventData ConnectionEvents::connectionEventData;
@@ -15,7 +24,9 @@ ConnectionEvents::ConnectionEvents(const char *connectionEventName) : connection
 }
 
 ConnectionEvents::~ConnectionEvents() {
-
+	if (instance == this) {
+		instance = NULL;
+	}
 }
 
 
@@ -23,11 +34,13 @@ ConnectionEvents::~ConnectionEvents() {
 // This should be called during setup()
 void ConnectionEvents::setup() {
 	if (connectionEventData.eventMagic != CONNECTION_EVENT_MAGIC ||
-		connectionEventData.eventCount > CONNECTION_EVENTS_MAX_EVENTS) {
+		(connectionEventData.writeIndex - connectionEventData.readIndex) > CONNECTION_EVENTS_MAX_EVENTS) {
 		//
 		Log.info("initializing connection event retained memory");
-		connectionEventData.eventMagic = CONNECTION_EVENT_MAGIC;
-		connectionEventData.eventCount = 0;
+		ATOMIC_BLOCK() {
+			connectionEventData.eventMagic = CONNECTION_EVENT_MAGIC;
+			connectionEventData.readIndex = connectionEventData.writeIndex = 0;
+		}
 	}
 	add(CONNECTION_EVENT_SETUP_STARTED);
 
@@ -40,49 +53,440 @@ void ConnectionEvents::setup() {
 // This should be called from loop()
 // If there are queued events and there is a cloud connection they're published, oldest first.
 void ConnectionEvents::loop() {
+	batchWaiting = false;
+
+	if (spool && !Particle.connected() && getRetainedCount() >= spoolHighWater) {
+		// Move the oldest events to flash before add() has to discard them
+		Breadcrumbs::mark(BREADCRUMB_EVENTS_SPILL);
+		spill();
+	}
 
-	if (connectionEventData.eventCount == 0) {
+	if (getEventCount() == 0) {
 		// No events to send
+		holding = false;
 		return;
 	}
 
+	if (!holding) {
+		// Start timing how long the oldest event has been waiting, for batching
+		holding = true;
+		holdStartMs = millis();
+	}
+
 	if (!canPublish()) {
 		// Not time to publish yet
 		return;
 	}
 
-	// Send events
-	char buf[256]; // 255 data bytes, plus null-terminator
+	// Pack as many events as we have, up to what will fit in a 255 byte publish. If the previous
+	// publish attempt failed and nothing has been added since, this reuses the formatted data.
+	if (!prepareBatch()) {
+		// Events were discarded by another thread while formatting; try again next time
+		return;
+	}
+
+	batchWaiting = !isBatchReady();
+	if (batchWaiting) {
+		// Batching, and waiting for more events
+		return;
+	}
+
+	if (!batchFromSpool) {
+		// A repeat added while publishing must not be counted in a record that's being sent
+		ATOMIC_BLOCK() {
+			copyingEnd = batchReadIndex + batchCount;
+			copying = true;
+		}
+	}
+	Breadcrumbs::mark(BREADCRUMB_EVENTS_PUBLISH);
+	bool published = Particle.publish(connectionEventName, batchBuf, PRIVATE);
+	Breadcrumbs::mark(BREADCRUMB_EVENTS_PUBLISHED);
+	copying = false;
+
+	if (!published) {
+		// Keep the events and the formatted batch and try again later
+		Log.info("publish failed, saving %d events for later", batchCount);
+		completedPublish();
+		return;
+	}
+	completedPublish();
+
+	ATOMIC_BLOCK() {
+		stats.published += batchCount;
+		stats.publishes++;
+		stats.publishBytes += batchLen;
+	}
+
+	if (batchFromSpool) {
+		spool->consume(batchCount);
+	}
+	else {
+		ATOMIC_BLOCK() {
+			// If add() discarded old events while we were publishing, the read index has already moved
+			// past some of the events we just sent. Never move it backwards.
+			if ((int32_t)(batchReadIndex + batchCount - connectionEventData.readIndex) > 0) {
+				connectionEventData.readIndex = batchReadIndex + batchCount;
+			}
+		}
+	}
+	size_t remaining = getEventCount();
+	if (remaining > 0) {
+		// Keep the hold window running. The events left have been waiting since holdStartMs, so
+		// they're held no longer than maxHoldMs in all.
+		Log.info("couldn't send all events, saving %d for later", remaining);
+	}
+	else {
+		Log.info("sent %d events", batchCount);
+		holding = false;
+		flushRequested = false;
+	}
+	batchCount = 0;
+}
+
+unsigned long ConnectionEvents::getMillisUntilNextLoop() {
+	if (getEventCount() == 0) {
+		// add() calls wake()
+		return NOT_SCHEDULED;
+	}
+	if (!Particle.connected()) {
+		return DISCONNECTED_POLL_MS;
+	}
+	if (batchWaiting && !flushRequested) {
+		// Adding an event calls wake(), so the only other thing that can make the batch ready is
+		// the hold time running out
+		size_t fillBytes, fillRecords;
+		unsigned long maxHoldMs;
+		getBatching(fillBytes, fillRecords, maxHoldMs);
+		return millisUntil(holdStartMs, maxHoldMs);
+	}
+	if (PublishScheduler::getInstance()) {
+		return PublishScheduler::getInstance()->getMillisUntilToken();
+	}
+	return millisUntil(connectionEventLastSent, PUBLISH_MIN_PERIOD_MS);
+}
+
+// Returns true if the formatted batch should be published now
+bool ConnectionEvents::isBatchReady() {
+	size_t fillBytes, fillRecords;
+	unsigned long maxHoldMs;
+	getBatching(fillBytes, fillRecords, maxHoldMs);
+
+	if (fillBytes == 0 && fillRecords == 0) {
+		// Not batching
+		return true;
+	}
+
+	if (flushRequested) {
+		// A high-priority event was added
+		return true;
+	}
+
+	if (batchCount < getEventCount()) {
+		// The publish is full and there are more events waiting
+		return true;
+	}
+
+	if ((fillBytes != 0 && batchLen >= fillBytes) ||
+		(fillRecords != 0 && batchCount >= fillRecords)) {
+		// Reached the fill target
+		return true;
+	}
+
+	// Otherwise, only send once the oldest event has waited long enough
+	return millis() - holdStartMs >= maxHoldMs;
+}
+
+// The batching settings, with the PowerState policy applied
+void ConnectionEvents::getBatching(size_t &fillBytes, size_t &fillRecords, unsigned long &maxHoldMs) const {
+	fillBytes = batchFillBytes;
+	fillRecords = batchFillRecords;
+	maxHoldMs = batchMaxHoldMs;
+
+	const PowerTierPolicy &power = PowerState::getPolicy();
+	if (power.batchMinHoldMs != 0) {
+		if (fillBytes == 0 && fillRecords == 0) {
+			fillBytes = power.batchFillBytes;
+		}
+		if (maxHoldMs < power.batchMinHoldMs) {
+			maxHoldMs = power.batchMinHoldMs;
+		}
+	}
+}
+
+ConnectionEvents &ConnectionEvents::withRepeatEventCode(int eventCode, bool repeat, bool anyData) {
+	if (eventCode >= 0 && eventCode < 64) {
+		if (repeat) {
+			repeatEventCodes |= (1ULL << eventCode);
+		}
+		else {
+			repeatEventCodes &= ~(1ULL << eventCode);
+		}
+		if (anyData) {
+			repeatAnyDataCodes |= (1ULL << eventCode);
+		}
+		else {
+			repeatAnyDataCodes &= ~(1ULL << eventCode);
+		}
+	}
+	return *this;
+}
+
+ConnectionEvents &ConnectionEvents::withSpool(ConnectionEventSpool &spool, size_t highWater, size_t lowWater) {
+	this->spool = &spool;
+	spoolHighWater = (highWater <= CONNECTION_EVENTS_MAX_EVENTS) ? highWater : CONNECTION_EVENTS_MAX_EVENTS;
+	spoolLowWater = (lowWater < spoolHighWater) ? lowWater : spoolHighWater;
+	return *this;
+}
+
+// Moves the oldest events from retained memory to the spool, until spoolLowWater are left or the
+// spool won't take any more
+void ConnectionEvents::spill() {
+	size_t moved = 0;
+	while(getRetainedCount() > spoolLowWater) {
+		uint32_t readIndex;
+		ConnectionEventInfo ev;
+		ATOMIC_BLOCK() {
+			readIndex = connectionEventData.readIndex;
+			ev = connectionEventData.events[readIndex % CONNECTION_EVENTS_MAX_EVENTS];
+			copyingEnd = readIndex + 1;
+			copying = true;
+		}
+
+		// The flash write is done outside of the atomic block, as it's slow
+		bool appended = spool->append(ev);
+
+		ATOMIC_BLOCK() {
+			// If add() discarded this event while it was being written, it's already gone
+			if (appended && connectionEventData.readIndex == readIndex) {
+				connectionEventData.readIndex++;
+			}
+			copying = false;
+			addGeneration++;
+		}
+		if (!appended) {
+			break;
+		}
+		spoolGeneration++;
+		moved++;
+	}
+	if (moved > 0) {
+		ATOMIC_BLOCK() {
+			stats.spooled += moved;
+		}
+		Log.info("moved %u events to the spool, %u in the spool", moved, spool->getCount());
+	}
+}
+
+ConnectionEvents &ConnectionEvents::withFlushEventCode(int eventCode, bool flush) {
+	if (eventCode >= 0 && eventCode < 64) {
+		if (flush) {
+			flushEventCodes |= (1ULL << eventCode);
+		}
+		else {
+			flushEventCodes &= ~(1ULL << eventCode);
+		}
+	}
+	return *this;
+}
+
+// Makes sure batchBuf contains the oldest events, formatted for publishing. Returns false if there
+// are no events to send.
+bool ConnectionEvents::prepareBatch() {
+	// add() increments addGeneration, which invalidates a cached batch from retained memory. A batch
+	// from the spool only changes when spill() adds to the spool, so it's kept while events are
+	// added to retained memory.
+	uint32_t generation = addGeneration;
+	if (batchCount > 0 && (batchFromSpool ? (batchGeneration == spoolGeneration) : (batchGeneration == generation))) {
+		return true;
+	}
+
+	if (spool && spool->getCount() > 0) {
+		// Events in the spool are older than the ones in retained memory, so they go first
+		size_t count = spool->read(spoolEvents, CONNECTION_EVENTS_MAX_EVENTS);
+		batchFromSpool = true;
+		if (encoding == ENCODING_COMPACT) {
+			batchCount = formatCompact(0, count, batchBuf, sizeof(batchBuf));
+		}
+		else {
+			batchCount = formatText(0, count, batchBuf, sizeof(batchBuf));
+		}
+		batchLen = strlen(batchBuf);
+		batchReadIndex = 0;
+		batchGeneration = spoolGeneration;
+
+		return batchCount > 0;
+	}
+	batchFromSpool = false;
+
+	// Other threads can add events while we're working, so take a snapshot of the indexes
+	uint32_t readIndex, writeIndex;
+	ATOMIC_BLOCK() {
+		readIndex = connectionEventData.readIndex;
+		writeIndex = connectionEventData.writeIndex;
+	}
+
+	if (encoding == ENCODING_COMPACT) {
+		batchCount = formatCompact(readIndex, writeIndex - readIndex, batchBuf, sizeof(batchBuf));
+	}
+	else {
+		batchCount = formatText(readIndex, writeIndex - readIndex, batchBuf, sizeof(batchBuf));
+	}
+	batchLen = strlen(batchBuf);
+	batchReadIndex = readIndex;
+	batchGeneration = generation;
+
+	return batchCount > 0;
+}
+
+// Copies the event at index out of the ring buffer. Returns false if it's been discarded already.
+bool ConnectionEvents::getEvent(uint32_t index, ConnectionEventInfo &ev) const {
+	bool result = false;
+	ATOMIC_BLOCK() {
+		if ((int32_t)(index - connectionEventData.readIndex) >= 0 &&
+			(int32_t)(connectionEventData.writeIndex - index) > 0) {
+			ev = connectionEventData.events[index % CONNECTION_EVENTS_MAX_EVENTS];
+			result = true;
+		}
+	}
+	return result;
+}
+
+// Gets an event for formatting: from spoolEvents if the batch is from the spool, otherwise from
+// the ring buffer
+bool ConnectionEvents::getBatchEvent(uint32_t index, ConnectionEventInfo &ev) const {
+	if (batchFromSpool) {
+		ev = spoolEvents[index];
+		return true;
+	}
+	return getEvent(index, ev);
+}
+
+// Number of characters needed to print value in decimal
+static size_t decimalLength(uint32_t value) {
+	size_t len = 1;
+	while(value >= 10) {
+		value /= 10;
+		len++;
+	}
+	return len;
+}
+
+static size_t decimalLength(int32_t value) {
+	return (value < 0) ? (1 + decimalLength((uint32_t)0 - (uint32_t)value)) : decimalLength((uint32_t)value);
+}
+
+// Stores value in decimal at buf, which must have room for len characters, len being the
+// value from decimalLength(). Not null terminated.
+static void appendDecimal(char *buf, uint32_t value, size_t len) {
+	do {
+		buf[--len] = '0' + (value % 10);
+		value /= 10;
+	} while(len > 0);
+}
+
+static void appendDecimal(char *buf, int32_t value, size_t len) {
+	if (value < 0) {
+		buf[0] = '-';
+		appendDecimal(&buf[1], (uint32_t)0 - (uint32_t)value, len - 1);
+	}
+	else {
+		appendDecimal(buf, (uint32_t)value, len);
+	}
+}
+
+// Formats up to count events starting at readIndex as decimal text. Returns the number of events
+// that fit in buf. The length of each record is calculated before writing anything, so the
+// buffer is filled right up to the end without formatting a record that doesn't fit.
+size_t ConnectionEvents::formatText(uint32_t readIndex, size_t count, char *buf, size_t bufSize) const {
 	size_t numHandled;
 	size_t offset = 0;
 
-	// Pack as many events as we have, up to what will fit in a 255 byte publish
-	for(numHandled = 0; numHandled < connectionEventData.eventCount; numHandled++) {
-		char entryBuf[64];
+	for(numHandled = 0; numHandled < count; numHandled++) {
+		ConnectionEventInfo ev;
+		if (!getBatchEvent(readIndex + numHandled, ev)) {
+			break;
+		}
+
+		size_t dateLen = decimalLength(ev.tsDate);
+		size_t millisLen = decimalLength(ev.tsMillis);
+		size_t codeLen = decimalLength((int32_t)ev.eventCode);
+		size_t dataLen = decimalLength((int32_t)ev.data);
 
-		ConnectionEventInfo *ev = &connectionEventData.events[numHandled];
-		size_t len = snprintf(entryBuf, sizeof(entryBuf), "%lu,%lu,%d,%d;", ev->tsDate, ev->tsMillis, ev->eventCode, ev->data);
-		if ((offset + len) >= sizeof(buf)) {
+		// 3 commas and a semicolon
+		size_t len = dateLen + millisLen + codeLen + dataLen + 4;
+		if ((offset + len) >= bufSize) {
 			// Not enough buffer space to send in this publish; try again later
 			break;
 		}
-		strcpy(&buf[offset], entryBuf);
-		offset += len;
-	}
-	connectionEventData.eventCount -= numHandled;
-	if (connectionEventData.eventCount > 0) {
-		Log.info("couldn't send all events, saving %d for later", connectionEventData.eventCount);
-		memmove(&connectionEventData.events[0], &connectionEventData.events[numHandled], connectionEventData.eventCount * sizeof(ConnectionEventData));
+
+		appendDecimal(&buf[offset], ev.tsDate, dateLen);
+		offset += dateLen;
+		buf[offset++] = ',';
+		appendDecimal(&buf[offset], ev.tsMillis, millisLen);
+		offset += millisLen;
+		buf[offset++] = ',';
+		appendDecimal(&buf[offset], (int32_t)ev.eventCode, codeLen);
+		offset += codeLen;
+		buf[offset++] = ',';
+		appendDecimal(&buf[offset], (int32_t)ev.data, dataLen);
+		offset += dataLen;
+		buf[offset++] = ';';
 	}
-	else {
-		Log.info("sent %d events", numHandled);
+	buf[offset] = 0;
+
+	return numHandled;
+}
+
+// Formats up to count events starting at readIndex using the compact encoding. Returns the number
+// of events that fit in buf.
+size_t ConnectionEvents::formatCompact(uint32_t readIndex, size_t count, char *buf, size_t bufSize) const {
+	// The prefix character and null terminator aren't available for Z85 data
+	uint8_t binary[PUBLISH_MAX_DATA];
+	size_t maxBinary = CompactEncoding::z85MaxBinary(bufSize - 2);
+	size_t numHandled;
+	size_t offset = 0;
+	uint32_t prevDate = 0, prevMillis = 0;
+
+	for(numHandled = 0; numHandled < count; numHandled++) {
+		ConnectionEventInfo ev;
+		if (!getBatchEvent(readIndex + numHandled, ev)) {
+			break;
+		}
+
+		uint32_t values[4];
+		values[0] = CompactEncoding::zigzag((int32_t)(ev.tsDate - prevDate));
+		values[1] = CompactEncoding::zigzag((int32_t)(ev.tsMillis - prevMillis));
+		values[2] = (uint32_t)ev.eventCode;
+		values[3] = CompactEncoding::zigzag(ev.data);
+
+		size_t len = 0;
+		for(size_t ii = 0; ii < 4; ii++) {
+			len += CompactEncoding::varintLength(values[ii]);
+		}
+		if ((offset + len) > maxBinary) {
+			// Not enough buffer space to send in this publish; try again later
+			break;
+		}
+		for(size_t ii = 0; ii < 4; ii++) {
+			offset += CompactEncoding::appendVarint(&binary[offset], values[ii]);
+		}
+		prevDate = ev.tsDate;
+		prevMillis = ev.tsMillis;
 	}
 
-	Particle.publish(connectionEventName, buf, PRIVATE);
-	completedPublish();
+	buf[0] = COMPACT_PREFIX;
+	CompactEncoding::z85Encode(binary, offset, &buf[1]);
+
+	return numHandled;
 }
 
 bool ConnectionEvents::canPublish() {
+	if (PublishScheduler::getInstance()) {
+		// The scheduler handles the publish rate limit for all modules. Flushes go ahead of other
+		// modules' normal priority publishes.
+		return PublishScheduler::getInstance()->canPublish(flushRequested ? PublishScheduler::PRIORITY_HIGH : PublishScheduler::PRIORITY_NORMAL);
+	}
+
 	if (!Particle.connected()) {
 		// Not cloud connected, can't publish
 		return false;
@@ -97,27 +501,139 @@ bool ConnectionEvents::canPublish() {
 
 void ConnectionEvents::completedPublish() {
 	connectionEventLastSent = millis();
+	if (PublishScheduler::getInstance()) {
+		PublishScheduler::getInstance()->completedPublish();
+	}
 }
 
 
-// Add a new event. This should only be called from the main loop thread.
-// Do not call from other threads like the system thread, software timer, or interrupt service routine.
+// Add a new event. This can be called from any thread, including the system thread and the
+// application watchdog thread, but not from an interrupt service routine.
 void ConnectionEvents::add(int eventCode, int data /* = 0 */) {
-	if (connectionEventData.eventCount >= CONNECTION_EVENTS_MAX_EVENTS) {
-		// Throw out oldest event
+	bool discarded = false;
+	bool collapsed = false;
+	store(eventCode, data, discarded, collapsed);
+
+	wake();
+
+	if (discarded) {
 		Log.info("discarding old event");
-		connectionEventData.eventCount--;
-		memmove(&connectionEventData.events[0], &connectionEventData.events[1], connectionEventData.eventCount * sizeof(ConnectionEventData));
 	}
+	Log.info("connectionEvent event=%d data=%d%s", eventCode, data, collapsed ? " (repeat)" : "");
+}
+
+// The ring buffer is only modified inside ATOMIC_BLOCK() and the work done there is a
+// fixed, small amount, so it doesn't matter how full the buffer is.
+void ConnectionEvents::store(int eventCode, int data, bool &discarded, bool &collapsed) {
+	ConnectionEventInfo ev;
+	ev.tsDate = Time.now();
+	ev.tsMillis = millis();
+	ev.eventCode = eventCode;
+	ev.data = data;
+
+	ATOMIC_BLOCK() {
+		stats.added++;
+		collapsed = collapseRepeat(ev);
+		if (collapsed) {
+			stats.collapsed++;
+		}
+		else {
+			if ((connectionEventData.writeIndex - connectionEventData.readIndex) >= CONNECTION_EVENTS_MAX_EVENTS) {
+				// Throw out oldest event
+				connectionEventData.readIndex++;
+				stats.discarded++;
+				discarded = true;
+			}
+
+			// Add new event
+			connectionEventData.events[connectionEventData.writeIndex++ % CONNECTION_EVENTS_MAX_EVENTS] = ev;
+		}
+
+		// Any formatted batch waiting to be published is now out of date
+		addGeneration++;
+
+		if (eventCode >= 0 && eventCode < 64 && (flushEventCodes & (1ULL << eventCode)) != 0) {
+			flushRequested = true;
+		}
+	}
+}
+
+// Called from store() inside its atomic block. If ev repeats the newest record, either increments
+// the count of that REPEAT record and returns true, or turns ev into a new REPEAT record and returns
+// false. Only the newest record is looked at, so the log stays in time order, and a REPEAT record
+// always comes right after the original record of its run.
+bool ConnectionEvents::collapseRepeat(ConnectionEventInfo &ev) {
+	int eventCode = ev.eventCode;
+	if (repeatWindowMs == 0 || eventCode < 0 || eventCode >= 64 || (repeatEventCodes & (1ULL << eventCode)) == 0) {
+		return false;
+	}
+	bool anyData = (repeatAnyDataCodes & (1ULL << eventCode)) != 0;
+	if (!anyData && (ev.data < 0 || ev.data > 0xff)) {
+		// The data wouldn't fit in a REPEAT record
+		return false;
+	}
+
+	// Don't change records that are being copied out by loop()
+	uint32_t oldest = connectionEventData.readIndex;
+	if (copying && (int32_t)(copyingEnd - oldest) > 0) {
+		oldest = copyingEnd;
+	}
+	if (connectionEventData.writeIndex == oldest) {
+		return false;
+	}
+
+	ConnectionEventInfo &rec = connectionEventData.events[(connectionEventData.writeIndex - 1) % CONNECTION_EVENTS_MAX_EVENTS];
+	if (ev.tsMillis - rec.tsMillis >= repeatWindowMs) {
+		return false;
+	}
+
+	if (rec.eventCode == CONNECTION_EVENT_REPEAT) {
+		uint32_t repeat = (uint32_t)rec.data;
+		uint32_t count = repeat & 0xffff;
+		if ((int)(repeat >> 24) == eventCode && (anyData || (int)((repeat >> 16) & 0xff) == ev.data) && count < REPEAT_MAX_COUNT) {
+			rec.data = packRepeat(eventCode, ev.data, count + 1);
+			rec.tsDate = ev.tsDate;
+			rec.tsMillis = ev.tsMillis;
+			return true;
+		}
+	}
+	else
+	if (rec.eventCode == eventCode && (anyData || rec.data == ev.data)) {
+		// First repeat of this event
+		ev.data = packRepeat(eventCode, ev.data, 1);
+		ev.eventCode = CONNECTION_EVENT_REPEAT;
+	}
+	return false;
+}
 
-	// Add new event
-	ConnectionEventInfo *ev = &connectionEventData.events[connectionEventData.eventCount++];
-	ev->tsDate = Time.now();
-	ev->tsMillis = millis();
-	ev->eventCode = eventCode;
-	ev->data = data;
+size_t ConnectionEvents::getEventCount() const {
+	size_t count = getRetainedCount();
+	if (spool) {
+		count += spool->getCount();
+	}
+	return count;
+}
 
-	Log.info("connectionEvent event=%d data=%d", eventCode, data);
+ConnectionEventStats ConnectionEvents::getStats() const {
+	ConnectionEventStats result;
+	ATOMIC_BLOCK() {
+		result = stats;
+	}
+	return result;
+}
+
+void ConnectionEvents::resetStats() {
+	ATOMIC_BLOCK() {
+		memset(&stats, 0, sizeof(stats));
+	}
+}
+
+size_t ConnectionEvents::getRetainedCount() const {
+	size_t count;
+	ATOMIC_BLOCK() {
+		count = connectionEventData.writeIndex - connectionEventData.readIndex;
+	}
+	return count;
 }
 
 // static
@@ -127,5 +643,14 @@ void ConnectionEvents::addEvent(int eventCode, int data) {
 	}
 }
 
+// static
+void ConnectionEvents::addEventBeforeReset(int eventCode, int data) {
+	if (instance) {
+		bool discarded = false;
+		bool collapsed = false;
+		instance->store(eventCode, data, discarded, collapsed);
+	}
+}
+
 
 
@@ -3,22 +3,43 @@
 
 #include "Particle.h"
 
+#include "CompactEncoding.h"
+#include "ConnectionEventCodes.h"
+#include "ModuleScheduler.h"
+
+class ConnectionEventSpool;
+
 // This code is used to track connection events, used mainly for debugging
 // and making sure this code works properly.
 const size_t CONNECTION_EVENTS_MAX_EVENTS = 32;
 
 // Data for each event is stored in this structure
 typedef struct { // 16 bytes per event
-	unsigned long tsDate;
-	unsigned long tsMillis;
+	uint32_t tsDate;
+	uint32_t tsMillis;
 	int eventCode;
 	int data;
 } ConnectionEventInfo;
 
-// This structure is what's stored in retained memory (520 bytes)
+// Counters for the event pipeline, since the ConnectionEvents object was created or resetStats()
+typedef struct {
+	uint32_t added; // Calls to add()
+	uint32_t collapsed; // Added events that only incremented the count of a REPEAT record
+	uint32_t discarded; // Events thrown out because the log was full
+	uint32_t spooled; // Events moved to the spool
+	uint32_t published; // Records in successful publishes
+	uint32_t publishes; // Successful publishes
+	uint32_t publishBytes; // Data bytes in successful publishes
+} ConnectionEventStats;
+
+// This structure is what's stored in retained memory (524 bytes)
+// It's a ring buffer. readIndex and writeIndex are free-running counters; the slot for an index is
+// index % CONNECTION_EVENTS_MAX_EVENTS and the number of queued events is writeIndex - readIndex.
+// Appending and draining are O(1) and nothing is ever moved within the events array.
 typedef struct {
 	uint32_t eventMagic; // CONNECTION_EVENT_MAGIC
-	size_t eventCount;
+	uint32_t readIndex; // Oldest event not yet published
+	uint32_t writeIndex; // Where the next event will be stored
 	ConnectionEventInfo events[CONNECTION_EVENTS_MAX_EVENTS]; // 32 entries, 16 bytes each
 } ConnectionEventData;
 
@@ -41,8 +62,14 @@ typedef struct {
  *
  * Multiple records are packed into a single event up to the maximum event size (256 bytes); they are
  * separated by semicolons.
+ *
+ * If you select ENCODING_COMPACT using withEncoding(), the event data instead starts with a ~ followed
+ * by Z85 (base85) encoded binary data. For each record there are 4 varints (see CompactEncoding):
+ * zigzag(tsDate - previous tsDate), zigzag(tsMillis - previous tsMillis), eventCode, zigzag(data).
+ * The previous values start at 0 for the first record in each publish. A typical record is 5 or 6 bytes
+ * so around 30 records fit in one publish instead of 7.
 */
-class ConnectionEvents {
+class ConnectionEvents : public ScheduledModule {
 public:
 	ConnectionEvents(const char *connectionEventName);
 	virtual ~ConnectionEvents();
@@ -50,48 +77,146 @@ public:
 	void setup();
 	void loop();
 
+	unsigned long getMillisUntilNextLoop();
+
 	bool canPublish();
 	void completedPublish();
 
+	// Can be called from any thread, including the system thread. It logs the event, so it's not
+	// safe from a thread that's about to reset because another one is stuck; use
+	// addEventBeforeReset() there.
 	void add(int eventCode, int data = 0);
 
 	static void addEvent(int eventCode, int data = 0);
 
+	// Only writes the event to retained memory, inside ATOMIC_BLOCK(), without logging or waking
+	// the scheduler, so it can't block on a lock held by a stuck thread. For the application
+	// watchdog and HeartbeatWatchdog, right before System.reset().
+	static void addEventBeforeReset(int eventCode, int data = 0);
+
+	// Number of events waiting to be published, including any in the spool
+	size_t getEventCount() const;
+
+	// Number of events discarded because there was no room for them since this object was created
+	inline uint32_t getDiscardedCount() const { return stats.discarded; };
+
+	// A copy of the counters. Safe to call from any thread.
+	ConnectionEventStats getStats() const;
+	void resetStats();
+
 	inline static ConnectionEvents *getInstance() { return instance; };
 
+	// How the records are formatted in the publish data
+	enum Encoding {
+		ENCODING_TEXT = 0,	// Decimal text, comma and semicolon separated (default)
+		ENCODING_COMPACT	// Delta-encoded varints, Z85 encoded, prefixed by ~
+	};
+
+	inline ConnectionEvents &withEncoding(Encoding value) { encoding = value; batchCount = 0; return *this; };
+
+	// Batching: instead of publishing as soon as there's an event, wait until the publish would
+	// contain at least fillBytes bytes of data (or fillRecords records), or the oldest event has
+	// been waiting maxHoldMs, whichever comes first. Events with a flush event code, and a full
+	// publish, are always sent right away. Batching is off by default (fill target of 0). The
+	// PowerState policy can hold events longer, and turn batching on, while saving power.
+	inline ConnectionEvents &withBatching(size_t fillBytes, unsigned long maxHoldMs) { batchFillBytes = fillBytes; batchFillRecords = 0; batchMaxHoldMs = maxHoldMs; return *this; };
+	inline ConnectionEvents &withBatchingRecords(size_t fillRecords, unsigned long maxHoldMs) { batchFillBytes = 0; batchFillRecords = fillRecords; batchMaxHoldMs = maxHoldMs; return *this; };
+
+	// Adding an event with this code publishes all queued events as soon as possible, even when
+	// batching. By default, CONNECTION_EVENT_RESET_REASON, CONNECTION_EVENT_APP_WATCHDOG
+	// and CONNECTION_EVENT_HEARTBEAT_STALL.
+	ConnectionEvents &withFlushEventCode(int eventCode, bool flush = true);
+
+	// Adds an overflow store in EEPROM. While the cloud is not connected and there are at least
+	// highWater events in retained memory, the oldest are moved to the spool until lowWater are
+	// left, instead of being discarded when the retained buffer is full. The spool is published
+	// first once connected. Call spool.setup() before setup().
+	ConnectionEvents &withSpool(ConnectionEventSpool &spool, size_t highWater = 24, size_t lowWater = 16);
+
+	// Runs of an event code are collapsed: when an event has the same code and data as the newest
+	// record, and that one was added less than the repeat window ago, a CONNECTION_EVENT_REPEAT record
+	// is added instead, and further repeats just increment its count and update its timestamps. So
+	// the original record has the time of the first occurrence and the REPEAT record right after it
+	// the time of the last, and the records stay in the order the events happened. With anyData, the
+	// data doesn't have to match and the REPEAT record keeps the low 8 bits of the latest data. By
+	// default, LISTENING_ENTERED, PING_DNS, PING_API, SESSION_EVENT_LOST and TESTER_PING (any data).
+	ConnectionEvents &withRepeatEventCode(int eventCode, bool repeat = true, bool anyData = false);
+
+	// How long after the last occurrence a repeat is still collapsed. 0 turns collapsing off.
+	// Default: 1 hour
+	inline ConnectionEvents &withRepeatWindow(unsigned long ms) { repeatWindowMs = ms; return *this; };
+
+	// Packs the data of a CONNECTION_EVENT_REPEAT record: the repeated event code in bits 24-31, the
+	// low 8 bits of its data in 16-23 and the number of repeats in 0-15
+	static inline int packRepeat(int eventCode, int data, unsigned count) { return (int)(((uint32_t)eventCode << 24) | (((uint32_t)data & 0xff) << 16) | (count & 0xffff)); };
+
+	// Publishes all queued events as soon as possible, even when batching
+	inline void flush() { if (getEventCount() > 0) { flushRequested = true; wake(); } };
+
 	// These are the defined event codes. Instead of a string, they're sent as an integer to make
 	// the output more compact, saving retained memory and allowing more events to fit in a Particle.publish/
+	// The list is in ConnectionEventCodes.h, which the native decoder shares.
 	enum ConnectionEventCode {
-		CONNECTION_EVENT_SETUP_STARTED = 0,		// 0
-		CONNECTION_EVENT_CELLULAR_READY,		// 1
-		CONNECTION_EVENT_CLOUD_CONNECTED,		// 2
-		CONNECTION_EVENT_LISTENING_ENTERED,		// 3
-		CONNECTION_EVENT_MODEM_RESET,			// 4
-		CONNECTION_EVENT_REBOOT_LISTENING,		// 5
-		CONNECTION_EVENT_REBOOT_NO_CLOUD,		// 6
-		CONNECTION_EVENT_PING_DNS,				// 7
-		CONNECTION_EVENT_PING_API,				// 8
-		CONNECTION_EVENT_APP_WATCHDOG,			// 9
-		CONNECTION_EVENT_TESTER_RESET,			// 10
-		CONNECTION_EVENT_TESTER_APP_WATCHDOG,	// 11
-		CONNECTION_EVENT_TESTER_SLEEP,			// 12
-		CONNECTION_EVENT_LOW_BATTERY_SLEEP,		// 13
-		CONNECTION_EVENT_SESSION_EVENT_LOST, 	// 14
-		CONNECTION_EVENT_SESSION_RESET, 		// 15
-		CONNECTION_EVENT_TESTER_RESET_SESSION,	// 16
-		CONNECTION_EVENT_TESTER_RESET_MODEM,	// 17
-		CONNECTION_EVENT_RESET_REASON,			// 18
-		CONNECTION_EVENT_TESTER_SAFE_MODE,		// 19
-		CONNECTION_EVENT_TESTER_PING,			// 20
-		CONNECTION_EVENT_STOP_SLEEP_WAKE,		// 21
-		CONNECTION_EVENT_FAILURE_SLEEP			// 22
+#define CONNECTION_EVENT_CODE_ENUM(name, value) CONNECTION_EVENT_##name = value,
+		CONNECTION_EVENT_CODES(CONNECTION_EVENT_CODE_ENUM)
+#undef CONNECTION_EVENT_CODE_ENUM
 	};
 
-	static const unsigned long CONNECTION_EVENT_MAGIC = 0x5c39d416;
+	static const unsigned long CONNECTION_EVENT_MAGIC = 0x5c39d417;
 	static const unsigned long PUBLISH_MIN_PERIOD_MS = 1010;
+	static const size_t PUBLISH_MAX_DATA = 255;
+	static const char COMPACT_PREFIX = '~';
+	static const unsigned long DISCONNECTED_POLL_MS = 1000; // How often to check for a cloud connection when there are events
+	static const uint32_t REPEAT_MAX_COUNT = 0xffff;
 
 private:
+	bool prepareBatch();
+	bool isBatchReady();
+	void getBatching(size_t &fillBytes, size_t &fillRecords, unsigned long &maxHoldMs) const;
+	void store(int eventCode, int data, bool &discarded, bool &collapsed);
+	bool collapseRepeat(ConnectionEventInfo &ev);
+	bool getEvent(uint32_t index, ConnectionEventInfo &ev) const;
+	bool getBatchEvent(uint32_t index, ConnectionEventInfo &ev) const;
+	size_t getRetainedCount() const;
+	void spill();
+	size_t formatText(uint32_t readIndex, size_t count, char *buf, size_t bufSize) const;
+	size_t formatCompact(uint32_t readIndex, size_t count, char *buf, size_t bufSize) const;
+
 	const char *connectionEventName;
+	Encoding encoding = ENCODING_TEXT;
+
+	// The oldest events, formatted and ready to publish. This is kept if the publish fails, so the
+	// same events don't have to be formatted again unless another event has been added.
+	char batchBuf[PUBLISH_MAX_DATA + 1]; // 255 data bytes, plus null-terminator
+	size_t batchCount = 0; // Number of events in batchBuf, 0 = none
+	uint32_t batchReadIndex = 0; // Index of the first event in batchBuf
+	uint32_t batchGeneration = 0; // Value of addGeneration, or spoolGeneration for a batch from the spool, when batchBuf was formatted
+	volatile uint32_t addGeneration = 0; // Incremented by add(), from any thread
+	uint32_t spoolGeneration = 0; // Incremented by spill() for each event added to the spool
+	size_t batchLen = 0; // strlen(batchBuf)
+
+	size_t batchFillBytes = 0;
+	size_t batchFillRecords = 0;
+	unsigned long batchMaxHoldMs = 0;
+	uint64_t flushEventCodes = (1ULL << CONNECTION_EVENT_RESET_REASON) | (1ULL << CONNECTION_EVENT_APP_WATCHDOG) |
+		(1ULL << CONNECTION_EVENT_HEARTBEAT_STALL);
+	volatile bool flushRequested = false; // Set by add() for a flush event code
+	uint64_t repeatEventCodes = (1ULL << CONNECTION_EVENT_LISTENING_ENTERED) | (1ULL << CONNECTION_EVENT_PING_DNS) |
+		(1ULL << CONNECTION_EVENT_PING_API) | (1ULL << CONNECTION_EVENT_SESSION_EVENT_LOST) | (1ULL << CONNECTION_EVENT_TESTER_PING);
+	uint64_t repeatAnyDataCodes = (1ULL << CONNECTION_EVENT_TESTER_PING);
+	unsigned long repeatWindowMs = 3600000;
+	volatile bool copying = false; // Records before copyingEnd are being published or spooled and must not be changed
+	volatile uint32_t copyingEnd = 0;
+	bool holding = false; // There are events that have not been published yet
+	bool batchWaiting = false; // The last loop() held the batch to wait for more events
+	unsigned long holdStartMs = 0; // millis() value when holding started, kept until all the events are published
+	ConnectionEventStats stats = {}; // Changed inside ATOMIC_BLOCK() as add() can be called from any thread
+
+	ConnectionEventSpool *spool = NULL;
+	size_t spoolHighWater = 0;
+	size_t spoolLowWater = 0;
+	bool batchFromSpool = false; // batchBuf holds events from the spool instead of retained memory
+	ConnectionEventInfo spoolEvents[CONNECTION_EVENTS_MAX_EVENTS]; // The events read from the spool for batchBuf
 
 	// This is used to slow down publishing of data to once every 1010 milliseconds to avoid
 	// exceeding the publish rate limit.
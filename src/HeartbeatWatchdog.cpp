@@ -0,0 +1,113 @@
+#include "HeartbeatWatchdog.h"
+
+#include "Breadcrumbs.h"
+#include "ConnectionEvents.h"
+
+
+HeartbeatWatchdog::HeartbeatWatchdog(unsigned long checkPeriodMs) : timer(checkPeriodMs, &HeartbeatWatchdog::check, *this) {
+	memset(moduleTimeouts, 0, sizeof(moduleTimeouts));
+	memset(channels, 0, sizeof(channels));
+}
+
+HeartbeatWatchdog::~HeartbeatWatchdog() {
+	timer.stop();
+}
+
+void HeartbeatWatchdog::setup() {
+	timer.start();
+}
+
+HeartbeatWatchdog &HeartbeatWatchdog::withModuleTimeout(size_t index, unsigned long ms) {
+	if (index < MAX_MODULES) {
+		moduleTimeouts[index] = ms;
+	}
+	return *this;
+}
+
+int HeartbeatWatchdog::addChannel(unsigned long timeoutMs) {
+	if (numChannels >= MAX_USER_CHANNELS) {
+		return -1;
+	}
+	UserChannel &ch = channels[numChannels];
+	ch.timeoutMs = timeoutMs;
+	ch.lastCheckin = millis();
+	ch.active = true;
+
+	// The timer only looks at channels below numChannels, so the channel is set up before it's counted
+	return USER_CHANNEL_BASE + (int) numChannels++;
+}
+
+void HeartbeatWatchdog::checkin(int channel) {
+	size_t index = (size_t)(channel - USER_CHANNEL_BASE);
+	if (index < numChannels) {
+		channels[index].lastCheckin = millis();
+		channels[index].active = true;
+	}
+}
+
+void HeartbeatWatchdog::pause(int channel) {
+	size_t index = (size_t)(channel - USER_CHANNEL_BASE);
+	if (index < numChannels) {
+		channels[index].active = false;
+	}
+}
+
+void HeartbeatWatchdog::moduleStarted(size_t index) {
+	// The start time is set first, so check() never sees the new module with the old time
+	moduleStartMs = millis();
+	runningModule = (index < MAX_MODULES) ? (uint8_t) index : STAGE_NONE;
+	stage = runningModule;
+}
+
+void HeartbeatWatchdog::moduleFinished() {
+	runningModule = STAGE_NONE;
+	stage = STAGE_NONE;
+}
+
+// Runs on the timer thread
+void HeartbeatWatchdog::check() {
+	// The module and its start time are read before millis(), so a module started by the loop thread
+	// in between can't make the elapsed time negative
+	uint8_t module = runningModule;
+	unsigned long startMs = moduleStartMs;
+	unsigned long now = millis();
+
+	if (module != STAGE_NONE) {
+		unsigned long elapsed = now - startMs;
+		unsigned long timeout = moduleTimeouts[module] ? moduleTimeouts[module] : moduleTimeoutMs;
+		if (elapsed >= timeout && (long)elapsed >= 0 && runningModule == module && moduleStartMs == startMs) {
+			stalled(module, elapsed);
+			return;
+		}
+	}
+
+	for(size_t ii = 0; ii < numChannels; ii++) {
+		const UserChannel &ch = channels[ii];
+		unsigned long elapsed = now - ch.lastCheckin;
+		if (ch.active && elapsed >= ch.timeoutMs && (long)elapsed >= 0) {
+			stalled(USER_CHANNEL_BASE + ii, elapsed);
+			return;
+		}
+	}
+}
+
+void HeartbeatWatchdog::stalled(unsigned channel, unsigned long stalledMs) {
+	if (resetting) {
+		return;
+	}
+	resetting = true;
+
+	// Only safe calls from here: the loop thread could be stuck anywhere, including in the logger
+	ConnectionEvents::addEventBeforeReset(ConnectionEvents::CONNECTION_EVENT_HEARTBEAT_STALL, packStall(channel, stage, stalledMs));
+	Breadcrumbs::requestUpload();
+	System.reset();
+}
+
+// static
+int HeartbeatWatchdog::packStall(unsigned channel, uint8_t stage, unsigned long stalledMs) {
+	unsigned long tenths = stalledMs / 100;
+	if (tenths > 0xffff) {
+		tenths = 0xffff;
+	}
+	return (int)(((uint32_t)(channel & 0xff) << 24) | ((uint32_t)stage << 16) | tenths);
+}
@@ -0,0 +1,93 @@
+#ifndef __HEARTBEATWATCHDOG_H
+#define __HEARTBEATWATCHDOG_H
+
+#include "Particle.h"
+
+/**
+ * @brief Software watchdog with its own deadline for each module and for your own code
+ *
+ * There are two kinds of channel:
+ *
+ * - Module channels. When the ModuleScheduler has a watchdog (ModuleScheduler::withWatchdog()),
+ * each module's loop() has to return within its timeout, 20 seconds by default
+ * (withModuleTimeout()). The channel number is the order the module was added to the
+ * ModuleScheduler, starting at 0. Modules don't need to check in, as a module that isn't running
+ * can't be stuck.
+ * - Channels you add with addChannel(), numbered from USER_CHANNEL_BASE. Call checkin() at least
+ * once per timeout, for example on each pass through your loop() or from your own thread.
+ *
+ * A software timer checks the deadlines every second. It runs on the timer thread, so it keeps
+ * going while loop() is stuck. When a deadline is missed, it adds a HEARTBEAT_STALL event with the
+ * channel, how long ago the channel checked in (or how long the module has been running) and the
+ * last loop stage, then resets. The event is written with ConnectionEvents::addEventBeforeReset(),
+ * which doesn't log or take any locks, so it can't be held up by the thread that's stuck. It's
+ * published after the reset.
+ *
+ * The stage is the number of the module the ModuleScheduler is running, or STAGE_NONE between
+ * modules. Your own code can mark what it's doing with setStage().
+ */
+class HeartbeatWatchdog {
+public:
+	HeartbeatWatchdog(unsigned long checkPeriodMs = 1000);
+	virtual ~HeartbeatWatchdog();
+
+	// Starts the timer
+	void setup();
+
+	// Timeout for the module channels, in milliseconds. Default: 20000
+	inline HeartbeatWatchdog &withModuleTimeout(unsigned long ms) { moduleTimeoutMs = ms; return *this; };
+
+	// Timeout for one module, by the order it was added to the ModuleScheduler. 0 uses the default.
+	HeartbeatWatchdog &withModuleTimeout(size_t index, unsigned long ms);
+
+	// Adds a channel for your own code, with its deadline starting now. Returns the channel number,
+	// or -1 if there are already MAX_USER_CHANNELS.
+	int addChannel(unsigned long timeoutMs);
+
+	// Can be called from any thread
+	void checkin(int channel);
+
+	// Stops checking a channel until its next checkin(), for example while your code is waiting
+	// for something on purpose. Can be called from any thread.
+	void pause(int channel);
+
+	// Marks what your code is doing, 0 to 254. Can be called from any thread.
+	inline void setStage(uint8_t value) { stage = value; };
+	inline uint8_t getStage() const { return stage; };
+
+	// Called by ModuleScheduler around each module's loop()
+	void moduleStarted(size_t index);
+	void moduleFinished();
+
+	// Packs the data of a CONNECTION_EVENT_HEARTBEAT_STALL event: the time since the channel checked
+	// in, in tenths of a second, in bits 0-15, the stage in bits 16-23 and the channel in bits 24-31
+	static int packStall(unsigned channel, uint8_t stage, unsigned long stalledMs);
+
+	static const size_t MAX_MODULES = 32;
+	static const size_t MAX_USER_CHANNELS = 8;
+	static const int USER_CHANNEL_BASE = 32;
+	static const uint8_t STAGE_NONE = 0xff;
+
+private:
+	// A channel added with addChannel()
+	typedef struct {
+		unsigned long timeoutMs;
+		volatile unsigned long lastCheckin; // millis() value
+		volatile bool active;
+	} UserChannel;
+
+	void check();
+	void stalled(unsigned channel, unsigned long stalledMs);
+
+	Timer timer;
+	unsigned long moduleTimeoutMs = 20000;
+	unsigned long moduleTimeouts[MAX_MODULES];
+	UserChannel channels[MAX_USER_CHANNELS];
+	volatile size_t numChannels = 0;
+	volatile uint8_t runningModule = STAGE_NONE;
+	volatile unsigned long moduleStartMs = 0; // millis() when runningModule was started
+	volatile uint8_t stage = STAGE_NONE;
+	volatile bool resetting = false;
+};
+
+#endif /* __HEARTBEATWATCHDOG_H */
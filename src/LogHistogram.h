@@ -0,0 +1,87 @@
+#ifndef __LOGHISTOGRAM_H
+#define __LOGHISTOGRAM_H
+
+#include "Particle.h"
+
+/**
+ * @brief Histogram with logarithmic buckets, small enough to keep in retained memory
+ *
+ * Values 0 and 1 have their own buckets. After that each power of 2 is split in half: bucket 2n
+ * holds values from 2^n up to 1.5 * 2^n, and bucket 2n + 1 from 1.5 * 2^n up to 2^(n + 1). So a
+ * value is always within 33% of the lower bound of its bucket, whatever its size. Values too large
+ * for the last bucket are counted in it.
+ *
+ * This is 112 bytes. There is no constructor so it can be part of a retained structure; call clear()
+ * to initialize it. Bucket counts stop at 65535, unless addScaled() is used.
+ */
+struct LogHistogram {
+	static const size_t NUM_BUCKETS = 52; // Up to 2^26 (about 18 hours in milliseconds)
+
+	uint32_t count;
+	uint32_t maxValue;
+	uint16_t buckets[NUM_BUCKETS];
+
+	inline void clear() {
+		memset(this, 0, sizeof(*this));
+	}
+
+	inline void add(uint32_t value) {
+		count++;
+		if (value > maxValue) {
+			maxValue = value;
+		}
+		uint16_t &bucket = buckets[bucketIndex(value)];
+		if (bucket < 0xffff) {
+			bucket++;
+		}
+	}
+
+	// Like add(), but when a bucket is full every bucket is halved instead, so the percentiles stay
+	// right however many values are added. The bucket counts are then only relative; count is still
+	// the number of values. Halving rounds up, so a rare slow value isn't lost from the tail.
+	inline void addScaled(uint32_t value) {
+		size_t index = bucketIndex(value);
+		if (buckets[index] == 0xffff) {
+			for(size_t ii = 0; ii < NUM_BUCKETS; ii++) {
+				buckets[ii] = (uint16_t)((buckets[ii] + 1) / 2);
+			}
+		}
+		add(value);
+	}
+
+	// Lower bound of the bucket containing the pct percentile, 0 if empty
+	inline uint32_t percentile(unsigned pct) const {
+		uint32_t total = 0;
+		for(size_t ii = 0; ii < NUM_BUCKETS; ii++) {
+			total += buckets[ii];
+		}
+		uint32_t target = (total * pct + 99) / 100;
+		uint32_t sum = 0;
+		for(size_t ii = 0; ii < NUM_BUCKETS; ii++) {
+			sum += buckets[ii];
+			if (sum >= target && sum > 0) {
+				return bucketLowerBound(ii);
+			}
+		}
+		return 0;
+	}
+
+	static inline size_t bucketIndex(uint32_t value) {
+		if (value < 2) {
+			return value;
+		}
+		size_t octave = 31 - __builtin_clz(value);
+		size_t index = 2 * octave + ((value >> (octave - 1)) & 1);
+		return (index < NUM_BUCKETS) ? index : (NUM_BUCKETS - 1);
+	}
+
+	static inline uint32_t bucketLowerBound(size_t index) {
+		if (index < 2) {
+			return index;
+		}
+		uint32_t base = 1UL << (index / 2);
+		return (index & 1) ? (base + base / 2) : base;
+	}
+};
+
+#endif /* __LOGHISTOGRAM_H */
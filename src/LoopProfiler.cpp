@@ -0,0 +1,136 @@
+#include "LoopProfiler.h"
+
+#include "ConnectionEvents.h"
+#include "PublishScheduler.h"
+
+retained LoopProfilerRetainedData LoopProfiler::loopProfilerRetainedData;
+
+
+LoopProfiler::LoopProfiler(const char *eventName) : eventName(eventName) {
+
+}
+
+LoopProfiler::~LoopProfiler() {
+
+}
+
+void LoopProfiler::setup() {
+	if (loopProfilerRetainedData.magic != LOOP_PROFILER_MAGIC) {
+		memset(&loopProfilerRetainedData, 0, sizeof(loopProfilerRetainedData));
+		loopProfilerRetainedData.magic = LOOP_PROFILER_MAGIC;
+	}
+}
+
+void LoopProfiler::loop() {
+	publishSummary();
+}
+
+unsigned long LoopProfiler::getMillisUntilNextLoop() {
+	if (summaryPeriodSecs == 0) {
+		return NOT_SCHEDULED;
+	}
+	if (!publishing) {
+		return SUMMARY_POLL_MS;
+	}
+	return PublishScheduler::millisUntilCanPublish(lastPublish);
+}
+
+void LoopProfiler::finish(size_t index, const LoopTimestamp &start) {
+	uint32_t elapsedUs = elapsedMicros(start);
+
+	if (index >= MAX_MODULES || loopProfilerRetainedData.magic != LOOP_PROFILER_MAGIC) {
+		return;
+	}
+	loopProfilerRetainedData.latencyUs[index].addScaled(elapsedUs);
+
+	if (elapsedUs / 1000 >= slowThresholdMs) {
+		if (loopProfilerRetainedData.slowCount[index] < 0xffff) {
+			loopProfilerRetainedData.slowCount[index]++;
+		}
+		if (slowEvents < MAX_SLOW_EVENTS) {
+			slowEvents++;
+			ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_SLOW_LOOP, packSlowLoop(index, elapsedUs));
+		}
+	}
+}
+
+// Publishes the summary once per summary period, then starts the next period
+void LoopProfiler::publishSummary() {
+	if (summaryPeriodSecs == 0 || !Particle.connected() || !Time.isValid()) {
+		return;
+	}
+
+	if (!publishing) {
+		time_t now = Time.now();
+		if (loopProfilerRetainedData.lastSummarySecs == 0) {
+			// Start the first period
+			loopProfilerRetainedData.lastSummarySecs = now;
+			return;
+		}
+		if (now - loopProfilerRetainedData.lastSummarySecs < summaryPeriodSecs) {
+			return;
+		}
+		publishing = true;
+		publishIndex = 0;
+	}
+
+	char buf[ConnectionEvents::PUBLISH_MAX_DATA + 1];
+	size_t index = publishIndex;
+	if (formatSummary(index, buf, sizeof(buf))) {
+		if (!PublishScheduler::tryPublish(PublishScheduler::PRIORITY_LOW, eventName, buf, lastPublish)) {
+			// Not time yet, or it failed. Try the same data again later.
+			return;
+		}
+		publishIndex = index;
+		if (publishIndex < MAX_MODULES) {
+			return;
+		}
+	}
+
+	// All sent, start the next period
+	clear();
+	loopProfilerRetainedData.lastSummarySecs = Time.now();
+	publishing = false;
+}
+
+void LoopProfiler::clear() {
+	for(size_t ii = 0; ii < MAX_MODULES; ii++) {
+		loopProfilerRetainedData.slowCount[ii] = 0;
+		loopProfilerRetainedData.latencyUs[ii].clear();
+	}
+	slowEvents = 0;
+}
+
+// static
+bool LoopProfiler::formatSummary(size_t &index, char *buf, size_t bufSize) {
+	size_t len = 0;
+	buf[0] = 0;
+
+	for(; index < MAX_MODULES; index++) {
+		const LogHistogram &hist = loopProfilerRetainedData.latencyUs[index];
+		if (hist.count == 0) {
+			continue;
+		}
+
+		char entry[80];
+		size_t entryLen = snprintf(entry, sizeof(entry), "%s%u:%lu,%lu,%lu,%lu,%lu,%u", (len > 0) ? ";" : "", (unsigned)index,
+			(unsigned long)hist.count, (unsigned long)hist.maxValue, (unsigned long)hist.percentile(50),
+			(unsigned long)hist.percentile(90), (unsigned long)hist.percentile(99), (unsigned)loopProfilerRetainedData.slowCount[index]);
+		if (len + entryLen >= bufSize) {
+			// Continue in the next publish
+			break;
+		}
+		strcpy(&buf[len], entry);
+		len += entryLen;
+	}
+	return len > 0;
+}
+
+// static
+int LoopProfiler::packSlowLoop(size_t index, uint32_t elapsedUs) {
+	uint32_t ms = elapsedUs / 1000;
+	if (ms > 0xffffff) {
+		ms = 0xffffff;
+	}
+	return (int)(((uint32_t)(index & 0xff) << 24) | ms);
+}
@@ -0,0 +1,130 @@
+#ifndef __LOOPPROFILER_H
+#define __LOOPPROFILER_H
+
+#include "Particle.h"
+
+#include "LogHistogram.h"
+#include "ModuleScheduler.h"
+
+// Number of modules that are measured, in the order they were added to the ModuleScheduler. Each
+// one uses 114 bytes of retained memory.
+#ifndef LOOP_PROFILER_MAX_MODULES
+#define LOOP_PROFILER_MAX_MODULES 8
+#endif
+
+// This structure is what's stored in retained memory (8 + 114 * LOOP_PROFILER_MAX_MODULES bytes)
+typedef struct {
+	uint32_t magic;
+	time_t lastSummarySecs; // Time.now() when the summary was last published
+	uint16_t slowCount[LOOP_PROFILER_MAX_MODULES]; // Calls that took longer than the slow threshold
+	LogHistogram latencyUs[LOOP_PROFILER_MAX_MODULES]; // Microseconds per call. count and maxValue are the calls and the longest one.
+} LoopProfilerRetainedData;
+
+// When a call to loop() started
+typedef struct {
+	uint32_t ticks; // System.ticks(), or micros() with LOOP_PROFILER_USE_MICROS
+	unsigned long ms; // millis()
+} LoopTimestamp;
+
+/**
+ * @brief Measures how long each module's loop() takes when run by ModuleScheduler
+ *
+ * Pass it to ModuleScheduler::withProfiler() and add it as a module too, so it can publish. Each
+ * call is timed with System.ticks(), the DWT cycle counter on the Electron, so short calls are
+ * measured to the microsecond for a few instructions each. The cycle counter wraps around every
+ * 35 seconds, so calls that take longer than LONG_CALL_MS, like a blocking Cellular.command(), are
+ * timed with millis() instead. Define LOOP_PROFILER_USE_MICROS to use micros() instead of
+ * System.ticks().
+ *
+ * For each module, the number of calls, the longest call and a histogram of the call times are
+ * kept in retained memory, so the calls leading up to a watchdog reset aren't lost. A module that's
+ * called more than 65535 times in one bucket has its histogram halved (LogHistogram::addScaled()),
+ * so the percentiles of a busy module don't drift towards the slow tail. Every 6 hours
+ * (withSummaryPeriod()) a summary is published at low priority and the statistics are cleared. For
+ * each module that was called, there's an entry like this, separated by semicolons:
+ *
+ * index:calls,maxUs,p50Us,p90Us,p99Us,slow
+ *
+ * index is the order the module was added to the ModuleScheduler, starting at 0. The percentiles
+ * are the lower bound of the histogram bucket, so they're within 33%. If it doesn't all fit in one
+ * publish it continues in the next.
+ *
+ * A call that takes longer than 1 second (withSlowThreshold()) also adds a SLOW_LOOP event with the
+ * module index and the time, up to MAX_SLOW_EVENTS of them per summary period. All of them are
+ * counted in slow.
+ */
+class LoopProfiler : public ScheduledModule {
+public:
+	LoopProfiler(const char *eventName = "loopStats");
+	virtual ~LoopProfiler();
+
+	void setup();
+	void loop();
+
+	unsigned long getMillisUntilNextLoop();
+
+	// How often to publish the summary, in seconds. 0 = never. Default: 6 hours.
+	inline LoopProfiler &withSummaryPeriod(time_t value) { summaryPeriodSecs = value; return *this; };
+
+	// Calls that take at least this long, in milliseconds, are slow. Default: 1000.
+	inline LoopProfiler &withSlowThreshold(unsigned long value) { slowThresholdMs = value; return *this; };
+
+	static inline LoopTimestamp start() {
+		LoopTimestamp ts;
+#ifdef LOOP_PROFILER_USE_MICROS
+		ts.ticks = micros();
+#else
+		ts.ticks = System.ticks();
+#endif
+		ts.ms = millis();
+		return ts;
+	};
+
+	// Microseconds since start
+	static inline uint32_t elapsedMicros(const LoopTimestamp &start) {
+		unsigned long ms = millis() - start.ms;
+		if (ms >= LONG_CALL_MS) {
+			return (ms < 0xffffffff / 1000) ? (uint32_t)(ms * 1000) : 0xffffffff;
+		}
+#ifdef LOOP_PROFILER_USE_MICROS
+		return micros() - start.ticks;
+#else
+		return (System.ticks() - start.ticks) / System.ticksPerMicrosecond();
+#endif
+	};
+
+	// Adds the time since start to the statistics of a module. Called by ModuleScheduler.
+	void finish(size_t index, const LoopTimestamp &start);
+
+	// Formats the summary entries starting at module index, and updates index to where the next
+	// publish should start. Returns false if there is nothing left to publish.
+	static bool formatSummary(size_t &index, char *buf, size_t bufSize);
+
+	// Packs the data of a CONNECTION_EVENT_SLOW_LOOP event: the time in milliseconds in bits 0-23,
+	// and the module index in bits 24-31
+	static int packSlowLoop(size_t index, uint32_t elapsedUs);
+
+	static inline const LoopProfilerRetainedData &getRetainedData() { return loopProfilerRetainedData; };
+
+	static const uint32_t LOOP_PROFILER_MAGIC = 0x1e0b5a01;
+	static const size_t MAX_MODULES = LOOP_PROFILER_MAX_MODULES;
+	static const unsigned long LONG_CALL_MS = 10000; // Longer calls are timed with millis()
+	static const size_t MAX_SLOW_EVENTS = 4; // SLOW_LOOP events per summary period
+	static const unsigned long SUMMARY_POLL_MS = 60000; // How often to check if it's time to publish the summary
+
+private:
+	void publishSummary();
+	void clear();
+
+	const char *eventName;
+	time_t summaryPeriodSecs = 6 * 3600;
+	unsigned long slowThresholdMs = 1000;
+	size_t slowEvents = 0; // SLOW_LOOP events added this summary period
+	bool publishing = false;
+	size_t publishIndex = 0; // Module of the next summary publish
+	unsigned long lastPublish = 0;
+
+	static LoopProfilerRetainedData loopProfilerRetainedData;
+};
+
+#endif /* __LOOPPROFILER_H */
@@ -0,0 +1,142 @@
+#include "ModuleScheduler.h"
+
+#include "HeartbeatWatchdog.h"
+#include "LoopProfiler.h"
+
+ModuleScheduler *ModuleScheduler::instance;
+
+void ScheduledModule::wake() {
+	ModuleScheduler *scheduler = ModuleScheduler::getInstance();
+	if (scheduler && schedulerIndex >= 0) {
+		ATOMIC_BLOCK() {
+			scheduler->wakeMask |= (1UL << schedulerIndex);
+		}
+	}
+}
+
+
+ModuleScheduler::ModuleScheduler() {
+	instance = this;
+	memset(wheel, 0, sizeof(wheel));
+}
+
+ModuleScheduler::~ModuleScheduler() {
+	for(size_t ii = 0; ii < numModules; ii++) {
+		modules[ii]->schedulerIndex = -1;
+	}
+	if (instance == this) {
+		instance = NULL;
+	}
+}
+
+bool ModuleScheduler::add(ScheduledModule &module) {
+	if (numModules >= MAX_MODULES) {
+		return false;
+	}
+	size_t index = numModules++;
+
+	modules[index] = &module;
+	module.schedulerIndex = (int) index;
+
+	// Everything runs the first time loop() is called
+	dueAt[index] = 0;
+	slotOf[index] = 0;
+	ATOMIC_BLOCK() {
+		wakeMask |= (1UL << index);
+	}
+	return true;
+}
+
+void ModuleScheduler::loop() {
+	// 32 bits like millis() on the device, so deadlines wrap the same way everywhere
+	uint32_t now = millis();
+	uint32_t nowTick = now / WHEEL_TICK_MS;
+
+	uint32_t due;
+	ATOMIC_BLOCK() {
+		due = wakeMask;
+		wakeMask = 0;
+	}
+
+	if (!started) {
+		started = true;
+		lastTick = nowTick;
+	}
+
+	// Check the slots for the ticks that have passed, including the current one as more modules may
+	// have become due in it since the last call. If we were away for more than a full revolution,
+	// just check every slot once.
+	uint32_t ticks = nowTick - lastTick + 1;
+	if (ticks > WHEEL_SLOTS) {
+		ticks = WHEEL_SLOTS;
+	}
+	for(uint32_t tt = 0; tt < ticks; tt++) {
+		size_t slot = (lastTick + tt) % WHEEL_SLOTS;
+		uint32_t mask = wheel[slot];
+		while(mask) {
+			size_t index = __builtin_ctz(mask);
+			mask &= mask - 1;
+
+			// Modules due in a later revolution of the wheel stay where they are
+			if ((int32_t)(now - dueAt[index]) >= 0) {
+				due |= (1UL << index);
+			}
+		}
+	}
+	lastTick = nowTick;
+
+	// Run them in the order they were added
+	while(due) {
+		size_t index = __builtin_ctz(due);
+		due &= due - 1;
+
+		wheel[slotOf[index]] &= ~(1UL << index);
+
+		if (watchdog) {
+			watchdog->moduleStarted(index);
+		}
+		if (profiler) {
+			LoopTimestamp start = LoopProfiler::start();
+			modules[index]->loop();
+			profiler->finish(index, start);
+		}
+		else {
+			modules[index]->loop();
+		}
+		if (watchdog) {
+			watchdog->moduleFinished();
+		}
+
+		schedule(index, millis(), modules[index]->getMillisUntilNextLoop());
+	}
+}
+
+unsigned long ModuleScheduler::getMillisUntilNextDeadline() const {
+	if (wakeMask) {
+		return 0;
+	}
+
+	uint32_t now = millis();
+	unsigned long result = 0xffffffff;
+	for(size_t ii = 0; ii < numModules; ii++) {
+		int32_t remaining = (int32_t)(dueAt[ii] - now);
+		if (remaining <= 0) {
+			return 0;
+		}
+		if ((unsigned long)remaining < result) {
+			result = remaining;
+		}
+	}
+	return result;
+}
+
+void ModuleScheduler::schedule(size_t index, uint32_t now, unsigned long delay) {
+	// Keep due times within the range of a signed comparison
+	if (delay > 0x7fffffff) {
+		delay = 0x7fffffff;
+	}
+	dueAt[index] = now + (uint32_t)delay;
+	slotOf[index] = (dueAt[index] / WHEEL_TICK_MS) % WHEEL_SLOTS;
+	wheel[slotOf[index]] |= (1UL << index);
+}
+
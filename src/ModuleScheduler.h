@@ -0,0 +1,108 @@
+#ifndef __MODULESCHEDULER_H
+#define __MODULESCHEDULER_H
+
+#include "Particle.h"
+
+class HeartbeatWatchdog;
+class LoopProfiler;
+
+/**
+ * @brief Base class for modules that can be run by ModuleScheduler
+ *
+ * All of the modules in this library are ScheduledModules. You can still call their loop() from
+ * your loop() yourself, in which case getMillisUntilNextLoop() is not used.
+ */
+class ScheduledModule {
+public:
+	virtual ~ScheduledModule() {};
+
+	virtual void loop() = 0;
+
+	// How long until loop() needs to be called again, in milliseconds. 0 means as soon as possible.
+	// Called by ModuleScheduler right after loop() returns.
+	virtual unsigned long getMillisUntilNextLoop() = 0;
+
+	// Makes ModuleScheduler call loop() as soon as possible, for example when an event arrives.
+	// Can be called from any thread.
+	void wake();
+
+	// Returned by getMillisUntilNextLoop() when there's nothing to do until wake() is called
+	static const unsigned long NOT_SCHEDULED = 0xffffffff;
+
+protected:
+	// Milliseconds left of a period that started at startMs (a millis() value), 0 if it has elapsed
+	static inline unsigned long millisUntil(unsigned long startMs, unsigned long periodMs) {
+		unsigned long elapsed = millis() - startMs;
+		return (elapsed < periodMs) ? (periodMs - elapsed) : 0;
+	};
+
+private:
+	friend class ModuleScheduler;
+	int schedulerIndex = -1;
+};
+
+/**
+ * @brief Runs modules only when they're due, instead of calling every module's loop() every time
+ *
+ * Each module reports how long until it next needs to run. The due times are kept in a timer wheel
+ * of WHEEL_SLOTS slots, WHEEL_TICK_MS apart. Each loop() only looks at the slots for the ticks that
+ * have passed since the last call, so the cost doesn't depend on how many modules are idle.
+ * Modules due more than one revolution of the wheel in the future stay in their slot until their
+ * time comes around.
+ *
+ * getMillisUntilNextDeadline() tells you how long until the next module is due, so your loop()
+ * can idle or do a low-power wait for that long.
+ */
+class ModuleScheduler {
+public:
+	ModuleScheduler();
+	virtual ~ModuleScheduler();
+
+	// Adds a module. It's run in the order added, the first time loop() is called. Returns false
+	// if there are already MAX_MODULES modules.
+	bool add(ScheduledModule &module);
+
+	inline ModuleScheduler &withModule(ScheduledModule &module) { add(module); return *this; };
+
+	// Times each module's loop() with the profiler. The modules are numbered in the order they were added.
+	inline ModuleScheduler &withProfiler(LoopProfiler &value) { profiler = &value; return *this; };
+
+	// Resets if a module's loop() doesn't return within its timeout. The watchdog's module channels
+	// are numbered in the order the modules were added.
+	inline ModuleScheduler &withWatchdog(HeartbeatWatchdog &value) { watchdog = &value; return *this; };
+
+	// Call from loop(). Runs the modules that are due.
+	void loop();
+
+	// Milliseconds until the next module is due, 0 if one is due now
+	unsigned long getMillisUntilNextDeadline() const;
+
+	static inline ModuleScheduler *getInstance() { return instance; };
+
+	static const size_t MAX_MODULES = 32;
+	static const size_t WHEEL_SLOTS = 32;
+	static const unsigned long WHEEL_TICK_MS = 32;
+
+private:
+	friend class ScheduledModule;
+
+	void schedule(size_t index, uint32_t now, unsigned long delay);
+
+	ScheduledModule *modules[MAX_MODULES];
+	uint32_t dueAt[MAX_MODULES]; // millis() value, compared as (int32_t)(a - b) so it wraps like on the device
+	uint8_t slotOf[MAX_MODULES];
+	size_t numModules = 0;
+
+	uint32_t wheel[WHEEL_SLOTS]; // Bit mask of the modules in each slot
+	uint32_t lastTick = 0; // millis() / WHEEL_TICK_MS
+	bool started = false;
+
+	volatile uint32_t wakeMask = 0; // Modules to run right away, set by ScheduledModule::wake()
+
+	LoopProfiler *profiler = NULL;
+	HeartbeatWatchdog *watchdog = NULL;
+
+	static ModuleScheduler *instance;
+};
+
+#endif /* __MODULESCHEDULER_H */
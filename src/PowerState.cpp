@@ -0,0 +1,89 @@
+#include "PowerState.h"
+
+#include "ConnectionEvents.h"
+
+retained PowerStateRetainedData PowerState::powerStateRetainedData;
+
+PowerState *PowerState::instance;
+
+// { enterSoC, sessionCheckMultiplier, batchFillBytes, batchMinHoldMs, pauseTesterPing, recoverySleepSec }
+static const PowerTierPolicy defaultPolicies[NUM_POWER_TIERS] = {
+	{ 100.0, 1, 0, 0, false, 0 },
+	{ 50.0, 2, 200, 5 * 60000, false, 0 },
+	{ 30.0, 4, 200, 15 * 60000, true, 30 * 60 },
+	{ 20.0, 8, 200, 60 * 60000, true, 2 * 3600 }
+};
+
+PowerState::PowerState() {
+	instance = this;
+
+	for(size_t ii = 0; ii < NUM_POWER_TIERS; ii++) {
+		policies[ii] = defaultPolicies[ii];
+	}
+}
+
+PowerState::~PowerState() {
+	if (instance == this) {
+		instance = NULL;
+	}
+}
+
+void PowerState::setup() {
+	if (powerStateRetainedData.magic != POWER_STATE_MAGIC || powerStateRetainedData.tier >= NUM_POWER_TIERS) {
+		memset(&powerStateRetainedData, 0, sizeof(powerStateRetainedData));
+		powerStateRetainedData.magic = POWER_STATE_MAGIC;
+	}
+}
+
+PowerState &PowerState::withPolicy(PowerTier tier, const PowerTierPolicy &policy) {
+	if (tier < NUM_POWER_TIERS) {
+		policies[tier] = policy;
+	}
+	return *this;
+}
+
+PowerState &PowerState::withThreshold(PowerTier tier, float enterSoC) {
+	if (tier < NUM_POWER_TIERS) {
+		policies[tier].enterSoC = enterSoC;
+	}
+	return *this;
+}
+
+void PowerState::update(float soc, bool onExternalPower) {
+	if (powerStateRetainedData.magic != POWER_STATE_MAGIC) {
+		// setup() hasn't been called yet
+		setup();
+	}
+
+	int oldTier = powerStateRetainedData.tier;
+	int tier = POWER_TIER_NORMAL;
+	if (!onExternalPower) {
+		// The lowest tier the SoC is below, counting the hysteresis for the tiers at or below the current one
+		for(int ii = NUM_POWER_TIERS - 1; ii > POWER_TIER_NORMAL; ii--) {
+			float threshold = policies[ii].enterSoC;
+			if (ii <= oldTier) {
+				threshold += hysteresis;
+			}
+			if (soc < threshold) {
+				tier = ii;
+				break;
+			}
+		}
+	}
+
+	if (tier != oldTier) {
+		powerStateRetainedData.tier = (uint8_t) tier;
+
+		int pct = (soc < 0.0) ? 0 : (soc > 255.0) ? 255 : (int)(soc + 0.5);
+		Log.info("power tier %d to %d at %d%%", oldTier, tier, pct);
+		ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_POWER_TIER, (pct << 16) | (oldTier << 8) | tier);
+	}
+}
+
+// static
+const PowerTierPolicy &PowerState::getPolicy() {
+	if (!instance || powerStateRetainedData.magic != POWER_STATE_MAGIC) {
+		return defaultPolicies[POWER_TIER_NORMAL];
+	}
+	return instance->policies[powerStateRetainedData.tier];
+}
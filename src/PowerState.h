@@ -0,0 +1,81 @@
+#ifndef __POWERSTATE_H
+#define __POWERSTATE_H
+
+#include "Particle.h"
+
+// Power tiers, from running normally to just hanging on. Each one has its own PowerTierPolicy.
+enum PowerTier {
+	POWER_TIER_NORMAL = 0,	// External power or a healthy battery
+	POWER_TIER_CONSERVE,	// Cut back on things that don't have to happen right away
+	POWER_TIER_LOW,			// Only what's needed to keep reporting
+	POWER_TIER_CRITICAL,	// About to go into low battery sleep
+	NUM_POWER_TIERS
+};
+
+// What the other modules do in a tier
+typedef struct {
+	float enterSoC; // The tier is entered when the SoC is below this (not used for POWER_TIER_NORMAL)
+	unsigned sessionCheckMultiplier; // SessionCheck check period is multiplied by this
+	size_t batchFillBytes; // ConnectionEvents batches to this size if it isn't already batching. 0 = no change.
+	unsigned long batchMinHoldMs; // ConnectionEvents holds events at least this long, unless they're high priority. 0 = no change.
+	bool pauseTesterPing; // Tester doesn't add TESTER_PING events
+	unsigned long recoverySleepSec; // ConnectionCheck sleeps at least this long instead of a modem reset recovery step. 0 = no change.
+} PowerTierPolicy;
+
+// This structure is what's stored in retained memory, so the tier and the hysteresis carry across deep sleep
+typedef struct {
+	uint32_t magic;
+	uint8_t tier;
+	uint8_t reserved[3];
+} PowerStateRetainedData;
+
+/**
+ * @brief Library-wide power tier, so the other modules can save power gradually as the battery drops
+ *
+ * BatteryCheck calls update() each time it reads the battery. The tier goes down as soon as the
+ * SoC is below the tier's enterSoC, and only goes back up once the SoC is above it by the
+ * hysteresis. With external power, unless the battery is draining anyway, it's POWER_TIER_NORMAL.
+ * Each change is logged as a POWER_TIER event.
+ *
+ * The other modules ask getPolicy() for the current tier's policy. If there's no PowerState
+ * object, that's the POWER_TIER_NORMAL default, which doesn't change anything.
+ */
+class PowerState {
+public:
+	PowerState();
+	virtual ~PowerState();
+
+	void setup();
+
+	// Sets the policy for a tier, including the SoC it starts at
+	PowerState &withPolicy(PowerTier tier, const PowerTierPolicy &policy);
+
+	// Sets just the SoC a tier starts at
+	PowerState &withThreshold(PowerTier tier, float enterSoC);
+
+	// How far above a tier's enterSoC the SoC has to be to go back up. Default: 3.0
+	inline PowerState &withHysteresis(float pct) { hysteresis = pct; return *this; };
+
+	// Called by BatteryCheck. onExternalPower is true when there's external power that's keeping up.
+	void update(float soc, bool onExternalPower);
+
+	inline PowerTier getTier() const { return (PowerTier) powerStateRetainedData.tier; };
+
+	inline const PowerTierPolicy &getTierPolicy(PowerTier tier) const { return policies[tier]; };
+
+	// The policy of the current tier, or the default POWER_TIER_NORMAL policy if there's no PowerState object
+	static const PowerTierPolicy &getPolicy();
+
+	static inline PowerState *getInstance() { return instance; };
+
+	static const uint32_t POWER_STATE_MAGIC = 0x6c0d2e01;
+
+private:
+	float hysteresis = 3.0;
+	PowerTierPolicy policies[NUM_POWER_TIERS];
+
+	static PowerStateRetainedData powerStateRetainedData;
+	static PowerState *instance;
+};
+
+#endif /* __POWERSTATE_H */
@@ -0,0 +1,217 @@
+
+#include "PublishScheduler.h"
+
+#include "ConnectionEvents.h"
+
+PublishScheduler *PublishScheduler::instance;
+
+PublishScheduler::PublishScheduler(size_t burst, unsigned long refillMs) : burst(burst), refillMs(refillMs), credit(burst * refillMs) {
+	instance = this;
+
+	for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+		queueStart[ii] = 0;
+		queueCount[ii] = 0;
+	}
+}
+
+PublishScheduler::~PublishScheduler() {
+	if (instance == this) {
+		instance = NULL;
+	}
+}
+
+void PublishScheduler::setup() {
+	lastRefill = millis();
+}
+
+// Sends queued publishes, highest priority first, as tokens become available
+void PublishScheduler::loop() {
+	refill();
+
+	while(hasToken() && Particle.connected()) {
+		size_t priority;
+		for(priority = 0; priority < NUM_PRIORITIES; priority++) {
+			if (queueCount[priority] > 0) {
+				break;
+			}
+		}
+		if (priority >= NUM_PRIORITIES) {
+			// Nothing queued
+			break;
+		}
+
+		QueuedPublish &qp = queues[priority][queueStart[priority]];
+		bool result = Particle.publish(qp.eventName, qp.data, qp.flags);
+		completedPublish();
+
+		CompletionCallback callback = qp.callback;
+		qp.callback = NULL;
+		queueStart[priority] = (queueStart[priority] + 1) % QUEUE_DEPTH;
+		queueCount[priority]--;
+
+		if (callback) {
+			callback(result);
+		}
+	}
+
+	setCongested(getQueuedCount() > 0);
+}
+
+unsigned long PublishScheduler::getMillisUntilNextLoop() {
+	if (getQueuedCount() == 0) {
+		// queue() calls wake()
+		return NOT_SCHEDULED;
+	}
+	if (!Particle.connected()) {
+		return DISCONNECTED_POLL_MS;
+	}
+	return getMillisUntilToken();
+}
+
+bool PublishScheduler::canPublish(Priority priority) {
+	refill();
+
+	if (!hasToken() || isQueuedAtOrAbove(priority)) {
+		// Would exceed the rate limit, or something more important is waiting
+		return false;
+	}
+	return Particle.connected();
+}
+
+void PublishScheduler::completedPublish() {
+	refill();
+	credit = (credit >= refillMs) ? (credit - refillMs) : 0;
+}
+
+unsigned long PublishScheduler::getMillisUntilToken() {
+	refill();
+	return hasToken() ? 0 : (refillMs - credit);
+}
+
+bool PublishScheduler::queue(Priority priority, const char *eventName, const char *data, PublishFlag flags, CompletionCallback callback) {
+	if (priority >= NUM_PRIORITIES) {
+		priority = PRIORITY_LOW;
+	}
+
+	if (canPublish(priority)) {
+		bool result = Particle.publish(eventName, data, flags);
+		completedPublish();
+		if (callback) {
+			callback(result);
+		}
+		return true;
+	}
+
+	if (queueCount[priority] >= QUEUE_DEPTH) {
+		Log.info("publish queue full, discarding %s", eventName);
+		droppedCount++;
+		setCongested(true);
+		return false;
+	}
+	if (strlen(eventName) >= MAX_EVENT_NAME || strlen(data) >= MAX_QUEUED_DATA) {
+		// Would have to be cut off, and a partial publish is worse than none
+		Log.info("too long to queue, discarding %s", eventName);
+		droppedCount++;
+		return false;
+	}
+
+	QueuedPublish &qp = queues[priority][(queueStart[priority] + queueCount[priority]) % QUEUE_DEPTH];
+	strcpy(qp.eventName, eventName);
+	strcpy(qp.data, data);
+	qp.flags = flags;
+	qp.callback = callback;
+	queueCount[priority]++;
+	wake();
+
+	setCongested(true);
+	return true;
+}
+
+bool PublishScheduler::addBackpressureCallback(BackpressureCallback callback) {
+	if (numBackpressureCallbacks >= MAX_BACKPRESSURE_CALLBACKS) {
+		return false;
+	}
+	backpressureCallbacks[numBackpressureCallbacks++] = callback;
+	return true;
+}
+
+size_t PublishScheduler::getQueuedCount() const {
+	size_t count = 0;
+	for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+		count += queueCount[ii];
+	}
+	return count;
+}
+
+// static
+bool PublishScheduler::publish(Priority priority, const char *eventName, const char *data, PublishFlag flags, CompletionCallback callback) {
+	if (instance) {
+		return instance->queue(priority, eventName, data, flags, callback);
+	}
+	else {
+		bool result = Particle.publish(eventName, data, flags);
+		if (callback) {
+			callback(result);
+		}
+		return result;
+	}
+}
+
+// static
+bool PublishScheduler::tryPublish(Priority priority, const char *eventName, const char *data, unsigned long &lastPublish) {
+	if (instance) {
+		if (!instance->canPublish(priority)) {
+			return false;
+		}
+	}
+	else
+	if (millis() - lastPublish < ConnectionEvents::PUBLISH_MIN_PERIOD_MS) {
+		return false;
+	}
+
+	bool result = Particle.publish(eventName, data, PRIVATE);
+	lastPublish = millis();
+	if (instance) {
+		instance->completedPublish();
+	}
+	return result;
+}
+
+// static
+unsigned long PublishScheduler::millisUntilCanPublish(unsigned long lastPublish) {
+	if (instance) {
+		return instance->getMillisUntilToken();
+	}
+	return millisUntil(lastPublish, ConnectionEvents::PUBLISH_MIN_PERIOD_MS);
+}
+
+void PublishScheduler::refill() {
+	unsigned long now = millis();
+	unsigned long elapsed = now - lastRefill;
+	unsigned long maxCredit = burst * refillMs;
+
+	lastRefill = now;
+	credit = (maxCredit - credit > elapsed) ? (credit + elapsed) : maxCredit;
+}
+
+bool PublishScheduler::hasToken() const {
+	return credit >= refillMs;
+}
+
+bool PublishScheduler::isQueuedAtOrAbove(Priority priority) const {
+	for(size_t ii = 0; ii <= (size_t)priority && ii < NUM_PRIORITIES; ii++) {
+		if (queueCount[ii] > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void PublishScheduler::setCongested(bool value) {
+	if (value != congested) {
+		congested = value;
+		for(size_t ii = 0; ii < numBackpressureCallbacks; ii++) {
+			backpressureCallbacks[ii](congested);
+		}
+	}
+}
@@ -0,0 +1,128 @@
+#ifndef __PUBLISHSCHEDULER_H
+#define __PUBLISHSCHEDULER_H
+
+#include "Particle.h"
+
+#include "ModuleScheduler.h"
+
+/**
+ * @brief Shares the Particle.publish rate limit between all of the modules
+ *
+ * The cloud allows an average of 1 publish per second with bursts of up to 4. Publishes over that
+ * are dropped. This keeps a token bucket with the same limits, so modules that publish through it
+ * never exceed the limit together.
+ *
+ * There are two ways to publish through the scheduler:
+ *
+ * - Modules that keep their own queue of data, like ConnectionEvents, ask canPublish() before
+ * publishing and call completedPublish() afterwards. canPublish() returns false while there's no
+ * token available or anything of the same or higher priority is queued (backpressure), so the
+ * module just keeps its data and tries again later. tryPublish() does all three for a module that
+ * formats one publish at a time and keeps it until it's been sent.
+ *
+ * - One-shot publishes, like the session end, use PublishScheduler::publish(). If a token is
+ * available it's published right away, otherwise it's copied into a small per-priority queue and
+ * published from loop(), highest priority first. Only an event name shorter than MAX_EVENT_NAME and
+ * data shorter than MAX_QUEUED_DATA can be queued.
+ *
+ * If there is no PublishScheduler object, PublishScheduler::publish() just calls Particle.publish()
+ * and the modules fall back to their own rate limiting, at most one publish every
+ * ConnectionEvents::PUBLISH_MIN_PERIOD_MS.
+ */
+class PublishScheduler : public ScheduledModule {
+public:
+	enum Priority {
+		PRIORITY_HIGH = 0,	// Session end, urgent events
+		PRIORITY_NORMAL,	// Connection event log, session check
+		PRIORITY_LOW,		// Periodic summaries
+		NUM_PRIORITIES
+	};
+
+	// Called when a queued publish is sent (true) or discarded (false)
+	typedef std::function<void(bool published)> CompletionCallback;
+
+	// Called with true when publishes start having to wait or being rejected, and false when
+	// they no longer are
+	typedef std::function<void(bool congested)> BackpressureCallback;
+
+	PublishScheduler(size_t burst = 4, unsigned long refillMs = 1000);
+	virtual ~PublishScheduler();
+
+	void setup();
+	void loop();
+
+	unsigned long getMillisUntilNextLoop();
+
+	// Returns true if a publish at this priority can be done now
+	bool canPublish(Priority priority = PRIORITY_NORMAL);
+
+	// Call after publishing when canPublish() returned true
+	void completedPublish();
+
+	// Milliseconds until the next token is available, 0 if there is one now
+	unsigned long getMillisUntilToken();
+
+	// Publishes now if possible, otherwise queues it. Returns false if the queue for this priority is
+	// full, or the event name or data is too long to queue; the publish is discarded and the caller
+	// should try again later.
+	bool queue(Priority priority, const char *eventName, const char *data, PublishFlag flags = PRIVATE, CompletionCallback callback = NULL);
+
+	// Adds a function to call when the congestion state changes. Up to MAX_BACKPRESSURE_CALLBACKS.
+	bool addBackpressureCallback(BackpressureCallback callback);
+
+	size_t getQueuedCount() const;
+	inline unsigned long getDroppedCount() const { return droppedCount; };
+
+	// Uses the scheduler if there is one, otherwise Particle.publish()
+	static bool publish(Priority priority, const char *eventName, const char *data, PublishFlag flags = PRIVATE, CompletionCallback callback = NULL);
+
+	// Publishes if the scheduler has a token for this priority, or, without a scheduler, if
+	// lastPublish (a millis() value) was at least PUBLISH_MIN_PERIOD_MS ago, and updates lastPublish.
+	// Returns false if it wasn't time yet or the publish failed; either way, try the same data
+	// again later.
+	static bool tryPublish(Priority priority, const char *eventName, const char *data, unsigned long &lastPublish);
+
+	// Milliseconds until tryPublish() could publish, for getMillisUntilNextLoop()
+	static unsigned long millisUntilCanPublish(unsigned long lastPublish);
+
+	static inline PublishScheduler *getInstance() { return instance; };
+
+	static const size_t QUEUE_DEPTH = 2; // Per priority
+	static const size_t MAX_EVENT_NAME = 64; // Including the null terminator
+	static const size_t MAX_QUEUED_DATA = 64; // Including the null terminator
+	static const size_t MAX_BACKPRESSURE_CALLBACKS = 4;
+	static const unsigned long DISCONNECTED_POLL_MS = 1000; // How often to check for a cloud connection when there are queued publishes
+
+private:
+	typedef struct {
+		char eventName[MAX_EVENT_NAME];
+		char data[MAX_QUEUED_DATA];
+		PublishFlag flags;
+		CompletionCallback callback;
+	} QueuedPublish;
+
+	void refill();
+	bool hasToken() const;
+	bool isQueuedAtOrAbove(Priority priority) const;
+	void setCongested(bool value);
+
+	size_t burst;
+	unsigned long refillMs;
+
+	// Token bucket, in milliseconds. Each token is worth refillMs and the bucket holds burst tokens.
+	unsigned long credit;
+	unsigned long lastRefill = 0;
+
+	QueuedPublish queues[NUM_PRIORITIES][QUEUE_DEPTH];
+	size_t queueStart[NUM_PRIORITIES];
+	size_t queueCount[NUM_PRIORITIES];
+
+	BackpressureCallback backpressureCallbacks[MAX_BACKPRESSURE_CALLBACKS];
+	size_t numBackpressureCallbacks = 0;
+	bool congested = false;
+	unsigned long droppedCount = 0;
+
+	static PublishScheduler *instance;
+};
+
+#endif /* __PUBLISHSCHEDULER_H */
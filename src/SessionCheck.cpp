@@ -1,12 +1,16 @@
 
 #include "SessionCheck.h"
+#include "Breadcrumbs.h"
 #include "ConnectionCheck.h"
+#include "PowerState.h"
+#include "PublishScheduler.h"
 
 retained SessionRetainedData SessionCheck::sessionRetainedData;
 
 
-SessionCheck::SessionCheck(time_t checkPeriodSecs, const char *eventSuffix) : checkPeriodSecs(checkPeriodSecs) {
+SessionCheck::SessionCheck(time_t checkPeriodSecs, const char *eventSuffix) : minPeriodSecs(checkPeriodSecs), maxPeriodSecs(checkPeriodSecs) {
 	eventName = System.deviceID() + "/" + eventSuffix;
+	memset(probes, 0, sizeof(probes));
 }
 
 SessionCheck::~SessionCheck() {
@@ -15,8 +19,18 @@ SessionCheck::~SessionCheck() {
 
 void SessionCheck::setup() {
 	if (sessionRetainedData.magic != SESSION_MAGIC) {
-		sessionRetainedData.magic = SESSION_MAGIC;
 		sessionRetainedData.lastCheckSecs = 0;
+		sessionRetainedData.failureHistory = 0;
+		sessionRetainedData.nextSeq = 1;
+		sessionRetainedData.rttAverageMs = 0;
+		sessionRetainedData.rttMinMs = 0;
+		sessionRetainedData.rttMaxMs = 0;
+		sessionRetainedData.lossRate = 0;
+		sessionRetainedData.probesSent = 0;
+		sessionRetainedData.probesReceived = 0;
+
+		// Set last, as reportCloudActivity() doesn't touch lastCheckSecs until it's valid
+		sessionRetainedData.magic = SESSION_MAGIC;
 	}
 
 
@@ -27,8 +41,106 @@ void SessionCheck::loop() {
 	stateHandler(*this);
 }
 
+unsigned long SessionCheck::getMillisUntilNextLoop() {
+	// Each probe that comes back calls wake()
+	return millisUntil(stateTime, stateWaitMs);
+}
+
+SessionCheck &SessionCheck::withCheckPeriodRange(time_t minSecs, time_t maxSecs) {
+	minPeriodSecs = minSecs;
+	maxPeriodSecs = (maxSecs > minSecs) ? maxSecs : minSecs;
+	return *this;
+}
+
+SessionCheck &SessionCheck::withProbeCount(size_t count) {
+	if (count < 1) {
+		count = 1;
+	}
+	if (count > MAX_PROBES) {
+		count = MAX_PROBES;
+	}
+	probeCount = count;
+	return *this;
+}
+
+SessionCheck &SessionCheck::withLatencyThreshold(unsigned long ms) {
+	latencyThresholdMs = ms;
+	return *this;
+}
+
+time_t SessionCheck::getCheckPeriod() const {
+	uint32_t recent = sessionRetainedData.failureHistory & ((1UL << HISTORY_LENGTH) - 1);
+
+	time_t period = maxPeriodSecs >> __builtin_popcount(recent);
+	if (period < minPeriodSecs) {
+		period = minPeriodSecs;
+	}
+
+	// Stretched out when saving power
+	return period * PowerState::getPolicy().sessionCheckMultiplier;
+}
+
+// static
+void SessionCheck::reportCloudActivity() {
+	// Can be called from another thread, and time_t isn't necessarily written in one store
+	if (sessionRetainedData.magic == SESSION_MAGIC && Time.isValid()) {
+		time_t now = Time.now();
+		ATOMIC_BLOCK() {
+			sessionRetainedData.lastCheckSecs = now;
+		}
+	}
+}
+
+// static
+int SessionCheck::packProbeResult(unsigned avgRttMs, unsigned lossPercent, unsigned received, unsigned sent) {
+	if (avgRttMs > 0xffff) {
+		avgRttMs = 0xffff;
+	}
+	return (int)((avgRttMs & 0xffff) | ((lossPercent & 0xff) << 16) | ((received & 0xf) << 24) | ((sent & 0xf) << 28));
+}
+
 void SessionCheck::subscriptionHandler(const char *eventName, const char *data) {
-	gotResponse = true;
+	// The data is "seq,millis" from sendProbe(). Anything else, including a probe from a check that
+	// has already finished, is ignored.
+	unsigned long seq, sentMs;
+	if (sscanf(data, "%lu,%lu", &seq, &sentMs) != 2) {
+		return;
+	}
+
+	for(size_t ii = 0; ii < MAX_PROBES; ii++) {
+		SessionProbe &probe = probes[ii];
+		if (probe.inFlight && probe.seq == seq && probe.sentMs == sentMs) {
+			probe.inFlight = false;
+
+			unsigned long rttMs = millis() - sentMs;
+			checkReceived++;
+			checkRttSum += rttMs;
+			addRttSample(rttMs);
+
+			wake();
+			break;
+		}
+	}
+}
+
+void SessionCheck::addToHistory(bool failed) {
+	sessionRetainedData.failureHistory = (sessionRetainedData.failureHistory << 1) | (failed ? 1 : 0);
+}
+
+void SessionCheck::addRttSample(unsigned long rttMs) {
+	if (sessionRetainedData.probesReceived++ == 0) {
+		sessionRetainedData.rttAverageMs = sessionRetainedData.rttMinMs = sessionRetainedData.rttMaxMs = rttMs;
+		return;
+	}
+
+	long average = (long)sessionRetainedData.rttAverageMs;
+	sessionRetainedData.rttAverageMs = (uint32_t)(average + ((long)rttMs - average) / 8);
+	if (rttMs < sessionRetainedData.rttMinMs) {
+		sessionRetainedData.rttMinMs = rttMs;
+	}
+	if (rttMs > sessionRetainedData.rttMaxMs) {
+		sessionRetainedData.rttMaxMs = rttMs;
+	}
 }
 
 void SessionCheck::waitToSendState() {
@@ -51,64 +163,191 @@ void SessionCheck::waitToSendState() {
 
 	time_t now = Time.now();
 
-	if (now - sessionRetainedData.lastCheckSecs < checkPeriodSecs) {
-		// Not time to check yet
+	// reportCloudActivity() can change lastCheckSecs from another thread
+	time_t lastCheckSecs;
+	ATOMIC_BLOCK() {
+		lastCheckSecs = sessionRetainedData.lastCheckSecs;
+	}
+	if (now - lastCheckSecs < getCheckPeriod()) {
+		// Not time to check yet, or the session was recently confirmed by reportCloudActivity()
 		return;
 	}
 
 	// Time to check again
-	sessionRetainedData.lastCheckSecs = now;
+	ATOMIC_BLOCK() {
+		sessionRetainedData.lastCheckSecs = now;
+	}
 	numFailures = 0;
 
-	sendEvent();
+	startCheck();
 }
 
-void SessionCheck::sendEvent() {
+void SessionCheck::startCheck() {
+	Breadcrumbs::mark(BREADCRUMB_SESSION_START_CHECK);
+
+	for(size_t ii = 0; ii < MAX_PROBES; ii++) {
+		probes[ii].inFlight = false;
+	}
+	probesToSend = probeCount;
+	checkSent = checkReceived = 0;
+	checkRttSum = 0;
+	checkStartMs = millis();
 
-	gotResponse = false;
 	stateHandler = &SessionCheck::waitForResponseState;
-	stateTime = millis();
+	sendProbe();
+}
 
-	Log.info("publishing session check event %s", eventName.c_str());
+void SessionCheck::sendProbe() {
+	Breadcrumbs::mark(BREADCRUMB_SESSION_SEND_PROBE);
+
+	if (!Particle.connected() || millis() - checkStartMs >= RECEIVE_TIMEOUT_MS) {
+		// Can't send the rest of the probes. They're not counted as sent, so they aren't lost either.
+		Log.info("session check gave up on %u probes", (unsigned)probesToSend);
+		probesNotSent += probesToSend;
+		probesToSend = 0;
+		stateTime = millis();
+		stateWaitMs = RECEIVE_TIMEOUT_MS;
+		return;
+	}
+
+	PublishScheduler *scheduler = PublishScheduler::getInstance();
+	if (scheduler && !scheduler->canPublish(PublishScheduler::PRIORITY_NORMAL)) {
+		// Publish directly once there's a token, instead of queueing, so the time spent waiting
+		// isn't counted in the round trip time
+		unsigned long waitMs = scheduler->getMillisUntilToken();
+		stateTime = millis();
+		stateWaitMs = (waitMs > PUBLISH_POLL_MS) ? waitMs : PUBLISH_POLL_MS;
+		return;
+	}
+
+	SessionProbe &probe = probes[checkSent];
+	probe.seq = sessionRetainedData.nextSeq++;
+	probe.sentMs = millis();
+
+	char data[24];
+	snprintf(data, sizeof(data), "%lu,%lu", (unsigned long)probe.seq, probe.sentMs);
+
+	Log.info("publishing session check event %s %s", eventName.c_str(), data);
 
 	// Post our event
-	Particle.publish(eventName, "", PRIVATE);
+	bool result = Particle.publish(eventName.c_str(), data, PRIVATE);
+	if (scheduler) {
+		scheduler->completedPublish();
+	}
+	probesToSend--;
+
+	if (result) {
+		probe.inFlight = true;
+		checkSent++;
+		sessionRetainedData.probesSent++;
+	}
+	else {
+		// Never went out, so don't wait for it. The next probe reuses the slot.
+		probesNotSent++;
+	}
+
+	// Wait until the next probe is due, or for the responses after the last one
+	stateTime = millis();
+	stateWaitMs = (probesToSend > 0) ? PROBE_SPACING_MS : RECEIVE_TIMEOUT_MS;
 }
 
 void SessionCheck::waitForResponseState() {
-	if (gotResponse) {
-		// Success
+	if (probesToSend > 0) {
+		if (millis() - stateTime >= stateWaitMs) {
+			sendProbe();
+		}
+		return;
+	}
+
+	if (checkReceived < checkSent && millis() - stateTime < RECEIVE_TIMEOUT_MS) {
+		// Waiting still
+		return;
+	}
+
+	finishCheck();
+}
+
+void SessionCheck::finishCheck() {
+	Breadcrumbs::mark(BREADCRUMB_SESSION_FINISH_CHECK);
+
+	if (checkSent == 0) {
+		// None of the probes could be published, so this says nothing about the session. Try again
+		// on the next pass through waitToSendState() instead of waiting a whole check period.
+		ATOMIC_BLOCK() {
+			sessionRetainedData.lastCheckSecs = 0;
+		}
 		stateHandler = &SessionCheck::waitToSendState;
 		stateTime = millis();
+		stateWaitMs = CHECK_PERIOD_MS;
+		return;
 	}
 
-	if (millis() - stateTime < RECEIVE_TIMEOUT_MS) {
-		// Waiting still
+	size_t lost = checkSent - checkReceived;
+	for(size_t ii = 0; ii < checkSent; ii++) {
+		// Move the loss rate 1/8 of the way towards 0 (received) or 65536 (lost)
+		long target = (ii < lost) ? 65536 : 0;
+		long lossRate = (long)sessionRetainedData.lossRate;
+		sessionRetainedData.lossRate = (uint32_t)(lossRate + (target - lossRate) / 8);
+
+		probes[ii].inFlight = false;
+	}
+
+	if (checkReceived == 0) {
+		// Failed to receive any of the events
+		ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_SESSION_EVENT_LOST);
+		checkFailed();
+		return;
+	}
+
+	// The session works, but may be slow or losing events
+	unsigned long avgRttMs = checkRttSum / checkReceived;
+	bool tooSlow = (latencyThresholdMs != 0 && avgRttMs > latencyThresholdMs);
+	if (lost > 0 || tooSlow) {
+		ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_SESSION_DEGRADED,
+				packProbeResult(avgRttMs, getLossPercent(), checkReceived, checkSent));
+	}
+	if (tooSlow) {
+		checkFailed();
 		return;
 	}
 
-	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_SESSION_EVENT_LOST);
+	// Success
+	addToHistory(false);
+	stateHandler = &SessionCheck::waitToSendState;
+	stateTime = millis();
+	stateWaitMs = CHECK_PERIOD_MS;
+}
+
+void SessionCheck::checkFailed() {
+	Breadcrumbs::mark(BREADCRUMB_SESSION_CHECK_FAILED);
+
+	addToHistory(true);
 
-	// Failed to receive event
 	if (++numFailures < NUM_FAILURES_BEFORE_RESET_SESSION) {
-		// Try sending again just in case
-		sendEvent();
+		// Try again just in case
+		startCheck();
 		return;
 	}
 
 	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_SESSION_RESET);
+	Breadcrumbs::mark(BREADCRUMB_SESSION_RESET);
 
 	// Too many tries, reset the session
-	Particle.publish("spark/device/session/end", "", PRIVATE);
-
-	delay(2000);
+	PublishScheduler::publish(PublishScheduler::PRIORITY_HIGH, "spark/device/session/end", "", PRIVATE);
 
 	// Reset the whole device just in case. If ConnectionCheck is present, do a full modem reset,
 	// otherwise just reset.
 	if (ConnectionCheck::getInstance()) {
+		// The modem reset is done from ConnectionCheck::loop(), and it waits for the session end
+		// to be published first. Go back to waiting; the device will go into deep sleep.
 		ConnectionCheck::getInstance()->fullModemReset();
+
+		stateHandler = &SessionCheck::waitToSendState;
+		stateTime = millis();
+		stateWaitMs = CHECK_PERIOD_MS;
 	}
 	else {
+		delay(2000);
 		System.reset();
 	}
 }
@@ -2,15 +2,31 @@
 #define __SESSIONCHECK_H
 
 #include "ConnectionEvents.h"
+#include "ModuleScheduler.h"
 
 // This structure is what's stored in retained memory
 typedef struct {
 	uint32_t magic;
-	time_t lastCheckSecs;
+	time_t lastCheckSecs; // Last check, or last time reportCloudActivity() was called. Access inside ATOMIC_BLOCK().
+	uint32_t failureHistory; // One bit per check, most recent in bit 0, 1 = the check failed
+	uint32_t nextSeq; // Sequence number of the next probe, continues across resets
+	uint32_t rttAverageMs; // Moving average (EWMA) of the round trip time
+	uint32_t rttMinMs;
+	uint32_t rttMaxMs;
+	uint32_t lossRate; // Moving average (EWMA) of the fraction of probes lost, 65536 = all of them
+	uint32_t probesSent;
+	uint32_t probesReceived;
 } SessionRetainedData;
 
+// A probe event that has been sent and not received back yet
+typedef struct {
+	uint32_t seq;
+	unsigned long sentMs; // millis() value
+	bool inFlight;
+} SessionProbe;
+
 
-class SessionCheck {
+class SessionCheck : public ScheduledModule {
 public:
 	SessionCheck(time_t checkPeriodSecs, const char *eventSuffix = "sessionCheck");
 	virtual ~SessionCheck();
@@ -18,22 +34,85 @@ public:
 	void setup();
 	void loop();
 
+	unsigned long getMillisUntilNextLoop();
+
+	// Lets the check period adapt between minSecs and maxSecs. With no recent failures, checks are
+	// maxSecs apart, and the period is halved for each of the last HISTORY_LENGTH checks that failed,
+	// down to minSecs. By default both are the checkPeriodSecs passed to the constructor.
+	SessionCheck &withCheckPeriodRange(time_t minSecs, time_t maxSecs);
+
+	// The current check period in seconds, based on the recent failure history and multiplied by
+	// the PowerState policy's sessionCheckMultiplier
+	time_t getCheckPeriod() const;
+
+	// Number of probe events to send for each check, PROBE_SPACING_MS apart, 1 to MAX_PROBES. Each one
+	// carries a sequence number and the time it was sent, so the round trip time can be measured.
+	// The check only fails if none of them come back. Default: 1
+	SessionCheck &withProbeCount(size_t count);
+
+	// If the average round trip time of a check is more than this, the check counts as failed even
+	// though the events came back, so a session that's too slow to use gets reset. 0 (the default)
+	// never fails a check because of latency.
+	SessionCheck &withLatencyThreshold(unsigned long ms);
+
+	// Statistics over all checks, kept in retained memory. The averages move 1/8 of the way towards
+	// each new value.
+	inline unsigned long getRttAverage() const { return sessionRetainedData.rttAverageMs; };
+	inline unsigned long getRttMin() const { return sessionRetainedData.rttMinMs; };
+	inline unsigned long getRttMax() const { return sessionRetainedData.rttMaxMs; };
+	inline unsigned getLossPercent() const { return (unsigned)((sessionRetainedData.lossRate * 100 + 32768) >> 16); };
+
+	static inline const SessionRetainedData &getRetainedData() { return sessionRetainedData; };
+
+	// Probes that were never published, because the publish failed, the cloud disconnected or no
+	// publish token came up within RECEIVE_TIMEOUT_MS. They aren't counted as sent or lost.
+	inline unsigned long getProbesNotSent() const { return probesNotSent; };
+
+	// Packs the result of a check into the data of a CONNECTION_EVENT_SESSION_DEGRADED event:
+	// average RTT in ms in bits 0-15, loss rate percent in 16-23, received in 24-27, sent in 28-31
+	static int packProbeResult(unsigned avgRttMs, unsigned lossPercent, unsigned received, unsigned sent);
+
+	// Call this when something arrives from the cloud, for example from your own subscription
+	// handler or function handler. It proves the session works, so the next check is put off
+	// for a full check period. Only use it for data that came from the cloud; a successful publish
+	// doesn't prove that events can be received. Can be called from any thread.
+	static void reportCloudActivity();
+
 	void subscriptionHandler(const char *eventName, const char *data);
 
-	static const uint32_t SESSION_MAGIC = 0x4a6849fe;
+	static const uint32_t SESSION_MAGIC = 0x4a684a00;
 	static const unsigned long CHECK_PERIOD_MS = 30000; // How often to do more intensive checks
-	static const unsigned long RECEIVE_TIMEOUT_MS = 45000; // 45 seconds
+	static const unsigned long RECEIVE_TIMEOUT_MS = 45000; // 45 seconds after the last probe is sent
+	static const unsigned long PROBE_SPACING_MS = 1100; // Time between probes of the same check
+	static const unsigned long PUBLISH_POLL_MS = 100; // How often to check for a publish token when a probe is due
+	static const size_t MAX_PROBES = 4;
 	static const int NUM_FAILURES_BEFORE_RESET_SESSION = 2;
+	static const int HISTORY_LENGTH = 8; // Number of recent checks that affect the check period
 
 private:
 	void waitToSendState();
-	void sendEvent();
+	void startCheck();
+	void sendProbe();
 	void waitForResponseState();
+	void finishCheck();
+	void checkFailed();
+	void addToHistory(bool failed);
+	void addRttSample(unsigned long rttMs);
 
-	time_t checkPeriodSecs;
+	time_t minPeriodSecs;
+	time_t maxPeriodSecs;
 	String eventName;
 	unsigned long stateTime = 0; // millis() value
-	bool gotResponse = false;
+	unsigned long stateWaitMs = CHECK_PERIOD_MS; // How long the current state waits after stateTime
+	size_t probeCount = 1;
+	unsigned long latencyThresholdMs = 0;
+	SessionProbe probes[MAX_PROBES];
+	size_t probesToSend = 0; // Probes of the current check not sent yet
+	size_t checkSent = 0;
+	size_t checkReceived = 0;
+	unsigned long checkRttSum = 0;
+	unsigned long checkStartMs = 0; // millis() value
+	unsigned long probesNotSent = 0;
 	int numFailures = 0;
 	std::function<void(SessionCheck&)> stateHandler = &SessionCheck::waitToSendState;
 
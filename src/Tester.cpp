@@ -4,9 +4,13 @@
 
 #include "ConnectionCheck.h"
 #include "ConnectionEvents.h"
+#include "PowerState.h"
+#include "PublishScheduler.h"
+#include "SessionCheck.h"
 
 Tester::Tester(const char *functionName, int sleepTestPin) :
-	functionName(functionName), sleepTestPin(sleepTestPin) {
+	functionName(functionName), sleepTestPin(sleepTestPin),
+	commandHead(0), commandTail(0), commandMaxDepth(0), commandOverflows(0) {
 
 }
 
@@ -24,33 +28,107 @@ void Tester::setup() {
 
 void Tester::loop() {
 
-	if (functionData) {
-		processOptions(functionData);
-		free(functionData);
-		functionData = NULL;
+	uint32_t tail = commandTail.load(std::memory_order_relaxed);
+	while(tail != commandHead.load(std::memory_order_acquire)) {
+		// The slot belongs to us until commandTail moves past it, so it can be parsed in place
+		processOptions(commandSlots[tail % COMMAND_QUEUE_SIZE]);
+		commandTail.store(++tail, std::memory_order_release);
+	}
+
+	if (commandOverflows.load(std::memory_order_relaxed) != reportedOverflows) {
+		reportCommandQueue();
 	}
 
 	if (pingInterval > 0) {
 		if (millis() - lastPing >= (unsigned long) (pingInterval * 1000)) {
 			lastPing = millis();
 
-			ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_PING, ++pingCounter);
+			// Paused while saving power. It keeps its schedule, so it picks up again when the tier goes back up.
+			if (!PowerState::getPolicy().pauseTesterPing) {
+				ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_PING, ++pingCounter);
+			}
 		}
 	}
+
+	if (loadMode != LOAD_IDLE) {
+		loadLoop();
+	}
 }
 
+unsigned long Tester::getMillisUntilNextLoop() {
+	if (getCommandQueueDepth() > 0) {
+		return 0;
+	}
+
+	unsigned long result = NOT_SCHEDULED; // functionHandler() calls wake()
+	if (pingInterval > 0) {
+		result = millisUntil(lastPing, (unsigned long) (pingInterval * 1000));
+	}
+
+	unsigned long loadMs = NOT_SCHEDULED;
+	switch(loadMode) {
+	case LOAD_RATE: {
+		// When the next event is due, or the end of the run
+		unsigned long nextMs = (unsigned long)((uint64_t)loadAdded * 1000 / loadRate);
+		loadMs = millisUntil(loadStartMs, (nextMs < loadDurationMs) ? nextMs : loadDurationMs);
+		break;
+	}
+	case LOAD_FLOOD:
+		loadMs = LOAD_FLOOD_POLL_MS;
+		break;
+
+	case LOAD_DRAIN:
+		loadMs = LOAD_DRAIN_POLL_MS;
+		break;
+
+	default:
+		break;
+	}
+	return (loadMs < result) ? loadMs : result;
+}
 
 // This is the function registered with Particle.function(). Just copy the data and return so
 // the successful response can be returned to the caller. Since we do things like reset, or
 // enter an infinite loop, or sleep, doing this right from the callback causes the caller to
 // time out because the response will never be received.
 int Tester::functionHandler(String argStr) {
+	// The function call came from the cloud, so the session is working
+	SessionCheck::reportCloudActivity();
+
 	// Process this in loop so the function won't time out
-	functionData = strdup(argStr.c_str());
+	uint32_t head = commandHead.load(std::memory_order_relaxed);
+	uint32_t depth = head - commandTail.load(std::memory_order_acquire);
+	if (depth >= COMMAND_QUEUE_SIZE) {
+		// Full. loop() reports this as a TESTER_QUEUE event.
+		commandOverflows.fetch_add(1, std::memory_order_relaxed);
+		wake();
+		return -1;
+	}
+
+	snprintf(commandSlots[head % COMMAND_QUEUE_SIZE], COMMAND_MAX_LEN, "%s", argStr.c_str());
+	commandHead.store(head + 1, std::memory_order_release);
+
+	if (depth + 1 > commandMaxDepth.load(std::memory_order_relaxed)) {
+		commandMaxDepth.store(depth + 1, std::memory_order_relaxed);
+	}
+	wake();
 
 	return 0;
 }
 
+size_t Tester::getCommandQueueDepth() const {
+	return commandHead.load(std::memory_order_acquire) - commandTail.load(std::memory_order_acquire);
+}
+
+// Adds a TESTER_QUEUE event: the most commands that have been queued at once in bits 0-7, and the
+// number dropped because the queue was full in bits 8-31
+void Tester::reportCommandQueue() {
+	reportedOverflows = commandOverflows.load(std::memory_order_relaxed);
+
+	uint32_t maxDepth = commandMaxDepth.load(std::memory_order_relaxed);
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_QUEUE, (int)((reportedOverflows << 8) | (maxDepth & 0xff)));
+}
+
 // This does the actual work from the Particle.function(). It's called from looo().
 void Tester::processOptions(char *mutableData) {
 	// Parse argument into space-separated fields
@@ -80,6 +158,8 @@ void Tester::processOptions(char *mutableData) {
 	if (strcmp(argv[0], "modemReset") == 0) {
 		if (ConnectionCheck::getInstance()) {
 			ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_RESET_MODEM);
+
+			// Returns right away, the reset is done from ConnectionCheck::loop()
 			ConnectionCheck::getInstance()->fullModemReset();
 		}
 		else {
@@ -90,7 +170,7 @@ void Tester::processOptions(char *mutableData) {
 	else
 	if (strcmp(argv[0], "resetSession") == 0) {
 		ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_RESET_SESSION);
-		Particle.publish("spark/device/session/end", "", PRIVATE);
+		PublishScheduler::publish(PublishScheduler::PRIORITY_HIGH, "spark/device/session/end", "", PRIVATE);
 	}
 	else
 	if (strcmp(argv[0], "safeMode") == 0) {
@@ -174,5 +254,149 @@ void Tester::processOptions(char *mutableData) {
 		}
 
 	}
+	else
+	if (strcmp(argv[0], "queue") == 0) {
+		// particle call electron2 testerFn queue
+		reportCommandQueue();
+	}
+	else
+	if (strcmp(argv[0], "load") == 0 && argc >= 2) {
+		loadCommand(argc, argv);
+	}
+
+}
+
+// Load generation for measuring the throughput and drop rate of the connection event log.
+// example usage from the Particle CLI:
+// particle call electron2 testerFn "load burst 200"
+// particle call electron2 testerFn "load rate 2 600"
+// particle call electron2 testerFn "load flood 300"
+// particle call electron2 testerFn "load stop"
+void Tester::loadCommand(size_t argc, const char **argv) {
+	ConnectionEvents *connectionEvents = ConnectionEvents::getInstance();
+	if (!connectionEvents) {
+		return;
+	}
+
+	// optional duration in seconds, default is 60
+	unsigned long durationSecs = 60;
+
+	if (strcmp(argv[1], "burst") == 0) {
+		// Adds all of the events right away
+		unsigned long count = (argc >= 3) ? strtoul(argv[2], NULL, 10) : 100;
+		if (count > LOAD_MAX_EVENTS) {
+			count = LOAD_MAX_EVENTS;
+		}
+		startLoad(LOAD_DRAIN, 0);
+		for(unsigned long ii = 0; ii < count; ii++) {
+			addLoadEvent();
+		}
+	}
+	else
+	if (strcmp(argv[1], "rate") == 0 && argc >= 3) {
+		// Events per second, then the optional duration
+		loadRate = strtoul(argv[2], NULL, 10);
+		if (loadRate == 0) {
+			return;
+		}
+		if (loadRate > LOAD_MAX_RATE) {
+			loadRate = LOAD_MAX_RATE;
+		}
+		if (argc >= 4) {
+			durationSecs = strtoul(argv[3], NULL, 10);
+		}
+		startLoad(LOAD_RATE, durationSecs * 1000);
+	}
+	else
+	if (strcmp(argv[1], "flood") == 0) {
+		if (argc >= 3) {
+			durationSecs = strtoul(argv[2], NULL, 10);
+		}
+		startLoad(LOAD_FLOOD, durationSecs * 1000);
+	}
+	else
+	if (strcmp(argv[1], "stop") == 0) {
+		if (loadMode == LOAD_RATE || loadMode == LOAD_FLOOD) {
+			loadMode = LOAD_DRAIN;
+			loadStartMs = millis();
+		}
+	}
+}
+
+void Tester::startLoad(LoadMode mode, unsigned long durationMs) {
+	if (durationMs > LOAD_MAX_SECS * 1000) {
+		durationMs = LOAD_MAX_SECS * 1000;
+	}
+
+	// The counters at the end are reported relative to these
+	loadStartStats = ConnectionEvents::getInstance()->getStats();
+	loadMode = mode;
+	loadStartMs = millis();
+	loadDurationMs = durationMs;
+	loadAdded = 0;
+
+	Log.info("load test mode=%d duration=%lu rate=%lu", mode, durationMs, loadRate);
+}
+
+void Tester::loadLoop() {
+	ConnectionEvents *connectionEvents = ConnectionEvents::getInstance();
+	if (!connectionEvents) {
+		loadMode = LOAD_IDLE;
+		return;
+	}
+
+	unsigned long elapsed = millis() - loadStartMs;
+
+	if (loadMode == LOAD_RATE || loadMode == LOAD_FLOOD) {
+		if (elapsed >= loadDurationMs) {
+			// Done adding events, now wait for them to be sent
+			loadMode = LOAD_DRAIN;
+			loadStartMs = millis();
+			return;
+		}
+
+		if (loadMode == LOAD_RATE) {
+			// Catch up to where we should be, in case loop() was late. The first event is added right away.
+			uint64_t target = (uint64_t)elapsed * loadRate / 1000 + 1;
+			while(loadAdded < target) {
+				addLoadEvent();
+			}
+		}
+		else {
+			// Keep the retained log full
+			while(connectionEvents->getEventCount() < CONNECTION_EVENTS_MAX_EVENTS) {
+				addLoadEvent();
+			}
+		}
+	}
+	else
+	if (loadMode == LOAD_DRAIN) {
+		if (connectionEvents->getEventCount() == 0 || elapsed >= LOAD_DRAIN_TIMEOUT_MS) {
+			reportLoad();
+			loadMode = LOAD_IDLE;
+		}
+	}
+}
+
+void Tester::addLoadEvent() {
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_LOAD, ++loadSeq);
+	loadAdded++;
+}
+
+// Adds the counters since the run started as events. Events still in the log when the drain timed
+// out are neither dropped nor published.
+void Tester::reportLoad() {
+	ConnectionEventStats stats = ConnectionEvents::getInstance()->getStats();
+
+	int enqueued = (int)(stats.added - loadStartStats.added);
+	int dropped = (int)(stats.discarded - loadStartStats.discarded);
+	int published = (int)(stats.published - loadStartStats.published);
+	int bytes = (int)(stats.publishBytes - loadStartStats.publishBytes);
+
+	Log.info("load test enqueued=%d dropped=%d published=%d bytes=%d", enqueued, dropped, published, bytes);
 
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_LOAD_ENQUEUED, enqueued);
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_LOAD_DROPPED, dropped);
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_LOAD_PUBLISHED, published);
+	ConnectionEvents::addEvent(ConnectionEvents::CONNECTION_EVENT_TESTER_LOAD_BYTES, bytes);
 }
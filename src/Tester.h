@@ -3,7 +3,12 @@
 
 #include "Particle.h"
 
-class Tester {
+#include <atomic>
+
+#include "ConnectionEvents.h"
+#include "ModuleScheduler.h"
+
+class Tester : public ScheduledModule {
 public:
 	Tester(const char *functionName, int sleepTestPin = -1);
 	virtual ~Tester();
@@ -11,18 +16,66 @@ public:
 	void setup();
 	void loop();
 
+	unsigned long getMillisUntilNextLoop();
+
+	// Queues the command for loop(). Returns 0, or -1 if the queue is full and the command was dropped.
 	int functionHandler(String argStr);
 	void processOptions(char *mutableData);
 
+	// Commands queued and not run yet, the most there have been, and how many were dropped
+	size_t getCommandQueueDepth() const;
+	inline size_t getCommandQueueMaxDepth() const { return commandMaxDepth.load(std::memory_order_relaxed); };
+	inline uint32_t getCommandOverflows() const { return commandOverflows.load(std::memory_order_relaxed); };
+
 	static const size_t MAX_ARGS = 5;
+	static const size_t COMMAND_QUEUE_SIZE = 8; // Must be a power of 2
+	static const size_t COMMAND_MAX_LEN = 64; // Including the null terminator; longer commands are truncated
+	static const unsigned long LOAD_MAX_EVENTS = 10000; // Largest burst
+	static const unsigned long LOAD_MAX_RATE = 1000; // Events per second
+	static const unsigned long LOAD_MAX_SECS = 86400; // Longest rate or flood run
+	static const unsigned long LOAD_FLOOD_POLL_MS = 50; // How often a flood tops up the event log
+	static const unsigned long LOAD_DRAIN_POLL_MS = 250;
+	static const unsigned long LOAD_DRAIN_TIMEOUT_MS = 120000; // How long to wait for the log to be published before reporting
+
+	// What the load generator is doing
+	enum LoadMode {
+		LOAD_IDLE = 0,	// Not running
+		LOAD_RATE,		// Adding loadRate events per second
+		LOAD_FLOOD,		// Keeping the event log full, so it publishes as fast as it can
+		LOAD_DRAIN		// Done adding events, waiting for them to be published before reporting
+	};
 
 private:
+	void reportCommandQueue();
+	void loadCommand(size_t argc, const char **argv);
+	void startLoad(LoadMode mode, unsigned long durationMs);
+	void loadLoop();
+	void addLoadEvent();
+	void reportLoad();
+
 	const char *functionName;
 	int sleepTestPin;
-	char *functionData = NULL;
+
+	// Commands from functionHandler(), which runs on the system thread, to loop(). There's one
+	// producer and one consumer, so the free-running head and tail counters are enough: the
+	// producer only writes commandHead and the slot at it, the consumer only writes commandTail.
+	char commandSlots[COMMAND_QUEUE_SIZE][COMMAND_MAX_LEN];
+	std::atomic<uint32_t> commandHead; // Next slot to write
+	std::atomic<uint32_t> commandTail; // Next slot to run
+	std::atomic<uint32_t> commandMaxDepth;
+	std::atomic<uint32_t> commandOverflows;
+	uint32_t reportedOverflows = 0; // commandOverflows when a TESTER_QUEUE event was last added
 	unsigned long lastPing = 0;
 	int pingInterval = 0;
 	int pingCounter = 0;
+
+	LoadMode loadMode = LOAD_IDLE;
+	unsigned long loadStartMs = 0; // millis() value when the run or the drain started
+	unsigned long loadDurationMs = 0;
+	unsigned long loadRate = 0; // Events per second for LOAD_RATE
+	unsigned long loadAdded = 0; // Events added by this run
+	int loadSeq = 0; // Data for CONNECTION_EVENT_TESTER_LOAD, so they're not collapsed as repeats
+	ConnectionEventStats loadStartStats = {};
 };
 
 #endif // __TESTER_H